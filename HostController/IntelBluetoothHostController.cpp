@@ -21,6 +21,7 @@
  */
 
 #include <sys/proc.h>
+#include <libkern/OSAtomic.h>
 #include "IntelBluetoothHostController.h"
 #include "../Transports/Gen1/IntelGen1BluetoothHostControllerUSBTransport.h"
 #include "../Transports/Gen2/IntelGen2BluetoothHostControllerUSBTransport.h"
@@ -28,86 +29,39 @@
 
 IOReturn ParseIntelVendorSpecificCommand(UInt16 ocf, UInt8 * inData, UInt32 inDataSize, UInt8 * outData, UInt32 * outDataSize, UInt8 * outStatus)
 {
+    const BluetoothIntelOpCodeInfo * info;
+    BluetoothIntelResponseLayout layout;
+
     if ( !inData || !outData || !outDataSize || !outStatus )
         return kIOReturnBadArgument;
 
-    switch ( ocf )
-    {
-        case kBluetoothHCIIntelCommandReadBootParams:
-            if ( inDataSize != sizeof(BluetoothIntelBootParams) + 1 )
-                return kIOReturnBadArgument;
-
-            *outDataSize = sizeof(BluetoothIntelBootParams);
-            if ( UnpackData(inDataSize, inData, "bbbbHbbbbbb^bbbbb", outStatus, outData, outData + 1, outData + 2, outData + 3, outData + 5, outData + 6, outData + 7, outData + 8, outData + 9, outData + 10, outData + 11, outData + 17, outData + 18, outData + 19, outData + 20, outData + 21) == -1 )
-                return kIOReturnBadArgument;
-            return kIOReturnSuccess;
-
-        case kBluetoothHCIIntelCommandReadOffloadUseCases:
-            if ( inDataSize != sizeof(BluetoothIntelOffloadUseCases) + 1 )
-                return kIOReturnBadArgument;
-
-            *outDataSize = sizeof(BluetoothIntelOffloadUseCases);
-            if ( UnpackData(inDataSize, inData, "bn", outStatus, 8, outData) == -1 )
-                return kIOReturnBadArgument;
-            return kIOReturnSuccess;
-
-        case kBluetoothHCIIntelCommandReadExceptionInfo:
-            if ( inDataSize != sizeof(BluetoothIntelExceptionInfo) + 1 )
-                return kIOReturnBadArgument;
+    info = IntelLookupVendorCommand(ocf);
+    layout = info ? info->layout : kBluetoothIntelResponseLayoutRaw;
 
-            *outDataSize = sizeof(BluetoothIntelExceptionInfo);
-            if ( UnpackData(inDataSize, inData, "bn", outStatus, 12, outData) == -1 )
-                return kIOReturnBadArgument;
+    switch ( layout )
+    {
+        case kBluetoothIntelResponseLayoutNone:
+            *outDataSize = 0;
             return kIOReturnSuccess;
 
-        case kBluetoothHCIIntelCommandReadDebugFeatures:
-            if ( inDataSize != sizeof(BluetoothIntelDebugFeatures) + 1 )
+        case kBluetoothIntelResponseLayoutStatus:
+            if ( inDataSize < 1 )
                 return kIOReturnBadArgument;
-            *outDataSize = sizeof(BluetoothIntelDebugFeatures);
-            if ( UnpackData(inDataSize, inData, "bbbn", outStatus, outData, outData + 1, 16, outData + 2) == -1 )
-                return kIOReturnBadArgument;
-            return kIOReturnSuccess;
-
-        case kBluetoothHCIIntelCommandReadVersionInfo:
-            if ( inDataSize == sizeof(BluetoothIntelVersionInfo) + 1 )
-            {
-                *outDataSize = sizeof(BluetoothIntelVersionInfo);
-                if ( UnpackData(inDataSize, inData, "bbbbbbbbbb", outStatus, outData, outData + 1, outData + 2, outData + 3, outData + 4, outData + 5, outData + 6, outData + 7, outData + 8) == -1 )
-                    return kIOReturnBadArgument;
-                return kIOReturnSuccess;
-            }
-            if ( UnpackData(inDataSize, inData, "b", outStatus) != -1 )
-            {
-                if ( UnpackData(inDataSize, inData, "b", outStatus) == -1 )
-                    return kIOReturnBadArgument;
-                *outDataSize = inDataSize - 1;
-                memmove(outData, inData + 1, inDataSize - 1);
-                return kIOReturnSuccess;
-            }
-            return kIOReturnBadArgument;
-
-        case kBluetoothHCIIntelCommandWriteBootParams:
-        case kBluetoothHCIIntelCommandWriteDeviceAddress:
-        case kBluetoothHCIIntelCommandWriteConfigDDC:
-        case kBluetoothHCIIntelCommandSecureSend:
-        case kBluetoothHCIIntelCommandReset:
-        case kBluetoothHCIIntelCommandSWRFKill:
-        case kBluetoothHCIIntelCommandSetLinkStatsTracing:
-        case kBluetoothHCIIntelCommandActivateTraces:
-        case kBluetoothHCIIntelCommandSetEventMask:
-        case kBluetoothHCIIntelCommandManufacturerMode:
-        case kBluetoothHCIIntelCommandWriteMemory:
-        case 0x0060:
+            *outStatus = inData[0];
             *outDataSize = 0;
-            if ( UnpackData(inDataSize, inData, "b", outStatus) == -1 )
-                return kIOReturnBadArgument;
             return kIOReturnSuccess;
 
-        case kBluetoothHCIIntelCommandWriteBDData:
-            *outDataSize = 0;
+        case kBluetoothIntelResponseLayoutStatusData:
+            if ( inDataSize < 1 || inDataSize - 1 < info->minSize || inDataSize - 1 > info->maxSize )
+                return kIOReturnBadArgument;
+            *outStatus = inData[0];
+            *outDataSize = inDataSize - 1;
+            memmove(outData, inData + 1, inDataSize - 1);
             return kIOReturnSuccess;
 
         default:
+            if ( inDataSize > kIntelCommandMaxParamLength )
+                return kIOReturnBadArgument;
             *outDataSize = inDataSize;
             memmove(outData, inData, inDataSize);
             return kIOReturnSuccess;
@@ -117,8 +71,64 @@ IOReturn ParseIntelVendorSpecificCommand(UInt16 ocf, UInt8 * inData, UInt32 inDa
 #define super IOBluetoothHostController
 OSDefineMetaClassAndStructors(IntelBluetoothHostController, super)
 
+/* Guards the class-static stores shared by every controller instance.
+ * Kext global constructors run at load, before any instance exists.
+ */
+class IntelBluetoothSharedStoreLock
+{
+public:
+    IntelBluetoothSharedStoreLock() : mLock(IOLockAlloc()) {}
+    ~IntelBluetoothSharedStoreLock() { if ( mLock ) IOLockFree(mLock); }
+
+    void Lock() { if ( mLock ) IOLockLock(mLock); }
+    void Unlock() { if ( mLock ) IOLockUnlock(mLock); }
+
+private:
+    IOLock * mLock;
+};
+
+static IntelBluetoothSharedStoreLock sSharedStoreLock;
+
+/* A hard reset re-enumerates the device and creates a new controller
+ * instance, so recordings and recovery times have to outlive it.
+ */
+BluetoothIntelConfigRecording IntelBluetoothHostController::sConfigRecordings[kIntelConfigRecordingSlots];
+UInt32 IntelBluetoothHostController::sConfigRecordingCount = 0;
+AbsoluteTime IntelBluetoothHostController::sHardResetTime = 0;
+BluetoothIntelRecoveryStatistics IntelBluetoothHostController::sRecoveryStatistics;
+BluetoothIntelTeardownStatistics IntelBluetoothHostController::sTeardownStatistics;
+BluetoothIntelRequestPoolStatistics IntelBluetoothHostController::sRequestPoolStatistics;
+BluetoothIntelCommandPackingStatistics IntelBluetoothHostController::sCommandPackingStatistics;
+BluetoothIntelResponseDecodingStatistics IntelBluetoothHostController::sResponseDecodingStatistics;
+BluetoothIntelDDCDefaults IntelBluetoothHostController::sDDCDefaults;
+BluetoothIntelWaitStatistics IntelBluetoothHostController::sWaitStatistics[kBluetoothIntelWaitCount];
+
+const BluetoothIntelSetupStatePolicy IntelBluetoothHostController::sSetupStatePolicies[kBluetoothIntelSetupStateCount] =
+{
+    /* name, retries, budget (ms), retry from, once out of retries */
+    { "Idle",            0, 0,     kBluetoothIntelSetupStateIdle,            kBluetoothIntelSetupStateFailed    },
+    { "HCIReset",        1, 1000,  kBluetoothIntelSetupStateHCIReset,        kBluetoothIntelSetupStateFailed    },
+    { "WarmResume",      0, 0,     kBluetoothIntelSetupStateWarmResume,      kBluetoothIntelSetupStateFailed    },
+    { "ReadVersionInfo", 2, 1000,  kBluetoothIntelSetupStateReadVersionInfo, kBluetoothIntelSetupStateFailed    },
+    { "LoadFirmware",    1, 15000, kBluetoothIntelSetupStateReadVersionInfo, kBluetoothIntelSetupStateFailed    },
+    { "PostBootConfig",  2, 5000,  kBluetoothIntelSetupStatePostBootConfig,  kBluetoothIntelSetupStateFailed    },
+    { "Fingerprint",     0, 0,     kBluetoothIntelSetupStateFingerprint,     kBluetoothIntelSetupStateFailed    },
+    { "EventMask",       0, 0,     kBluetoothIntelSetupStateEventMask,       kBluetoothIntelSetupStateFailed    },
+    { "GeneralSetup",    1, 2000,  kBluetoothIntelSetupStateGeneralSetup,    kBluetoothIntelSetupStateHardReset },
+    { "HardReset",       0, 0,     kBluetoothIntelSetupStateHardReset,       kBluetoothIntelSetupStateFailed    },
+    { "Done",            0, 0,     kBluetoothIntelSetupStateDone,            kBluetoothIntelSetupStateDone      },
+    { "Failed",          0, 0,     kBluetoothIntelSetupStateFailed,          kBluetoothIntelSetupStateFailed    }
+};
+
 bool IntelBluetoothHostController::init(IOBluetoothHCIController * family, IOBluetoothHostControllerTransport * transport)
 {
+    OSBoolean * concurrentSetupSteps;
+    OSBoolean * deferFirmwareUpgrade;
+    OSBoolean * fastRadioToggle;
+    OSBoolean * verboseCommandDiagnostics;
+    OSBoolean * measureCommandOverhead;
+    OSBoolean * suppressRepeatCommands;
+
     CreateOSLogObject();
     if ( !super::init(family, transport) )
         return false;
@@ -126,6 +136,7 @@ bool IntelBluetoothHostController::init(IOBluetoothHCIController * family, IOBlu
     if ( !mExpansionData )
         return false;
     mVersionInfo = IONewZero(UInt8, kMaxHCIBufferLength * 4);
+    mCachedVersionInfoTLV = IONewZero(UInt8, kMaxHCIBufferLength * 4);
 
     mValidLEStates = false;
     mStrictDuplicateFilter = true;
@@ -139,12 +150,182 @@ bool IntelBluetoothHostController::init(IOBluetoothHCIController * family, IOBlu
     mFirmwareLoaded = false;
     mFirmwareLoadingFailed = false;
     mQualityReportSet = true;
+    mDDCSyncMode = true;
+    mDDCBatchWrites = true;
+    bzero(mDDCCache, sizeof(mDDCCache));
+    bzero(mDDCStatistics, sizeof(mDDCStatistics));
+    mDDCBootDefaults = false;
+    bzero(&mBootupEvent, sizeof(mBootupEvent));
+    mBootupEventValid = false;
+    bzero(mResetHistory, sizeof(mResetHistory));
+    mResetHistoryCount = 0;
+    mWatchdogResetCount = 0;
+    mExceptionResetCount = 0;
+    bzero(mBootProfiles, sizeof(mBootProfiles));
+    mCurrentBootProfile = NULL;
+    mBootProfileStartTime = 0;
+    mBootProfileCount = 0;
+
+    /* Post-boot setup steps run concurrently unless the transport
+     * personality sets ConcurrentSetupSteps to false.
+     */
+    mConcurrentSetupSteps = true;
+    concurrentSetupSteps = OSDynamicCast(OSBoolean, transport->getProperty("ConcurrentSetupSteps"));
+    if ( concurrentSetupSteps )
+        mConcurrentSetupSteps = concurrentSetupSteps->isTrue();
+    mSetupEventMaskSet = false;
+    mSetupStepsRunning = 0;
+    bzero(mSetupSteps, sizeof(mSetupSteps));
+    mIdentityEpoch = 0;
+    bzero(mIdentityCache, sizeof(mIdentityCache));
+    bzero(&mCachedVersionInfo, sizeof(mCachedVersionInfo));
+    bzero(&mCachedBootParams, sizeof(mCachedBootParams));
+    mIdentityCacheHits = 0;
+    mIdentityCacheMisses = 0;
+    mIdentityCacheInvalidations = 0;
+    mBootloaderResetPending = false;
+    mTransportTerminating = false;
+    bzero(&mFingerprint, sizeof(mFingerprint));
+    mFingerprintValid = false;
+    mDDCConfigData = NULL;
+    bzero(&mWarmResumeStatistics, sizeof(mWarmResumeStatistics));
+    mSetupState = kBluetoothIntelSetupStateIdle;
+    mSetupResult = kIOReturnSuccess;
+    mSetupHardReset = false;
+    mPostBootConfigPending = false;
+    bzero(mSetupStateRetries, sizeof(mSetupStateRetries));
+    bzero(mSetupStateTime, sizeof(mSetupStateTime));
+    bzero(mSetupStateStatistics, sizeof(mSetupStateStatistics));
+    bzero(&mBootParams, sizeof(mBootParams));
+    bzero(&mBootloaderVersionInfo, sizeof(mBootloaderVersionInfo));
+    bzero(&mBootloaderVersionInfoTLV, sizeof(mBootloaderVersionInfoTLV));
+    mConfigRecording = IONewZero(BluetoothIntelConfigRecording, 1);
+    mConfigRecordingActive = false;
+    mConfigReplayed = false;
+
+    /* Outdated operational firmware is reflashed during setup unless the
+     * transport personality sets DeferFirmwareUpgrade to true.
+     */
+    mDeferFirmwareUpgrade = false;
+    deferFirmwareUpgrade = OSDynamicCast(OSBoolean, transport->getProperty("DeferFirmwareUpgrade"));
+    if ( deferFirmwareUpgrade )
+        mDeferFirmwareUpgrade = deferFirmwareUpgrade->isTrue();
+    bzero(&mFirmwareUpgrade, sizeof(mFirmwareUpgrade));
+    mFirmwareUpgradeDeferTime = 0;
+    mFirmwareUpgradeThreadCall = NULL;
+    mActiveConnections = 0;
+    mHardwareVariantInfo = NULL;
+    mManufacturerModeDepth = 0;
+    mManufacturerModeResetOption = kBluetoothIntelManufacturingExitResetOptionsNoReset;
+
+    /* The radio is toggled with SW RF kill unless the transport
+     * personality sets FastRadioToggle to false.
+     */
+    mFastRadioToggle = true;
+    fastRadioToggle = OSDynamicCast(OSBoolean, transport->getProperty("FastRadioToggle"));
+    if ( fastRadioToggle )
+        mFastRadioToggle = fastRadioToggle->isTrue();
+    mRadioKilled = false;
+    mRadioOffTime = 0;
+    bzero(&mRadioToggleStatistics, sizeof(mRadioToggleStatistics));
+
+    mRequestPoolLock = IOLockAlloc();
+    if ( !mRequestPoolLock )
+        return false;
+    bzero(mRequestPool, sizeof(mRequestPool));
+    mRequestPoolCount = 0;
+    mRequestLeases = 0;
+
+    /* Opcode and process names are resolved for every command only when
+     * the transport personality sets VerboseCommandDiagnostics to true.
+     */
+    mVerboseCommandDiagnostics = false;
+    verboseCommandDiagnostics = OSDynamicCast(OSBoolean, transport->getProperty("VerboseCommandDiagnostics"));
+    if ( verboseCommandDiagnostics )
+        mVerboseCommandDiagnostics = verboseCommandDiagnostics->isTrue();
+    mMeasureCommandOverhead = false;
+    measureCommandOverhead = OSDynamicCast(OSBoolean, transport->getProperty("MeasureCommandOverhead"));
+    if ( measureCommandOverhead )
+        mMeasureCommandOverhead = measureCommandOverhead->isTrue();
+    bzero(&mCommandOverheadStatistics, sizeof(mCommandOverheadStatistics));
+    bzero((void *) mCommandLatency, sizeof(mCommandLatency));
+    mStatisticsThreadCall = thread_call_allocate(StatisticsThreadCall, this);
+    if ( !mStatisticsThreadCall )
+        return false;
+    mStatisticsPublishPending = false;
+    mInteractiveCommands = 0;
+    mCommandLaneLock = IOLockAlloc();
+    if ( !mCommandLaneLock )
+        return false;
+    bzero(mCommandLaneStatistics, sizeof(mCommandLaneStatistics));
+    bzero(mAsyncLanes, sizeof(mAsyncLanes));
+    mProcessAccountingLock = IOLockAlloc();
+    if ( !mProcessAccountingLock )
+        return false;
+    bzero(mProcessAccounting, sizeof(mProcessAccounting));
+    mProcessAccountingDecayTime = 0;
+
+    /* Byte-identical repeats of idempotent commands are completed without
+     * the controller only when the transport personality sets
+     * SuppressRepeatCommands to true.
+     */
+    mSuppressRepeatCommands = false;
+    suppressRepeatCommands = OSDynamicCast(OSBoolean, transport->getProperty("SuppressRepeatCommands"));
+    if ( suppressRepeatCommands )
+        mSuppressRepeatCommands = suppressRepeatCommands->isTrue();
+    mCommandCacheLock = IOLockAlloc();
+    if ( !mCommandCacheLock )
+        return false;
+    bzero(mCommandCache, sizeof(mCommandCache));
+    bzero(&mCommandCacheStatistics, sizeof(mCommandCacheStatistics));
+
+    mRecordedResponses = IONewZero(BluetoothIntelRecordedResponse, kIntelRecordedResponseSlots);
+    mRecordedResponseCount = 0;
     return true;
 }
 
 void IntelBluetoothHostController::free()
 {
+    if ( mFirmwareUpgradeThreadCall )
+    {
+        thread_call_cancel_wait(mFirmwareUpgradeThreadCall);
+        thread_call_free(mFirmwareUpgradeThreadCall);
+        mFirmwareUpgradeThreadCall = NULL;
+    }
+    if ( mStatisticsThreadCall )
+    {
+        thread_call_cancel_wait(mStatisticsThreadCall);
+        thread_call_free(mStatisticsThreadCall);
+        mStatisticsThreadCall = NULL;
+    }
+    ReapSetupStepThreadCalls(true);
     IOSafeDeleteNULL(mVersionInfo, UInt8, kMaxHCIBufferLength * 4);
+    IOSafeDeleteNULL(mCachedVersionInfoTLV, UInt8, kMaxHCIBufferLength * 4);
+    OSSafeReleaseNULL(mDDCConfigData);
+    IOSafeDeleteNULL(mConfigRecording, BluetoothIntelConfigRecording, 1);
+    IOSafeDeleteNULL(mRecordedResponses, BluetoothIntelRecordedResponse, kIntelRecordedResponseSlots);
+    if ( mRequestPoolLock )
+    {
+        DrainRequestPool();
+        sRequestPoolStatistics.leaked += mRequestLeases;
+        IOLockFree(mRequestPoolLock);
+        mRequestPoolLock = NULL;
+    }
+    if ( mCommandLaneLock )
+    {
+        IOLockFree(mCommandLaneLock);
+        mCommandLaneLock = NULL;
+    }
+    if ( mProcessAccountingLock )
+    {
+        IOLockFree(mProcessAccountingLock);
+        mProcessAccountingLock = NULL;
+    }
+    if ( mCommandCacheLock )
+    {
+        IOLockFree(mCommandCacheLock);
+        mCommandCacheLock = NULL;
+    }
     IOSafeDeleteNULL(mExpansionData, ExpansionData, 1);
     super::free();
 }
@@ -169,19 +350,36 @@ bool IntelBluetoothHostController::InitializeController()
 IOReturn IntelBluetoothHostController::SendHCIRequestFormatted(BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, IOByteCount outResultsSize, void * outResultsPtr, const char * inFormat, ...)
 {
     va_list va;
+    IOReturn err;
+
+    va_start(va, inFormat);
+    err = SendHCIRequestCommon(inID, inOpCode, outResultsSize, outResultsPtr, NULL, 0, inFormat, &va);
+    va_end(va);
+
+    return err;
+}
+
+IOReturn IntelBluetoothHostController::SendHCIRequestPacked(BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, IOByteCount outResultsSize, void * outResultsPtr, const UInt8 * command, IOByteCount commandSize)
+{
+    return SendHCIRequestCommon(inID, inOpCode, outResultsSize, outResultsPtr, command, commandSize, NULL, NULL);
+}
+
+IOReturn IntelBluetoothHostController::SendHCIRequestCommon(BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, IOByteCount outResultsSize, void * outResultsPtr, const UInt8 * command, IOByteCount commandSize, const char * inFormat, va_list * va)
+{
     IOReturn err = kIOReturnSuccess;
     BluetoothHCIRequestID id;
     IOBluetoothHCIRequest * request;
     IOBluetoothHCIControllerInternalPowerState state;
     int PID = 0xFF;
-    char processName[0x100];
-    char opStr[100];
-    char errStrLong[100];
-    char errStrShort[50];
+    char processName[MAXCOMLEN + 1] = "Unknown";
+    UInt64 time = 0;
+    UInt64 overhead = 0;
+    UInt64 enqueueTime;
+    UInt64 laneWaitTime;
+    BluetoothIntelCommandLane lane;
 
-    va_start(va, inFormat);
-    snprintf(processName, 0x100, "Unknown");
-    mBluetoothFamily->ConvertOpCodeToString(inOpCode, opStr);
+    if ( mMeasureCommandOverhead )
+        time = mach_absolute_time();
 
     if ( mSupportNewIdlePolicy )
         ChangeIdleTimerTime((char *) __FUNCTION__, mIdleTimerTime);
@@ -196,17 +394,25 @@ IOReturn IntelBluetoothHostController::SendHCIRequestFormatted(BluetoothHCIReque
     request->RetainRequest((char *) "IntelBluetoothHostController::SendHCIRequestFormatted -- at the beginning");
     request->InitializeRequest();
     PID = request->mPID;
-    proc_name(PID, processName, 0x100);
+
+    /* Names are only resolved up front in the verbose diagnostic mode,
+     * otherwise LogHCIRequestError looks them up when something fails.
+     */
+    if ( mVerboseCommandDiagnostics )
+        proc_name(PID, processName, sizeof(processName));
 
     if ( inOpCode == BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLESetAdvertisingData) )
         UpdateLESetAdvertisingDataReporter(request);
 
     if ( !mBluetoothTransport || mBluetoothTransport->isInactive() )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] -- Transport is inactive -- inOpCode = 0x%04X (%s), From: %s (%d), mNumberOfCommandsAllowedByHardware is %d, requestPtr = 0x%04x -- this = 0x%04x ****\n", inOpCode, opStr, processName, PID, mNumberOfCommandsAllowedByHardware, ConvertAddressToUInt32(request), ConvertAddressToUInt32(this));
+        LogHCIRequestError("Transport is inactive", inID, inOpCode, PID, kIOReturnSuccess);
         goto OVER_RELEASE;
     }
 
+    /* TransportRadioPowerOff logs the sender when it rejects the command. */
+    if ( !mVerboseCommandDiagnostics && mBluetoothTransport->GetRadioPowerState() == kRadioPoweredOff )
+        proc_name(PID, processName, sizeof(processName));
     if ( TransportRadioPowerOff(inOpCode, processName, PID, request) )
         goto OVER_RELEASE;
 
@@ -214,9 +420,17 @@ IOReturn IntelBluetoothHostController::SendHCIRequestFormatted(BluetoothHCIReque
         request->SetResultsBufferPtrAndSize((UInt8 *) outResultsPtr, outResultsSize);
 
     request->mOpCode = inOpCode;
-    request->mCommandBufferSize = PackDataList(request->mCommandBuffer, sizeof(request->mCommandBuffer), inFormat, va);
-
     err = kIOReturnError;
+    if ( command )
+    {
+        if ( commandSize > kMaxHCIBufferLength || commandSize > sizeof(request->mCommandBuffer) )
+            goto OVER_RELEASE;
+        memcpy(request->mCommandBuffer, command, commandSize);
+        request->mCommandBufferSize = commandSize;
+    }
+    else
+        request->mCommandBufferSize = PackDataList(request->mCommandBuffer, sizeof(request->mCommandBuffer), inFormat, *va);
+
     if ( request->mCommandBufferSize > kMaxHCIBufferLength )
         goto OVER_RELEASE;
 
@@ -233,21 +447,42 @@ IOReturn IntelBluetoothHostController::SendHCIRequestFormatted(BluetoothHCIReque
         if ( inOpCode == BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLEStartEncryption) )
             request->mConnectionHandle = *(BluetoothConnectionHandle *) (request->mCommandBuffer + 3);
 
+        if ( inOpCode == BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupHostController, kBluetoothHCICommandReset) || inOpCode == BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupVendorSpecific, kBluetoothHCIIntelCommandReset) )
+        {
+            /* No link survives a reset, and no disconnection event is sent for them. */
+            mActiveConnections = 0;
+            InvalidateCommandCache("Reset");
+        }
+        else if ( mSuppressRepeatCommands && !request->mAsyncNotify && CompleteCachedCommand(request, outResultsSize, outResultsPtr) )
+        {
+            /* A local completion is not dispatch overhead. */
+            time = 0;
+            err = kIOReturnSuccess;
+            goto OVER_RELEASE;
+        }
+
+        if ( time )
+        {
+            overhead = mach_absolute_time() - time;
+            time = 0;
+        }
+
+        lane = IntelLookupCommandLane(inOpCode);
+        laneWaitTime = EnterCommandLane(lane);
+
+        enqueueTime = mach_absolute_time();
         err = EnqueueRequest(request);
         if ( err != 99 )
         {
             if ( err )
-            {
-              mBluetoothFamily->ConvertErrorCodeToString(err, errStrLong, errStrShort);
-              os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] ### ERROR: EnqueueRequest failed (err=0x%x (%s)) for opCode 0x%04x (%s) ****\n", err, errStrLong, inOpCode, opStr);
-            }
+                LogHCIRequestError("EnqueueRequest failed", inID, inOpCode, PID, err);
 
             err = EnqueueRequestForController(request);
             if ( err )
             {
                 AbortRequestAndSetTime(request);
-                mBluetoothFamily->ConvertErrorCodeToString(err, errStrLong, errStrShort);
-                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] ### ERROR: EnqueueRequestForController failed (err=0x%x (%s)) for opCode 0x%04x (%s) ****\n", err, errStrLong, inOpCode, opStr);
+                LogHCIRequestError("EnqueueRequestForController failed", inID, inOpCode, PID, err);
+                ExitCommandLane(lane, laneWaitTime, 0);
                 goto OVER_RELEASE;
             }
         }
@@ -265,12 +500,32 @@ IOReturn IntelBluetoothHostController::SendHCIRequestFormatted(BluetoothHCIReque
         }
 
         request->Start();
+        if ( mMeasureCommandOverhead )
+            time = mach_absolute_time();
         err = request->mStatus;
+
+        /* An asynchronous request is still in flight at this point. */
+        if ( request->mAsyncNotify )
+            DeferCommandLaneExit(lane, inOpCode, laneWaitTime, enqueueTime);
+        else
+            ExitCommandLane(lane, laneWaitTime, mach_absolute_time() - enqueueTime);
+
+        if ( !request->mAsyncNotify )
+        {
+            RecordCommandLatency(inOpCode, mach_absolute_time() - enqueueTime, err, request->mState == kHCIRequestStateWaiting);
+            RecordProcessCommand(PID, request->mCommandBufferSize, mach_absolute_time() - enqueueTime, request->mState == kHCIRequestStateWaiting);
+        }
+        else
+            RecordProcessCommand(PID, request->mCommandBufferSize, 0, false);
+
+        if ( mSuppressRepeatCommands )
+            UpdateCommandCache(request, request->mAsyncNotify ? kIOReturnNotReady : err);
+
         if ( err <= kBluetoothSyncHCIRequestTimedOutWaitingToBeSent )
         {
             if ( err == kBluetoothSyncHCIRequestTimedOutWaitingToBeSent && !mBusyQueueHead )
             {
-                BluetoothFamilyLogPacket(mBluetoothFamily, 249, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] -- requestPtr->Start() returned kBluetoothSyncHCIRequestTimedOutWaitingToBeSent but mBusyQueueHead is NULL -- inID = %d, opCode = 0x%04x (%s), mNumberOfCommandsAllowedByHardware is %d ****\n", inID, inOpCode, opStr, mNumberOfCommandsAllowedByHardware);
+                BluetoothFamilyLogPacket(mBluetoothFamily, 249, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] -- requestPtr->Start() returned kBluetoothSyncHCIRequestTimedOutWaitingToBeSent but mBusyQueueHead is NULL -- inID = %d, opCode = 0x%04x, mNumberOfCommandsAllowedByHardware is %d ****\n", inID, inOpCode, mNumberOfCommandsAllowedByHardware);
             }
             if ( request->mState == kHCIRequestStateWaiting )
             {
@@ -294,167 +549,943 @@ OVER:
     if ( mSupportNewIdlePolicy )
         ChangeIdleTimerTime((char *) __FUNCTION__, mIdleTimerTime);
 
-    va_end(va);
+    if ( time )
+        RecordCommandOverhead(overhead + mach_absolute_time() - time);
+
     return err;
 }
 
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
-IOReturn IntelBluetoothHostController::SetupController(bool * hardReset)
-#else
-IOReturn IntelBluetoothHostController::SetupController()
-#endif
+void IntelBluetoothHostController::LogHCIRequestError(const char * message, BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, int PID, IOReturn err)
 {
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupController] -- Starting setup routine... ****\n");
+    char processName[MAXCOMLEN + 1] = "Unknown";
+    char opStr[100];
+    char errStrLong[100];
+    char errStrShort[50];
 
-    IOReturn err;
-    setConfigState(kIOBluetoothHCIControllerConfigStateKernelSetupPending);
+    mBluetoothFamily->ConvertOpCodeToString(inOpCode, opStr);
+    proc_name(PID, processName, sizeof(processName));
 
-    /* Some controllers have a bug with the first HCI command sent to it
-     * returning number of completed commands as zero. This would stall the
-     * command processing in the Bluetooth core.
-     *
-     * As a workaround, send HCI Reset command first which will reset the
-     * number of completed commands and allow normal command processing.
-     */
+    if ( !err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] -- %s -- inID = %d, inOpCode = 0x%04X (%s), From: %s (%d), mNumberOfCommandsAllowedByHardware is %d -- this = 0x%04x ****\n", message, inID, inOpCode, opStr, processName, PID, mNumberOfCommandsAllowedByHardware, ConvertAddressToUInt32(this));
+        return;
+    }
+
+    mBluetoothFamily->ConvertErrorCodeToString(err, errStrLong, errStrShort);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendHCIRequestFormatted] ### ERROR: %s (err=0x%x (%s)) for opCode 0x%04x (%s), From: %s (%d) ****\n", message, err, errStrLong, inOpCode, opStr, processName, PID);
+}
+
+void IntelBluetoothHostController::RecordCommandLatency(BluetoothHCICommandOpCode opCode, UInt64 latency, IOReturn status, bool timedOut)
+{
+    BluetoothIntelCommandLatency * slot = &mCommandLatency[IntelLookupCommandLatencySlot(opCode)];
+    UInt64 elapsed;
+    UInt64 max;
+    UInt64 deadline;
+
+    absolutetime_to_nanoseconds(latency, &elapsed);
+    elapsed /= NSEC_PER_USEC;
+
+    OSIncrementAtomic(&slot->count);
+    OSIncrementAtomic(&slot->buckets[IntelLatencyHistogramBucket(elapsed)]);
+    if ( timedOut )
+        OSIncrementAtomic(&slot->timeouts);
+    else if ( status )
+        OSIncrementAtomic(&slot->errors);
+
+    do
+    {
+        max = slot->maxLatency;
+        if ( elapsed <= max )
+            break;
+    } while ( !OSCompareAndSwap64(max, elapsed, &slot->maxLatency) );
 
-    if ( mProductID == 2012 )
+    /* Building the dictionaries is left off the send path. */
+    if ( OSCompareAndSwap(false, true, &mStatisticsPublishPending) )
     {
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_11_0
-        err = CallBluetoothHCIReset(false, (char *) __FUNCTION__);
-#else
-        err = CallBluetoothHCIReset(false);
-#endif
-        if ( err )
-        {
-            REQUIRE_NO_ERR(err);
-            return err;
-        }
+        clock_interval_to_deadline(kIntelStatisticsPublishInterval, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(mStatisticsThreadCall, deadline);
+    }
+}
+
+void IntelBluetoothHostController::StatisticsThreadCall(thread_call_param_t owner, thread_call_param_t arg)
+{
+    IntelBluetoothHostController * that = (IntelBluetoothHostController *) owner;
+
+    /* Commands recorded from now on schedule the next publication. */
+    that->mStatisticsPublishPending = false;
+    that->PublishCommandLatencyStatistics();
+    that->PublishCommandLaneStatistics();
+    that->PublishProcessAccounting();
+}
+
+bool IntelBluetoothHostController::CompleteCachedCommand(IOBluetoothHCIRequest * request, IOByteCount outResultsSize, void * outResultsPtr)
+{
+    BluetoothIntelCommandCacheSlot slot = IntelLookupCommandCacheSlot(request->mOpCode);
+    BluetoothIntelCommandCacheEntry * entry;
+    bool publish;
+
+    if ( slot >= kBluetoothIntelCommandCacheSlotCount )
+        return false;
+
+    IOLockLock(mCommandCacheLock);
+    entry = &mCommandCache[slot];
+    if ( !entry->valid || request->mCommandBufferSize != kBluetoothHCICommandPacketHeaderSize + entry->paramSize || memcmp(request->mCommandBuffer + kBluetoothHCICommandPacketHeaderSize, entry->params, entry->paramSize) )
+    {
+        ++mCommandCacheStatistics.misses;
+        IOLockUnlock(mCommandCacheLock);
+        return false;
     }
+    ++mCommandCacheStatistics.roundTripsSaved;
+    publish = !(mCommandCacheStatistics.roundTripsSaved % kIntelCommandLatencySamples);
+    IOLockUnlock(mCommandCacheLock);
 
-    setConfigState(kIOBluetoothHCIControllerConfigStateKernelPostResetSetupPending);
+    /* The only return parameter of these commands is the status. */
+    if ( outResultsPtr && outResultsSize )
+        *(UInt8 *) outResultsPtr = kBluetoothHCIErrorSuccess;
+    request->mStatus = kIOReturnSuccess;
 
-    /* Starting from TyP devices, the command parameter and response are
-     * changed even though the OCF for HCI_Intel_Read_Version command
-     * remains same. The legacy devices can handle even if the command
-     * has a parameter and returns a correct version information. So,
-     * the new format is used to support both legacy and new devices.
+    if ( publish )
+        PublishCommandCacheStatistics();
+    return true;
+}
+
+void IntelBluetoothHostController::UpdateCommandCache(IOBluetoothHCIRequest * request, IOReturn status)
+{
+    BluetoothIntelCommandCacheSlot slot = IntelLookupCommandCacheSlot(request->mOpCode);
+    BluetoothIntelCommandCacheEntry * entry;
+    IOByteCount paramSize;
+
+    if ( slot >= kBluetoothIntelCommandCacheSlotCount )
+        return;
+
+    /* What the controller holds after a failed or still pending command
+     * is not known.
      */
-    err = CallBluetoothHCIIntelReadVersionInfo(0xFF);
-    if ( err )
-        return err;
+    IOLockLock(mCommandCacheLock);
+    entry = &mCommandCache[slot];
+    paramSize = request->mCommandBufferSize - kBluetoothHCICommandPacketHeaderSize;
+    entry->valid = !status && request->mCommandBufferSize >= kBluetoothHCICommandPacketHeaderSize && paramSize <= kIntelCommandCacheMaxParamLength;
+    if ( entry->valid )
+    {
+        entry->paramSize = paramSize;
+        memcpy(entry->params, request->mCommandBuffer + kBluetoothHCICommandPacketHeaderSize, paramSize);
+    }
+    IOLockUnlock(mCommandCacheLock);
+}
 
-    BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) mVersionInfo;
+void IntelBluetoothHostController::InvalidateCommandCache(const char * reason)
+{
+    bool cached = false;
 
-    if ( version->hardwarePlatform == 0x37 )
+    IOLockLock(mCommandCacheLock);
+    for ( int i = 0; i < kBluetoothIntelCommandCacheSlotCount; ++i )
     {
-        PrintVersionInfo(version);
+        cached |= mCommandCache[i].valid;
+        mCommandCache[i].valid = false;
+    }
+    if ( cached )
+        ++mCommandCacheStatistics.invalidations;
+    IOLockUnlock(mCommandCacheLock);
+    if ( !cached )
+        return;
 
-        switch ( version->hardwareVariant )
-        {
-            case kBluetoothIntelHardwareVariantWP:
-            case kBluetoothIntelHardwareVariantStP:
-                err = SetupGen1Controller();
-                break;
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][InvalidateCommandCache] -- %s -- round trips saved so far: %u ****\n", reason, mCommandCacheStatistics.roundTripsSaved);
+    PublishCommandCacheStatistics();
+}
 
-            case kBluetoothIntelHardwareVariantSfP:
-            case kBluetoothIntelHardwareVariantWsP:
-            case kBluetoothIntelHardwareVariantJfP:
-            case kBluetoothIntelHardwareVariantThP:
-            case kBluetoothIntelHardwareVariantHrP:
-            case kBluetoothIntelHardwareVariantCcP:
-SETUP_GEN2:
-                err = SetupGen2Controller();
-                break;
+void IntelBluetoothHostController::PublishCommandCacheStatistics()
+{
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "RoundTripsSaved", mCommandCacheStatistics.roundTripsSaved, 32 },
+        { "Misses",          mCommandCacheStatistics.misses,          32 },
+        { "Invalidations",   mCommandCacheStatistics.invalidations,   32 }
+    };
 
-            default:
-                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupController] -- Unsupported hardware variant: %u ****\n", version->hardwareVariant);
-                err = kIOReturnInvalid;
-        }
+    PublishStatistics("CommandCache", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
 
-        if ( err )
+void IntelBluetoothHostController::RecordProcessCommand(int PID, IOByteCount bytes, UInt64 latency, bool timedOut)
+{
+    BluetoothIntelProcessAccounting * entry = NULL;
+    BluetoothIntelProcessAccounting * victim = NULL;
+    UInt64 elapsed;
+
+    absolutetime_to_nanoseconds(latency, &elapsed);
+
+    IOLockLock(mProcessAccountingLock);
+    for ( int i = 0; i < kIntelProcessAccountingSlots; ++i )
+    {
+        if ( mProcessAccounting[i].valid && mProcessAccounting[i].PID == PID )
         {
-            REQUIRE_NO_ERR(err);
-            return err;
+            entry = &mProcessAccounting[i];
+            break;
         }
-        goto COMPLETE;
+        if ( !victim || !mProcessAccounting[i].valid || (victim->valid && mProcessAccounting[i].commands < victim->commands) )
+            victim = &mProcessAccounting[i];
     }
 
-    err = SetupGen3Controller();
-    if ( err == kIOReturnUnsupported && mGeneration == 2 )
+    /* The name is only looked up once per process. */
+    if ( !entry )
     {
-        /* Some legacy bootloader devices from JfP supports both old
-         * and TLV based HCI_Intel_Read_Version command. But we don't
-         * want to use the TLV based setup routines for those legacy
-         * bootloader devices.
-         *
-         * Also, it is not easy to convert TLV based version from the
-         * legacy version format.
-         *
-         * So, as a workaround for those devices, use the legacy
-         * HCI_Intel_Read_Version to get the version information and
-         * run the legacy bootloader setup.
-         */
-        err = CallBluetoothHCIIntelReadVersionInfo(0x00);
-        if ( err )
-            return err;
-        goto SETUP_GEN2;
+        entry = victim;
+        bzero(entry, sizeof(BluetoothIntelProcessAccounting));
+        entry->PID = PID;
+        entry->valid = true;
+        snprintf(entry->name, sizeof(entry->name), "Unknown");
+        proc_name(PID, entry->name, sizeof(entry->name));
     }
-    else if ( err )
+
+    ++entry->commands;
+    entry->bytes += bytes;
+    entry->controllerTime += elapsed;
+    if ( timedOut )
+        ++entry->timeouts;
+    IOLockUnlock(mProcessAccountingLock);
+}
+
+void IntelBluetoothHostController::DecayProcessAccounting()
+{
+    UInt64 now = mach_absolute_time();
+    UInt64 elapsed;
+    UInt64 halvings;
+    BluetoothIntelProcessAccounting * entry;
+
+    if ( !mProcessAccountingDecayTime )
     {
-        REQUIRE_NO_ERR(err);
-        return err;
+        mProcessAccountingDecayTime = now;
+        return;
     }
 
-COMPLETE:
-    /* Set the event mask for Intel specific vendor events. This enables
-     * a few extra events that are useful during general operation. It
-     * does not enable any debugging related events.
-     *
-     * The device will function correctly without these events enabled
-     * and thus no need to fail the setup.
-     */
-    CallBluetoothHCIIntelSetEventMask(false);
+    absolutetime_to_nanoseconds(now - mProcessAccountingDecayTime, &elapsed);
+    halvings = elapsed / ((UInt64) kIntelProcessAccountingHalfLife * NSEC_PER_MSEC);
+    if ( !halvings )
+        return;
+    mProcessAccountingDecayTime = now;
 
-    err = SetupGeneralController();
-    if ( err && mBluetoothTransport )
+    /* Halve once per elapsed half-life, freeing the processes that went quiet. */
+    for ( int i = 0; i < kIntelProcessAccountingSlots; ++i )
     {
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
-        if ( hardReset )
-            *hardReset = true;
-#endif
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_15
-        err = HardResetController(1);
-#else
-        err = BluetoothResetDevice(1);
-#endif
+        entry = &mProcessAccounting[i];
+        if ( !entry->valid )
+            continue;
+        if ( halvings >= 32 )
+        {
+            entry->valid = false;
+            continue;
+        }
+
+        entry->commands >>= halvings;
+        entry->timeouts >>= halvings;
+        entry->bytes >>= halvings;
+        entry->controllerTime >>= halvings;
+        if ( !entry->commands )
+            entry->valid = false;
     }
+}
 
-    return err;
+void IntelBluetoothHostController::PublishProcessAccounting()
+{
+    OSDictionary * accounting;
+    OSDictionary * dict;
+    BluetoothIntelProcessAccounting * entry;
+    char key[MAXCOMLEN + 16];
+
+    accounting = OSDictionary::withCapacity(kIntelProcessAccountingSlots);
+    if ( !accounting )
+        return;
+
+    IOLockLock(mProcessAccountingLock);
+    DecayProcessAccounting();
+
+    /* controller time in microseconds */
+    for ( int i = 0; i < kIntelProcessAccountingSlots; ++i )
+    {
+        entry = &mProcessAccounting[i];
+        if ( !entry->valid )
+            continue;
+
+        const BluetoothIntelStatistic process[] =
+        {
+            { "Commands",       entry->commands,                       32 },
+            { "Bytes",          entry->bytes,                          64 },
+            { "ControllerTime", entry->controllerTime / NSEC_PER_USEC, 64 },
+            { "Timeouts",       entry->timeouts,                       32 }
+        };
+
+        dict = CreateStatisticsDictionary(process, sizeof(process) / sizeof(process[0]));
+        if ( !dict )
+            continue;
+
+        snprintf(key, sizeof(key), "%s (%d)", entry->name, entry->PID);
+        accounting->setObject(key, dict);
+        dict->release();
+    }
+    IOLockUnlock(mProcessAccountingLock);
+
+    setProperty("ProcessAccounting", accounting);
+    accounting->release();
 }
 
-IOReturn IntelBluetoothHostController::SetupGen1Controller()
+UInt64 IntelBluetoothHostController::EnterCommandLane(BluetoothIntelCommandLane lane)
 {
-    IOReturn err;
-    BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) mVersionInfo;
-    OSData * fwData;
-    UInt8 * fwPtr;
-    BluetoothHCIRequestID id;
-    int disablePatch;
-    IntelGen1BluetoothHostControllerUSBTransport * transport = (IntelGen1BluetoothHostControllerUSBTransport *) mBluetoothTransport;
-    if ( !transport )
+    AbsoluteTime start;
+    UInt64 deadline;
+    UInt64 remaining;
+    UInt64 waitTime = 0;
+
+    if ( lane == kBluetoothIntelCommandLaneInteractive )
     {
-        REQUIRE("( transport != NULL )");
-        return kIOReturnError;
+        OSIncrementAtomic(&mInteractiveCommands);
+        return 0;
     }
 
-    mGeneration = 1;
+    if ( lane != kBluetoothIntelCommandLaneBackground || !mInteractiveCommands )
+        return 0;
 
-    /* Apply the device specific HCI quirks
-     *
+    /* The interactive commands sleep in the gate while they wait for the
+     * controller, which lets this one in, so hold it back until they are
+     * done.
+     */
+    IOLockLock(mCommandLaneLock);
+    ++mCommandLaneStatistics[lane].yields;
+    IOLockUnlock(mCommandLaneLock);
+    start = mach_absolute_time();
+    clock_interval_to_deadline(kIntelBackgroundLaneMaxWait, kMillisecondScale, &deadline);
+    while ( mInteractiveCommands && !mTransportTerminating && mach_absolute_time() < deadline )
+    {
+        absolutetime_to_nanoseconds(deadline - mach_absolute_time(), &remaining);
+        if ( ControllerCommandSleep((void *) &mInteractiveCommands, (UInt32) (remaining / NSEC_PER_MSEC) + 1, (char *) __FUNCTION__, true) == THREAD_INTERRUPTED )
+            break;
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - start, &waitTime);
+
+    return waitTime;
+}
+
+void IntelBluetoothHostController::ExitCommandLane(BluetoothIntelCommandLane lane, UInt64 waitTime, UInt64 latency)
+{
+    BluetoothIntelCommandLaneStatistics * stats = &mCommandLaneStatistics[lane];
+    UInt64 elapsed;
+
+    if ( lane == kBluetoothIntelCommandLaneInteractive && OSDecrementAtomic(&mInteractiveCommands) == 1 )
+        mCommandGate->commandWakeup((void *) &mInteractiveCommands);
+
+    absolutetime_to_nanoseconds(latency, &elapsed);
+    IOLockLock(mCommandLaneLock);
+    ++stats->commands;
+    stats->waitTime += waitTime;
+    if ( waitTime > stats->maxWaitTime )
+        stats->maxWaitTime = waitTime;
+    stats->latency += elapsed;
+    IOLockUnlock(mCommandLaneLock);
+}
+
+void IntelBluetoothHostController::DeferCommandLaneExit(BluetoothIntelCommandLane lane, BluetoothHCICommandOpCode opCode, UInt64 waitTime, UInt64 enqueueTime)
+{
+    BluetoothIntelAsyncLaneEntry expired[kIntelAsyncLaneSlots];
+    BluetoothIntelAsyncLaneEntry * slot = NULL;
+    UInt32 numExpired = 0;
+    UInt64 timeout;
+    UInt64 now = mach_absolute_time();
+
+    nanoseconds_to_absolutetime((UInt64) kIntelAsyncLaneTimeout * NSEC_PER_MSEC, &timeout);
+
+    IOLockLock(mCommandLaneLock);
+    for ( int i = 0; i < kIntelAsyncLaneSlots; ++i )
+    {
+        if ( mAsyncLanes[i].valid && now - mAsyncLanes[i].enqueueTime > timeout )
+        {
+            expired[numExpired++] = mAsyncLanes[i];
+            mAsyncLanes[i].valid = false;
+        }
+        if ( !slot && !mAsyncLanes[i].valid )
+            slot = &mAsyncLanes[i];
+    }
+    if ( slot )
+    {
+        slot->opCode = opCode;
+        slot->lane = lane;
+        slot->waitTime = waitTime;
+        slot->enqueueTime = enqueueTime;
+        slot->valid = true;
+    }
+    IOLockUnlock(mCommandLaneLock);
+
+    for ( UInt32 i = 0; i < numExpired; ++i )
+        ExitCommandLane(expired[i].lane, expired[i].waitTime, now - expired[i].enqueueTime);
+    if ( !slot )
+        ExitCommandLane(lane, waitTime, now - enqueueTime);
+}
+
+void IntelBluetoothHostController::CompleteCommandLane(BluetoothHCICommandOpCode opCode)
+{
+    BluetoothIntelAsyncLaneEntry entry;
+    int oldest = -1;
+
+    /* The oldest request of an opcode completes first. */
+    IOLockLock(mCommandLaneLock);
+    for ( int i = 0; i < kIntelAsyncLaneSlots; ++i )
+    {
+        if ( mAsyncLanes[i].valid && mAsyncLanes[i].opCode == opCode && ( oldest < 0 || mAsyncLanes[i].enqueueTime < mAsyncLanes[oldest].enqueueTime ) )
+            oldest = i;
+    }
+    if ( oldest >= 0 )
+    {
+        entry = mAsyncLanes[oldest];
+        mAsyncLanes[oldest].valid = false;
+    }
+    IOLockUnlock(mCommandLaneLock);
+
+    if ( oldest >= 0 )
+        ExitCommandLane(entry.lane, entry.waitTime, mach_absolute_time() - entry.enqueueTime);
+}
+
+void IntelBluetoothHostController::PublishCommandLaneStatistics()
+{
+    static const char * laneNames[kBluetoothIntelCommandLaneCount] = { "Interactive", "Normal", "Background" };
+    OSDictionary * statistics;
+    OSDictionary * dict;
+    BluetoothIntelCommandLaneStatistics snapshot[kBluetoothIntelCommandLaneCount];
+    BluetoothIntelCommandLaneStatistics * stats;
+
+    statistics = OSDictionary::withCapacity(kBluetoothIntelCommandLaneCount);
+    if ( !statistics )
+        return;
+
+    IOLockLock(mCommandLaneLock);
+    memcpy(snapshot, mCommandLaneStatistics, sizeof(snapshot));
+    IOLockUnlock(mCommandLaneLock);
+
+    /* times in microseconds */
+    for ( int i = 0; i < kBluetoothIntelCommandLaneCount; ++i )
+    {
+        stats = &snapshot[i];
+        if ( !stats->commands )
+            continue;
+
+        const BluetoothIntelStatistic lane[] =
+        {
+            { "Commands",        stats->commands,                                   32 },
+            { "Yields",          stats->yields,                                     32 },
+            { "AverageWaitTime", stats->waitTime / stats->commands / NSEC_PER_USEC, 64 },
+            { "MaxWaitTime",     stats->maxWaitTime / NSEC_PER_USEC,                64 },
+            { "AverageLatency",  stats->latency / stats->commands / NSEC_PER_USEC,  64 }
+        };
+
+        dict = CreateStatisticsDictionary(lane, sizeof(lane) / sizeof(lane[0]));
+        if ( !dict )
+            continue;
+
+        statistics->setObject(laneNames[i], dict);
+        dict->release();
+    }
+
+    setProperty("CommandLanes", statistics);
+    statistics->release();
+}
+
+void IntelBluetoothHostController::PublishCommandLatencyStatistics()
+{
+    OSDictionary * statistics;
+    OSDictionary * dict;
+    OSArray * histogram;
+    OSNumber * number;
+    BluetoothIntelCommandLatency * slot;
+    char name[8];
+
+    statistics = OSDictionary::withCapacity(kIntelCommandLatencySlots);
+    if ( !statistics )
+        return;
+
+    /* latencies in microseconds, a snapshot that may be torn by commands completing meanwhile */
+    for ( UInt32 i = 0; i < kIntelCommandLatencySlots; ++i )
+    {
+        slot = &mCommandLatency[i];
+        if ( !slot->count )
+            continue;
+
+        const BluetoothIntelStatistic latency[] =
+        {
+            { "Count",      (UInt32) slot->count,    32 },
+            { "Timeouts",   (UInt32) slot->timeouts, 32 },
+            { "Errors",     (UInt32) slot->errors,   32 },
+            { "MaxLatency", slot->maxLatency,        64 }
+        };
+
+        dict = CreateStatisticsDictionary(latency, sizeof(latency) / sizeof(latency[0]));
+        if ( !dict )
+            continue;
+
+        histogram = OSArray::withCapacity(kIntelLatencyHistogramBuckets);
+        if ( histogram )
+        {
+            for ( int j = 0; j < kIntelLatencyHistogramBuckets; ++j )
+            {
+                number = OSNumber::withNumber(slot->buckets[j], 32);
+                if ( !number )
+                    continue;
+                histogram->setObject(number);
+                number->release();
+            }
+            dict->setObject("Histogram", histogram);
+            histogram->release();
+        }
+
+        if ( i < kIntelCommandLatencySlots - 1 )
+            snprintf(name, sizeof(name), "0x%04X", BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupVendorSpecific, kBluetoothIntelOpCodeTable[i].ocf));
+        else
+            snprintf(name, sizeof(name), "HCI");
+        statistics->setObject(name, dict);
+        dict->release();
+    }
+
+    setProperty("CommandLatency", statistics);
+    statistics->release();
+}
+
+void IntelBluetoothHostController::RecordCommandOverhead(UInt64 overhead)
+{
+    UInt64 elapsed;
+
+    absolutetime_to_nanoseconds(overhead, &elapsed);
+    ++mCommandOverheadStatistics.samples;
+    mCommandOverheadStatistics.totalTime += elapsed;
+    if ( elapsed > mCommandOverheadStatistics.maxTime )
+        mCommandOverheadStatistics.maxTime = elapsed;
+
+    /* A command storm would otherwise rebuild the dictionary on every command. */
+    if ( !(mCommandOverheadStatistics.samples % kIntelCommandOverheadSamples) )
+        PublishCommandOverheadStatistics();
+}
+
+void IntelBluetoothHostController::PublishCommandOverheadStatistics()
+{
+    OSDictionary * dict;
+
+    /* times in nanoseconds */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Samples",     mCommandOverheadStatistics.samples,                                                                                 32 },
+        { "AverageTime", mCommandOverheadStatistics.samples ? mCommandOverheadStatistics.totalTime / mCommandOverheadStatistics.samples : 0, 64 },
+        { "MaxTime",     mCommandOverheadStatistics.maxTime,                                                                                 64 }
+    };
+
+    dict = CreateStatisticsDictionary(statistics, sizeof(statistics) / sizeof(statistics[0]));
+    if ( !dict )
+        return;
+
+    dict->setObject("VerboseCommandDiagnostics", mVerboseCommandDiagnostics ? kOSBooleanTrue : kOSBooleanFalse);
+
+    setProperty("CommandOverhead", dict);
+    dict->release();
+}
+
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
+IOReturn IntelBluetoothHostController::SetupController(bool * hardReset)
+#else
+IOReturn IntelBluetoothHostController::SetupController()
+#endif
+{
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupController] -- Starting setup routine... ****\n");
+
+    BeginBootProfile();
+    ResetSetupState();
+    InvalidateCommandCache("Setup");
+    setConfigState(kIOBluetoothHCIControllerConfigStateKernelSetupPending);
+
+    while ( mSetupState != kBluetoothIntelSetupStateDone && mSetupState != kBluetoothIntelSetupStateFailed )
+        StepSetupState();
+
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
+    if ( hardReset && mSetupHardReset )
+        *hardReset = true;
+#endif
+
+    PublishSetupStateStatistics();
+    EndBootProfile(mSetupResult);
+
+    /* Time how long the controller took to come back from the last hard
+     * reset, separately for replayed and full configurations.
+     */
+    if ( sHardResetTime && !mSetupResult && !mSetupHardReset )
+    {
+        UInt64 recoveryTime;
+
+        absolutetime_to_nanoseconds(mach_absolute_time() - sHardResetTime, &recoveryTime);
+        if ( mConfigReplayed )
+            sRecoveryStatistics.lastReplayTime = recoveryTime;
+        else
+            sRecoveryStatistics.lastFullSetupTime = recoveryTime;
+        sHardResetTime = 0;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupController] -- Recovered from hard reset in %llu usecs (%s configuration) ****\n", recoveryTime / 1000, mConfigReplayed ? "replayed" : "full");
+    }
+    PublishRecoveryStatistics();
+    PublishTeardownStatistics();
+    PublishRequestPoolStatistics();
+    PublishCommandLatencyStatistics();
+    PublishCommandLaneStatistics();
+    PublishProcessAccounting();
+
+    /* A radio that was powered off the full way comes back here. */
+    if ( mRadioOffTime && !mSetupResult && !mSetupHardReset )
+    {
+        ++mRadioToggleStatistics.fullToggles;
+        absolutetime_to_nanoseconds(mach_absolute_time() - mRadioOffTime, &mRadioToggleStatistics.lastFullLatency);
+        mRadioOffTime = 0;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupController] -- Radio back on after full setup in %llu usecs ****\n", mRadioToggleStatistics.lastFullLatency / 1000);
+        PublishRadioToggleStatistics();
+    }
+
+    return mSetupResult;
+}
+
+void IntelBluetoothHostController::ResetSetupState()
+{
+    mSetupState = kBluetoothIntelSetupStateHCIReset;
+    mSetupResult = kIOReturnSuccess;
+    mSetupHardReset = false;
+    mSetupEventMaskSet = false;
+    mPostBootConfigPending = false;
+    mConfigRecordingActive = false;
+    mConfigReplayed = false;
+    bzero(mSetupStateRetries, sizeof(mSetupStateRetries));
+    bzero(mSetupStateTime, sizeof(mSetupStateTime));
+}
+
+BluetoothIntelSetupState IntelBluetoothHostController::GetSetupState()
+{
+    return mSetupState;
+}
+
+BluetoothIntelSetupState IntelBluetoothHostController::StepSetupState()
+{
+    IOReturn err = kIOReturnSuccess;
+    BluetoothIntelSetupState state = mSetupState;
+    BluetoothIntelSetupState next = kBluetoothIntelSetupStateFailed;
+    const BluetoothIntelSetupStatePolicy * policy;
+    IntelBluetoothManufacturerModeSession session(this);
+    AbsoluteTime callTime;
+    UInt64 duration;
+    UInt64 budget;
+
+    if ( state == kBluetoothIntelSetupStateIdle || state >= kBluetoothIntelSetupStateDone )
+        return state;
+
+    policy = &sSetupStatePolicies[state];
+    budget = (UInt64) policy->budget * NSEC_PER_MSEC;
+    callTime = mBluetoothFamily->GetCurrentTime();
+    ++mSetupStateStatistics[state].runs;
+
+    switch ( state )
+    {
+        case kBluetoothIntelSetupStateHCIReset:
+            /* Some controllers have a bug with the first HCI command sent to it
+             * returning number of completed commands as zero. This would stall the
+             * command processing in the Bluetooth core.
+             *
+             * As a workaround, send HCI Reset command first which will reset the
+             * number of completed commands and allow normal command processing.
+             */
+            if ( mProductID == 2012 )
+            {
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_11_0
+                err = CallBluetoothHCIReset(false, (char *) __FUNCTION__);
+#else
+                err = CallBluetoothHCIReset(false);
+#endif
+                RecordSetupPhase(kBluetoothIntelSetupPhaseHCIReset, callTime);
+                if ( err )
+                {
+                    REQUIRE_NO_ERR(err);
+                    break;
+                }
+            }
+
+            setConfigState(kIOBluetoothHCIControllerConfigStateKernelPostResetSetupPending);
+            next = kBluetoothIntelSetupStateWarmResume;
+            break;
+
+        case kBluetoothIntelSetupStateWarmResume:
+            /* On wake or after a soft reset the controller usually still runs
+             * the operational firmware of the last setup, in which case only
+             * its volatile settings need to be applied again.
+             */
+            next = kBluetoothIntelSetupStateReadVersionInfo;
+            if ( mFingerprintValid )
+            {
+                err = WarmResumeController();
+                if ( !err )
+                {
+                    next = kBluetoothIntelSetupStateEventMask;
+                    break;
+                }
+
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][StepSetupState] -- Warm resume failed: 0x%x -- running full setup... ****\n", err);
+                ++mWarmResumeStatistics.fallbacks;
+                PublishWarmResumeStatistics();
+                mSetupEventMaskSet = false;
+                err = kIOReturnSuccess;
+            }
+            mFingerprintValid = false;
+
+            /* The controller may have been power cycled or hard reset since the
+             * last setup, so nothing cached about its DDC values can be trusted.
+             * If the firmware boots, the bootup event tells that it holds the
+             * defaults again.
+             */
+            InvalidateDDCCache(false);
+            break;
+
+        case kBluetoothIntelSetupStateReadVersionInfo:
+            /* Starting from TyP devices, the command parameter and response are
+             * changed even though the OCF for HCI_Intel_Read_Version command
+             * remains same. The legacy devices can handle even if the command
+             * has a parameter and returns a correct version information. So,
+             * the new format is used to support both legacy and new devices.
+             */
+            err = CallBluetoothHCIIntelReadVersionInfo(0xFF);
+            RecordSetupPhase(kBluetoothIntelSetupPhaseReadVersionInfo, callTime);
+            next = kBluetoothIntelSetupStateLoadFirmware;
+            break;
+
+        case kBluetoothIntelSetupStateLoadFirmware:
+            mPostBootConfigPending = false;
+            err = LoadControllerFirmware();
+            next = mPostBootConfigPending ? kBluetoothIntelSetupStatePostBootConfig : kBluetoothIntelSetupStateFingerprint;
+            break;
+
+        case kBluetoothIntelSetupStatePostBootConfig:
+            next = kBluetoothIntelSetupStateFingerprint;
+
+            /* Replay the configuration recorded for this firmware build if
+             * there is one. Retries and anything that does not match run
+             * the full configuration, recording it again.
+             */
+            if ( !mSetupStateRetries[state] && !ReplayPostBootConfig() )
+                break;
+
+            mSetupEventMaskSet = false;
+            if ( mConfigRecording )
+            {
+                bzero(mConfigRecording, sizeof(BluetoothIntelConfigRecording));
+                mConfigRecording->valid = true;
+                mConfigRecordingActive = true;
+            }
+            err = ConfigurePostBoot();
+            mConfigRecordingActive = false;
+            if ( err && mConfigRecording )
+                mConfigRecording->valid = false;
+            ++sRecoveryStatistics.fullSetups;
+            break;
+
+        case kBluetoothIntelSetupStateFingerprint:
+            RecordControllerFingerprint();
+            StoreConfigRecording();
+            next = kBluetoothIntelSetupStateEventMask;
+            break;
+
+        case kBluetoothIntelSetupStateEventMask:
+            /* Set the event mask for Intel specific vendor events. This enables
+             * a few extra events that are useful during general operation. It
+             * does not enable any debugging related events.
+             *
+             * The device will function correctly without these events enabled
+             * and thus no need to fail the setup.
+             */
+            if ( !mSetupEventMaskSet )
+            {
+                /* Legacy ROM devices only take it in the manufacturer mode. */
+                if ( mGeneration != 1 || !session.Begin() )
+                {
+                    CallBluetoothHCIIntelSetEventMask(false);
+                    session.End();
+                }
+                RecordSetupPhase(kBluetoothIntelSetupPhaseEventMask, callTime);
+            }
+            next = kBluetoothIntelSetupStateGeneralSetup;
+            break;
+
+        case kBluetoothIntelSetupStateGeneralSetup:
+            err = SetupGeneralController();
+            RecordSetupPhase(kBluetoothIntelSetupPhaseGeneralSetup, callTime);
+            next = kBluetoothIntelSetupStateDone;
+            break;
+
+        case kBluetoothIntelSetupStateHardReset:
+            mSetupHardReset = true;
+            mActiveConnections = 0;
+            NoteHardReset();
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_15
+            mSetupResult = HardResetController(1);
+#else
+            mSetupResult = BluetoothResetDevice(1);
+#endif
+            next = kBluetoothIntelSetupStateDone;
+            break;
+
+        default:
+            break;
+    }
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
+    mSetupStateTime[state] += duration;
+    if ( budget && duration > budget )
+    {
+        ++mSetupStateStatistics[state].overruns;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][StepSetupState] -- %s took %llu usecs, over its %u ms budget ****\n", policy->name, duration / 1000, policy->budget);
+    }
+
+    if ( err )
+    {
+        ++mSetupStateStatistics[state].failures;
+
+        /* Retry the state, or the one it depends on, as long as it has
+         * retries and budget left, instead of starting over.
+         */
+        if ( mSetupStateRetries[state] < policy->maxRetries && mSetupStateTime[state] < budget && !mTransportTerminating )
+        {
+            ++mSetupStateRetries[state];
+            ++mSetupStateStatistics[state].retries;
+            next = policy->retryState;
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][StepSetupState] -- %s failed: 0x%x -- retrying from %s (%u/%u) ****\n", policy->name, err, sSetupStatePolicies[next].name, mSetupStateRetries[state], policy->maxRetries);
+        }
+        else
+        {
+            next = policy->failureState;
+            if ( next == kBluetoothIntelSetupStateHardReset && !mBluetoothTransport )
+                next = kBluetoothIntelSetupStateFailed;
+            mSetupResult = err;
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][StepSetupState] -- %s failed: 0x%x -- moving to %s ****\n", policy->name, err, sSetupStatePolicies[next].name);
+        }
+    }
+
+    mSetupState = next;
+    return next;
+}
+
+void IntelBluetoothHostController::PublishSetupStateStatistics()
+{
+    OSDictionary * statistics;
+    OSDictionary * dict;
+    OSString * state;
+
+    statistics = OSDictionary::withCapacity(kBluetoothIntelSetupStateCount);
+    if ( !statistics )
+        return;
+
+    for ( int i = kBluetoothIntelSetupStateHCIReset; i < kBluetoothIntelSetupStateDone; ++i )
+    {
+        const BluetoothIntelStatistic setupState[] =
+        {
+            { "Runs",     mSetupStateStatistics[i].runs,     32 },
+            { "Failures", mSetupStateStatistics[i].failures, 32 },
+            { "Retries",  mSetupStateStatistics[i].retries,  32 },
+            { "Overruns", mSetupStateStatistics[i].overruns, 32 }
+        };
+
+        dict = CreateStatisticsDictionary(setupState, sizeof(setupState) / sizeof(setupState[0]));
+        if ( !dict )
+            continue;
+
+        statistics->setObject(sSetupStatePolicies[i].name, dict);
+        dict->release();
+    }
+
+    state = OSString::withCString(sSetupStatePolicies[mSetupState].name);
+    if ( state )
+    {
+        statistics->setObject("LastState", state);
+        state->release();
+    }
+
+    setProperty("SetupStates", statistics);
+    statistics->release();
+}
+
+IOReturn IntelBluetoothHostController::LoadControllerFirmware()
+{
+    IOReturn err;
+    AbsoluteTime phaseTime;
+    BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) mVersionInfo;
+
+    if ( version->hardwarePlatform == 0x37 )
+    {
+        PrintVersionInfo(version);
+
+        mHardwareVariantInfo = IntelLookupHardwareVariant(version->hardwareVariant);
+        switch ( mHardwareVariantInfo ? mHardwareVariantInfo->generation : 0 )
+        {
+            case 1:
+                err = SetupGen1Controller();
+                break;
+
+            case 2:
+SETUP_GEN2:
+                err = SetupGen2Controller();
+                break;
+
+            default:
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][LoadControllerFirmware] -- Unsupported hardware variant: %u ****\n", version->hardwareVariant);
+                err = kIOReturnInvalid;
+        }
+
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+
+    err = SetupGen3Controller();
+    if ( err == kIOReturnUnsupported && mGeneration == 2 )
+    {
+        /* Some legacy bootloader devices from JfP supports both old
+         * and TLV based HCI_Intel_Read_Version command. But we don't
+         * want to use the TLV based setup routines for those legacy
+         * bootloader devices.
+         *
+         * Also, it is not easy to convert TLV based version from the
+         * legacy version format.
+         *
+         * So, as a workaround for those devices, use the legacy
+         * HCI_Intel_Read_Version to get the version information and
+         * run the legacy bootloader setup.
+         */
+        phaseTime = mBluetoothFamily->GetCurrentTime();
+        err = CallBluetoothHCIIntelReadVersionInfo(0x00);
+        RecordSetupPhase(kBluetoothIntelSetupPhaseReadVersionInfo, phaseTime);
+        if ( err )
+            return err;
+        version = (BluetoothIntelVersionInfo *) mVersionInfo;
+        goto SETUP_GEN2;
+    }
+
+    REQUIRE_NO_ERR(err);
+    return err;
+}
+
+IOReturn IntelBluetoothHostController::SetupGen1Controller()
+{
+    IOReturn err;
+    BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) mVersionInfo;
+    OSData * fwData;
+    UInt8 * fwPtr;
+    int disablePatch;
+    AbsoluteTime phaseTime;
+    IntelBluetoothManufacturerModeSession session(this);
+    IntelGen1BluetoothHostControllerUSBTransport * transport = (IntelGen1BluetoothHostControllerUSBTransport *) mBluetoothTransport;
+    if ( !transport )
+    {
+        REQUIRE("( transport != NULL )");
+        return kIOReturnError;
+    }
+
+    mGeneration = 1;
+
+    /* Apply the device specific HCI quirks
+     *
      * WBS for SdP - SdP and Stp have a same hw_varaint but
      * different fw_variant
      */
-    if ( version->hardwareVariant == kBluetoothIntelHardwareVariantStP && version->firmwareVariant == kBluetoothHCIIntelFirmwareVariantLegacyROM2_X )
+    if ( mHardwareVariantInfo && ((mHardwareVariantInfo->capabilities & kBluetoothIntelCapabilityWidebandSpeech) || ((mHardwareVariantInfo->capabilities & kBluetoothIntelCapabilityWidebandSpeechROM2_X) && version->firmwareVariant == kBluetoothHCIIntelFirmwareVariantLegacyROM2_X)) )
         mWidebandSpeechSupported = true;
 
     /* fw_patch_num indicates the version of patch the device currently
@@ -473,7 +1504,9 @@ IOReturn IntelBluetoothHostController::SetupGen1Controller()
      * If no patch file is found, allow the device to operate without
      * a patch.
      */
+    phaseTime = mBluetoothFamily->GetCurrentTime();
     transport->GetFirmware(version, NULL, "bseq", &fwData);
+    RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareLookup, phaseTime);
     if ( !fwData )
         goto complete;
     fwPtr = (UInt8 *) fwData->getBytesNoCopy();
@@ -484,15 +1517,7 @@ IOReturn IntelBluetoothHostController::SetupGen1Controller()
      * Only while this mode is enabled, the driver can download the
      * firmware patch data and configuration parameters.
      */
-
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCIIntelEnterManufacturerMode(id);
-    HCIRequestDelete(NULL, id);
+    err = session.Begin();
     if ( err )
         return err;
 
@@ -520,23 +1545,20 @@ IOReturn IntelBluetoothHostController::SetupGen1Controller()
      * If the default patch file is used, no reset is done when disabling
      * the manufacturer.
      */
+    phaseTime = mBluetoothFamily->GetCurrentTime();
     while ( fwData->getLength() > fwPtr - (UInt8 *) fwData->getBytesNoCopy() )
     {
         err = transport->PatchFirmware(fwData, &fwPtr, &disablePatch);
 
         if ( err )
         {
+            RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareDownload, phaseTime);
+
             /* Patching failed. Disable the manufacturer mode with reset and
              * deactivate the downloaded firmware patches.
              */
-            err = HCIRequestCreate(&id);
-            if ( err )
-            {
-                REQUIRE_NO_ERR(err);
-                return err;
-            }
-            err = BluetoothHCIIntelExitManufacturerMode(id, kBluetoothIntelManufacturingExitResetOptionResetDeactivatePatches);
-            HCIRequestDelete(NULL, id);
+            session.SetResetOption(kBluetoothIntelManufacturingExitResetOptionResetDeactivatePatches);
+            err = session.End();
             if ( err )
                 return err;
 
@@ -545,981 +1567,3150 @@ IOReturn IntelBluetoothHostController::SetupGen1Controller()
         }
     }
 
+    RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareDownload, phaseTime);
+
     if ( disablePatch )
     {
         /* Disable the manufacturer mode without reset */
-        err = HCIRequestCreate(&id);
+        err = session.End();
         if ( err )
-        {
-            REQUIRE_NO_ERR(err);
             return err;
+
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen1Controller] -- Patch completed with default firmware. ****\n");
+        goto complete;
+    }
+
+    /* Patching completed successfully and disable the manufacturer mode
+     * with reset and activate the downloaded firmware patches.
+     */
+    session.SetResetOption(kBluetoothIntelManufacturingExitResetOptionResetActivatePatches);
+    err = session.End();
+    if ( err )
+        return err;
+
+    /* Need build number for downloaded fw patches in
+     * every power-on boot
+     */
+    err = CallBluetoothHCIIntelReadVersionInfo(0x00);
+    if ( err )
+        return err;
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen1Controller] -- Patch (0x%02x) completed and activated. ****\n", ((BluetoothIntelVersionInfo *) mVersionInfo)->firmwarePatchVersion);
+
+complete:
+    CheckDeviceAddress();
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::SetupGen2Controller()
+{
+    IOReturn err;
+    BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) mVersionInfo;
+    UInt32 bootAddress;
+    IntelGen2BluetoothHostControllerUSBTransport * transport = (IntelGen2BluetoothHostControllerUSBTransport *) mBluetoothTransport;
+    if ( !transport )
+    {
+        REQUIRE("( transport != NULL )");
+        return kIOReturnError;
+    }
+
+    mGeneration = 2;
+
+    /* Legacy bootloader devices falling back from SetupGen3Controller
+     * are looked up again with their legacy version information.
+     */
+    mHardwareVariantInfo = IntelLookupHardwareVariant(version->hardwareVariant);
+    if ( !mHardwareVariantInfo || mHardwareVariantInfo->generation != 2 )
+        return kIOReturnInvalid;
+
+    if ( mHardwareVariantInfo->capabilities & kBluetoothIntelCapabilityValidLEStates )
+        mValidLEStates = true;
+
+    if ( mHardwareVariantInfo->capabilities & kBluetoothIntelCapabilityWidebandSpeech )
+        mWidebandSpeechSupported = true;
+
+    /* Setup MSFT Extension support */
+    SetMicrosoftExtensionOpCode(version->hardwareVariant);
+
+    /* Set the default boot parameter to 0x0 and it is updated to
+     * SKU specific boot parameter after reading Intel_Write_Boot_Params
+     * command while downloading the firmware.
+     */
+    bootAddress = 0x00000000;
+
+    mBootloaderMode = true;
+
+    err = transport->DownloadFirmware(version, &mBootParams, &bootAddress);
+    if ( err )
+        return err;
+
+    /* controller is already having an operational firmware */
+    if ( version->firmwareVariant == kBluetoothHCIIntelFirmwareVariantFirmware )
+        return kIOReturnSuccess;
+
+    /* The DDC file is looked up with the bootloader version information. */
+    mBootloaderVersionInfo = *version;
+
+    err = BootDevice(bootAddress);
+    if ( err )
+        return err;
+
+    mBootloaderMode = false;
+    mPostBootConfigPending = true;
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::SetupGen3Controller()
+{
+    IOReturn err;
+    BluetoothIntelVersionInfoTLV version;
+    UInt32 bootAddress;
+
+    if ( !mBluetoothTransport )
+        return kIOReturnError;
+
+    IntelGen3BluetoothHostControllerUSBTransport * transport = (IntelGen3BluetoothHostControllerUSBTransport *) mBluetoothTransport;
+    if ( !transport )
+    {
+        REQUIRE("( transport != NULL )");
+        return kIOReturnError;
+    }
+
+    err = transport->ParseVersionInfoTLV(&version, mVersionInfo, kMaxHCIBufferLength * 4);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Failed to parse TLV version information! ****\n");
+        return err;
+    }
+
+    if ( IntelCNVXExtractHardwarePlatform(version.cnviBT) != 0x37 )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Unsupported hardware platform: 0x%02x ****\n", IntelCNVXExtractHardwarePlatform(version.cnviBT));
+        return kIOReturnInvalid;
+    }
+
+    /* Check for supported iBT hardware variants of this firmware
+     * loading method.
+     *
+     * This check has been put in place to ensure correct forward
+     * compatibility options when newer hardware variants come
+     * along.
+     */
+    mHardwareVariantInfo = IntelLookupHardwareVariant(IntelCNVXExtractHardwareVariant(version.cnviBT));
+    switch ( mHardwareVariantInfo ? mHardwareVariantInfo->generation : 0 )
+    {
+        case 2:
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- This controller is not an Intel new bootloader device!!! ****\n");
+            mGeneration = 2;
+            return kIOReturnUnsupported;
+        }
+
+        case 3:
+        {
+            mGeneration = 3;
+
+            /* Display version information of TLV type */
+            PrintVersionInfo(&version);
+
+            /* Apply the device specific HCI quirks for TLV based devices,
+             * e.g. valid LE states for GfP. All TLV based devices support
+             * WBS.
+             */
+            if ( mHardwareVariantInfo->capabilities & kBluetoothIntelCapabilityValidLEStates )
+                mValidLEStates = true;
+            if ( mHardwareVariantInfo->capabilities & kBluetoothIntelCapabilityWidebandSpeech )
+                mWidebandSpeechSupported = true;
+
+            /* Setup MSFT Extension support */
+            SetMicrosoftExtensionOpCode(IntelCNVXExtractHardwareVariant(version.cnviBT));
+
+            /* Set the default boot parameter to 0x0 and it is updated to
+             * SKU specific boot parameter after reading Intel_Write_Boot_Params
+             * command while downloading the firmware.
+             */
+            bootAddress = 0x00000000;
+
+            mBootloaderMode = true;
+
+            err = transport->DownloadFirmware(&version, NULL, &bootAddress);
+            if ( err )
+                return err;
+
+            /* check if controller is already having an operational firmware */
+            if ( version.imageType == kBluetoothHCIIntelImageTypeFirmware )
+                return kIOReturnSuccess;
+
+            /* The DDC file is looked up with the bootloader version information. */
+            mBootloaderVersionInfoTLV = version;
+
+            err = BootDevice(bootAddress);
+            if ( err )
+                return err;
+
+            mBootloaderMode = false;
+            mPostBootConfigPending = true;
+
+            return kIOReturnSuccess;
+        }
+
+        default:
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Unsupported hardware variant: %u ****\n", IntelCNVXExtractHardwareVariant(version.cnviBT));
+            return kIOReturnInvalid;
         }
-        err = BluetoothHCIIntelExitManufacturerMode(id, kBluetoothIntelManufacturingExitResetOptionsNoReset);
-        HCIRequestDelete(NULL, id);
+    }
+}
+
+IOReturn IntelBluetoothHostController::ConfigurePostBoot()
+{
+    IOReturn err;
+    BluetoothIntelVersionInfoTLV version;
+    IntelBluetoothHostControllerUSBTransport * transport = (IntelBluetoothHostControllerUSBTransport *) mBluetoothTransport;
+    if ( !transport )
+    {
+        REQUIRE("( transport != NULL )");
+        return kIOReturnError;
+    }
+
+    /* Once the device is running in operational mode, it needs to
+     * apply the device configuration (DDC) parameters.
+     *
+     * The device can work without DDC parameters, so even if it
+     * fails to load the file, no need to fail the setup.
+     *
+     * The quality report writes DDC parameters of its own, and the
+     * version information must not change under the DDC file lookup,
+     * so both wait for the DDC to be loaded. Reading the supported
+     * offload use cases and setting the event mask are independent
+     * of the DDC. Read the Intel version information after loading
+     * the FW.
+     */
+    if ( mGeneration == 2 )
+    {
+        BluetoothIntelSetupStep steps[] =
+        {
+            { "LoadDDCConfig",   LoadDDCConfigStepAction,   transport, &mBootloaderVersionInfo, &mBootParams, 0,      false },
+            { "EventMask",       EventMaskStepAction,       NULL,      NULL,                    NULL,         0,      false },
+            { "QualityReport",   QualityReportStepAction,   NULL,      NULL,                    NULL,         1 << 0, false },
+            { "ReadVersionInfo", ReadVersionInfoStepAction, (void *) 0x00, NULL,                NULL,         1 << 0, true  }
+        };
+
+        err = RunSetupSteps(steps, sizeof(steps) / sizeof(steps[0]));
         if ( err )
             return err;
 
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen1Controller] -- Patch completed with default firmware. ****\n");
-        goto complete;
+        PrintVersionInfo((BluetoothIntelVersionInfo *) mVersionInfo);
+        return kIOReturnSuccess;
+    }
+
+    BluetoothIntelSetupStep steps[] =
+    {
+        { "LoadDDCConfig",    LoadDDCConfigStepAction,    transport, &mBootloaderVersionInfoTLV, NULL, 0,      false },
+        { "ConfigureOffload", ConfigureOffloadStepAction, NULL,      NULL,                       NULL, 0,      false },
+        { "EventMask",        EventMaskStepAction,        NULL,      NULL,                       NULL, 0,      false },
+        { "QualityReport",    QualityReportStepAction,    NULL,      NULL,                       NULL, 1 << 0, false },
+        { "ReadVersionInfo",  ReadVersionInfoStepAction,  (void *) 0xFF, NULL,                   NULL, 1 << 0, true  }
+    };
+
+    err = RunSetupSteps(steps, sizeof(steps) / sizeof(steps[0]));
+    if ( err )
+        return err;
+
+    err = transport->ParseVersionInfoTLV(&version, mVersionInfo, kMaxHCIBufferLength * 4);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ConfigurePostBoot] -- Failed to parse TLV version information! ****\n");
+        return err;
+    }
+
+    PrintVersionInfo(&version);
+
+    return kIOReturnSuccess;
+}
+
+bool IntelBluetoothHostController::InitializeHostControllerVariables(bool setup)
+{
+    if ( !super::InitializeHostControllerVariables(setup) )
+        return false;
+
+    if ( mBluetoothTransport )
+        mSupportWoBT = mBluetoothTransport->ControllerSupportWoBT();
+
+    setProperty("ActiveBluetoothControllerVendor", "Intel");
+    setProperty("BluetoothVendor", "Intel");
+    return true;
+}
+
+IOReturn IntelBluetoothHostController::SetTransportRadioPowerState(UInt8 inState)
+{
+    IOReturn err;
+
+    if ( !mBluetoothTransport )
+        return kIOReturnInvalid;
+
+    InvalidateCommandCache("Radio Power State Change");
+
+    if ( !inState )
+    {
+        mActiveConnections = 0;
+        mRadioOffTime = mach_absolute_time();
+
+        /* The controller may lose power along with the radio and come
+         * back in the bootloader without sending a bootup event, unless
+         * the radio was only killed in software.
+         */
+        if ( CallPowerRadio(false) )
+            InvalidateControllerIdentity("Radio Power Off");
+
+        mBluetoothTransport->SetRadioPowerState(inState);
+        return kIOReturnSuccess;
+    }
+
+    /* The transport has to be up before the kill is lifted over it. */
+    mBluetoothTransport->SetRadioPowerState(inState);
+    if ( !mRadioKilled )
+        return kIOReturnSuccess;
+
+    err = CallPowerRadio(true);
+    if ( !err )
+    {
+        ++mRadioToggleStatistics.fastToggles;
+        absolutetime_to_nanoseconds(mach_absolute_time() - mRadioOffTime, &mRadioToggleStatistics.lastFastLatency);
+        mRadioOffTime = 0;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetTransportRadioPowerState] -- Radio back on after SW RF kill in %llu usecs ****\n", mRadioToggleStatistics.lastFastLatency / 1000);
+        PublishRadioToggleStatistics();
+        return kIOReturnSuccess;
+    }
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetTransportRadioPowerState] -- Failed to lift SW RF kill: 0x%x, falling back to full setup ****\n", err);
+
+    InvalidateControllerIdentity("Radio Toggle Fallback");
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
+    err = SetupController(NULL);
+#else
+    err = SetupController();
+#endif
+    if ( err )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetTransportRadioPowerState] -- SetupController() failed after the SW RF kill fallback: 0x%x ****\n", err);
+
+    return err;
+}
+
+IOReturn IntelBluetoothHostController::GetTransportRadioPowerState(UInt8 * outState)
+{
+    if ( !mBluetoothTransport )
+        return kIOReturnInvalid;
+    *outState = mBluetoothTransport->GetRadioPowerState();
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::CallPowerRadio(bool powerOn)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+
+    if ( !mFastRadioToggle )
+        return kIOReturnUnsupported;
+
+    if ( !powerOn )
+    {
+        if ( mSetupState != kBluetoothIntelSetupStateDone || !mFingerprintValid )
+            return kIOReturnNotReady;
+
+        err = lease.Acquire(&id);
+        if ( err )
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CallPowerRadio] -- AcquireRequest() failed: 0x%x ****\n", err);
+            return err;
+        }
+        /* The LED off command is the SW RF kill. */
+        err = BluetoothHCIIntelTurnOffDeviceLED(id);
+        lease.Release();
+
+        if ( err )
+        {
+            ++mRadioToggleStatistics.fallbacks;
+            PublishRadioToggleStatistics();
+            return err;
+        }
+
+        mRadioKilled = true;
+        return kIOReturnSuccess;
+    }
+
+    if ( !mRadioKilled )
+        return kIOReturnSuccess;
+    mRadioKilled = false;
+
+    /* An HCI reset lifts the kill but clears the event masks, and the
+     * controller may still have lost power in between.
+     */
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
+    err = CallBluetoothHCIReset(false, (char *) __FUNCTION__);
+#else
+    err = CallBluetoothHCIReset(false);
+#endif
+    if ( !err )
+        err = WarmResumeController();
+    if ( !err )
+        err = SetupGeneralController();
+
+    if ( err )
+    {
+        ++mRadioToggleStatistics.fallbacks;
+        PublishRadioToggleStatistics();
+    }
+    return err;
+}
+
+void IntelBluetoothHostController::SetMicrosoftExtensionOpCode(UInt8 hardwareVariant)
+{
+    const BluetoothIntelHardwareVariantInfo * info = IntelLookupHardwareVariant(hardwareVariant);
+
+    /* JfP and later legacy bootloader devices, as well as all Intel new
+     * generation controllers, support the Microsoft vendor extension.
+     */
+    if ( info && info->msftOpCode )
+    {
+        mMicrosoftExtensionOpCode = info->msftOpCode;
+        // What operations need to be done?
+    }
+}
+
+IOReturn IntelBluetoothHostController::ResetToBootloader(bool retry)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    AbsoluteTime callTime = mBluetoothFamily->GetCurrentTime();
+
+    mBootloaderMode = true;
+    mDownloading = true;
+    mBooting = false;
+    mBootloaderResetPending = true;
+    
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCISendIntelReset(id, 0x01, true, true, 0x00, 0x00000000);
+    lease.Release();
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetToBootloader] -- BluetoothHCISendIntelReset() failed -- cannot deliver Intel reset: 0x%x ****\n", err);
+        mBootloaderResetPending = false;
+        return err;
+    }
+    
+    if ( retry )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetToBootloader] -- Reset is sent successfully. Retrying firmware download... ****\n");
+    
+    /* Current Intel BT controllers(ThP/JfP) hold the USB reset
+     * lines for 2ms when it receives Intel Reset in bootloader mode.
+     * Whereas, the upcoming Intel BT controllers will hold USB reset
+     * for 150ms. To keep the delay generic, 150ms is chosen here.
+     *
+     * The device re-enumerates once it is done, so the wait ends as
+     * soon as the transport terminates. Without that signal, the whole
+     * delay has elapsed and the controller is past its reset hold.
+     */
+    err = WaitForSignal(kBluetoothIntelWaitResetToBootloader, &mBootloaderResetPending, kIntelResetToBootloaderDelay, true);
+    mBootloaderResetPending = false;
+    if ( err == THREAD_INTERRUPTED )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetToBootloader] -- Interrupted while waiting for the controller to reset ****\n");
+        return kIOReturnAborted;
+    }
+    if ( err == kIOReturnTimeout )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetToBootloader] -- The device did not re-enumerate within %u ms, continuing ****\n", kIntelResetToBootloaderDelay);
+
+    RecordSetupPhase(kBluetoothIntelSetupPhaseResetToBootloader, callTime);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadExceptionInfo(BluetoothHCIRequestID inID, BluetoothIntelExceptionInfo * info)
+{
+    IOReturn err;
+
+    err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadExceptionInfo] -- Failed to prepare request for new command: 0x%x ****\n", err);
+        return err;
+    }
+
+    err = SendIntelCommand(inID, BluetoothIntelReadExceptionInfoPacket({ 0x00 }), sizeof(BluetoothIntelExceptionInfo), info);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadExceptionInfo] ### ERROR: opCode = 0x%04X -- send request failed -- Unable to obtain exception info: 0x%x ****\n", 0xFC22, err);
+        return err;
+    }
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadExceptionInfo] -- Exception Info: %s ****\n", info->info);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::WriteDeviceAddress(BluetoothHCIRequestID inID, BluetoothDeviceAddress * inAddress)
+{
+    IOReturn err;
+    
+    err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WriteDeviceAddress] -- Failed to prepare request for new command: 0x%x ****\n", err);
+        return err;
+    }
+    
+    err = SendIntelCommand(inID, BluetoothIntelWriteDeviceAddressPacket({ *inAddress }));
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WriteDeviceAddress] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC31, err);
+        return err;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::CheckDeviceAddress()
+{
+    IOReturn err;
+    BluetoothDeviceAddress address;
+    BluetoothDeviceAddress defaultAddress = (BluetoothDeviceAddress) {0x00, 0x8B, 0x9E, 0x19, 0x03, 0x00};
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCIReadDeviceAddress(id, &address);
+    lease.Release();
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckDeviceAddress] -- BluetoothHCIReadDeviceAddress() failed -- cannot read device address: 0x%x ****\n", err);
+        return err;
+    }
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckDeviceAddress] -- Printing device address: 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x ****\n", address.data[0], address.data[1], address.data[2], address.data[3], address.data[4], address.data[5]);
+
+    /* For some Intel based controllers, the default Bluetooth device
+     * address 00:03:19:9E:8B:00 can be found. These controllers are
+     * fully operational, but have the danger of duplicate addresses
+     * and that in turn can cause problems with Bluetooth operation.
+     */
+    if ( !memcmp(&address, &defaultAddress, 6) )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckDeviceAddress] -- Default device address (%pMR) found! ****\n", &address);
+        mInvalidDeviceAddress = true;
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelReadVersionInfo(UInt8 param)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    BluetoothIntelIdentityCacheSlot slot;
+    UInt8 * cached;
+    UInt32 size;
+
+    if ( !mVersionInfo )
+        return kIOReturnInvalid;
+
+    /* The TLV response has no fixed length, so the whole buffer is kept. */
+    if ( param == 0xFF )
+    {
+        slot = kBluetoothIntelIdentityCacheSlotVersionInfoTLV;
+        cached = mCachedVersionInfoTLV;
+        size = kMaxHCIBufferLength * 4;
+    }
+    else
+    {
+        slot = kBluetoothIntelIdentityCacheSlotVersionInfo;
+        cached = (UInt8 *) &mCachedVersionInfo;
+        size = sizeof(BluetoothIntelVersionInfo);
+    }
+
+    if ( cached && IsControllerIdentityCached(slot) )
+    {
+        memcpy(mVersionInfo, cached, size);
+        ++mIdentityCacheHits;
+        PublishIdentityCacheStatistics();
+        return kIOReturnSuccess;
+    }
+    
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCIIntelReadVersionInfo(id, param, mVersionInfo);
+    lease.Release();
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+
+    ++mIdentityCacheMisses;
+    if ( cached )
+    {
+        memcpy(cached, mVersionInfo, size);
+        mIdentityCache[slot].epoch = mIdentityEpoch;
+        mIdentityCache[slot].valid = true;
+    }
+    PublishIdentityCacheStatistics();
+
+    return err;
+}
+
+IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelReadBootParams(BluetoothIntelBootParams * params)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+
+    if ( !params )
+        return kIOReturnInvalid;
+
+    if ( IsControllerIdentityCached(kBluetoothIntelIdentityCacheSlotBootParams) )
+    {
+        *params = mCachedBootParams;
+        ++mIdentityCacheHits;
+        PublishIdentityCacheStatistics();
+        return kIOReturnSuccess;
+    }
+
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCIIntelReadBootParams(id, params);
+    lease.Release();
+    if ( err )
+        return err;
+
+    ++mIdentityCacheMisses;
+    mCachedBootParams = *params;
+    mIdentityCache[kBluetoothIntelIdentityCacheSlotBootParams].epoch = mIdentityEpoch;
+    mIdentityCache[kBluetoothIntelIdentityCacheSlotBootParams].valid = true;
+    PublishIdentityCacheStatistics();
+
+    return kIOReturnSuccess;
+}
+
+bool IntelBluetoothHostController::IsControllerIdentityCached(BluetoothIntelIdentityCacheSlot slot)
+{
+    return mIdentityCache[slot].valid && mIdentityCache[slot].epoch == mIdentityEpoch;
+}
+
+void IntelBluetoothHostController::InvalidateControllerIdentity(const char * reason)
+{
+    ++mIdentityEpoch;
+    ++mIdentityCacheInvalidations;
+    mActiveConnections = 0;
+    InvalidateCommandCache(reason);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][InvalidateControllerIdentity] -- %s -- identity epoch = %u ****\n", reason, mIdentityEpoch);
+    PublishIdentityCacheStatistics();
+}
+
+void IntelBluetoothHostController::PublishIdentityCacheStatistics()
+{
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Epoch",         mIdentityEpoch,              32 },
+        { "AvoidedReads",  mIdentityCacheHits,          32 },
+        { "Reads",         mIdentityCacheMisses,        32 },
+        { "Invalidations", mIdentityCacheInvalidations, 32 }
+    };
+
+    PublishStatistics("IdentityCache", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+const char * IntelBluetoothHostController::ConvertFirmwareVariantToString(BluetoothHCIIntelFirmwareVariant firmwareVariant)
+{
+    switch ( firmwareVariant )
+    {
+        case kBluetoothHCIIntelFirmwareVariantLegacyROM2_5:
+            return "Legacy ROM 2.5";
+            
+        case kBluetoothHCIIntelFirmwareVariantBootloader:
+            return "Bootloader";
+            
+        case kBluetoothHCIIntelFirmwareVariantLegacyROM2_X:
+            return "Legacy ROM 2.x";
+            
+        case kBluetoothHCIIntelFirmwareVariantFirmware:
+            return "Firmware";
+            
+        default:
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ConvertFirmwareVariantToString] -- Unsupported firmware variant: %02x ****\n", firmwareVariant);
+            return "Unknown";
+    }
+}
+
+const char * IntelBluetoothHostController::ConvertImageTypeToString(BluetoothHCIIntelImageType imageType)
+{
+    switch ( imageType )
+    {
+        case kBluetoothHCIIntelImageTypeBootloader:
+            return "Bootloader";
+            
+        case kBluetoothHCIIntelImageTypeFirmware:
+            return "Firmware";
+            
+        default:
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ConvertImageTypeToString] -- Unsupported image type: %02x ****\n", imageType);
+            return "Unknown";
+    }
+}
+
+IOReturn IntelBluetoothHostController::PrintVersionInfo(BluetoothIntelVersionInfo * version)
+{
+    /* The hardware platform number has a fixed value of 0x37 and
+     * for now only accept this single value.
+     */
+    if ( version->hardwarePlatform != 0x37 )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware platform: %u ****\n", version->hardwarePlatform);
+        return kIOReturnInvalid;
+    }
+
+    /* Check for supported iBT hardware variants of this firmware
+     * loading method.
+     *
+     * This check has been put in place to ensure correct forward
+     * compatibility options when newer hardware variants come along.
+     */
+    const BluetoothIntelHardwareVariantInfo * info = IntelLookupHardwareVariant(version->hardwareVariant);
+    if ( !info || info->generation > 2 )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware variant: %u ****\n", version->hardwareVariant);
+        return kIOReturnInvalid;
+    }
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- %s -- Firmware Revision: %u.%u -- Firmware Build: %u - week: %u - year: %u ****\n", ConvertFirmwareVariantToString(version->firmwareVariant), version->firmwareRevision >> 4, version->firmwareRevision & 0x0F, version->firmwareBuildNum, version->firmwareBuildWeek, 2000 + version->firmwareBuildYear);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::PrintVersionInfo(BluetoothIntelVersionInfoTLV * version)
+{
+    /* The hardware platform number has a fixed value of 0x37 and
+     * for now only accept this single value.
+     */
+    if ( IntelCNVXExtractHardwarePlatform(version->cnviBT) != 0x37 )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware platform: 0x%02x ****\n", IntelCNVXExtractHardwarePlatform(version->cnviBT));
+        return kIOReturnInvalid;
+    }
+
+    /* Check for supported iBT hardware variants of this firmware
+     * loading method.
+     *
+     * This check has been put in place to ensure correct forward
+     * compatibility options when newer hardware variants come along.
+     */
+    const BluetoothIntelHardwareVariantInfo * info = IntelLookupHardwareVariant(IntelCNVXExtractHardwareVariant(version->cnviBT));
+    if ( !info || info->generation != 3 )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware variant: 0x%x ****\n", IntelCNVXExtractHardwareVariant(version->cnviBT));
+        return kIOReturnInvalid;
+    }
+
+    if ( version->imageType == kBluetoothHCIIntelImageTypeBootloader )
+    {
+        /* It is required that every single firmware fragment is acknowledged
+         * with a command complete event. If the boot parameters indicate
+         * that this bootloader does not send them, then abort the setup.
+         */
+        if ( version->limitedCCE != 0x00 )
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported firmware loading method: 0x%x ****\n", version->limitedCCE);
+            return kIOReturnInvalid;
+        }
+
+        /* Secure boot engine type should be either 1 (ECDSA) or 0 (RSA) */
+        if ( version->sbeType > 0x01 )
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported secure boot engine type: 0x%x ****\n", version->sbeType);
+            return kIOReturnInvalid;
+        }
+
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Device revision is %u ****\n", version->deviceRevisionID);
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Secure boot is %s ****\n", version->secureBoot ? "enabled" : "disabled");
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- OTP lock is %s ****\n", version->otpLock ? "enabled" : "disabled");
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- API lock is %s ****\n", version->apiLock ? "enabled" : "disabled");
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Debug lock is %s ****\n", version->debugLock ? "enabled" : "disabled");
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Minimum firmware build %u week %u %u ****\n", version->firmwareBuildNumber, version->firmwareBuildWeek, 2000 + version->firmwareBuildYear);
+    }
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- %s -- Timestamp: %u.%u -- Build Type: %u -- Build Number: %u ****\n", ConvertImageTypeToString(version->imageType), 2000 + (version->timestamp >> 8), version->timestamp & 0xFF, version->buildType, version->buildNumber);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::SetQualityReport(bool enable)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    BluetoothIntelDebugFeatures features;
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetQualityReport] -- %s quality report... ****\n", enable ? "Setting" : "Resetting");
+
+     /* Read the Intel supported features and if new exception formats
+      * supported, need to load the additional DDC config to enable.
+      */
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCIIntelReadDebugFeatures(id, &features);
+    lease.Release();
+    if ( err )
+        return err;
+
+    /* Set or reset the debug features. */
+    if ( enable )
+        err = SetDebugFeatures(&features);
+    else
+        err = ResetDebugFeatures(&features);
+
+    return err;
+}
+
+#if 0
+static int btintel_get_codec_config_data(struct hci_dev *hdev,
+                   __u8 link, struct bt_codec *codec,
+                   __u8 *ven_len, __u8 **ven_data)
+{
+    int err = 0;
+
+    if ( !ven_data || !ven_len )
+        return -EINVAL;
+
+    *ven_len = 0;
+    *ven_data = NULL;
+
+    if ( link != ESCO_LINK ) {
+        bt_dev_err(hdev, "Invalid link type(%u)", link);
+        return -EINVAL;
+    }
+
+    *ven_data = kmalloc(sizeof(__u8), GFP_KERNEL);
+    if ( !*ven_data ) {
+        err = -ENOMEM;
+        goto error;
+    }
+
+    // supports only CVSD and mSBC offload codecs
+    switch ( codec->id )
+    {
+        case 0x02:
+            **ven_data = 0x00;
+            break;
+        case 0x05:
+            **ven_data = 0x01;
+            break;
+        default:
+            err = -EINVAL;
+            bt_dev_err(hdev, "Invalid codec id(%u)", codec->id);
+            goto error;
+    }
+
+    /* codec and its capabilities are pre-defined to ids
+     * preset id = 0x00 represents CVSD codec with sampling rate 8K
+     * preset id = 0x01 represents mSBC codec with sampling rate 16K
+     */
+
+    *ven_len = sizeof(__u8);
+    return err;
+
+error:
+    kfree(*ven_data);
+    *ven_data = NULL;
+    return err;
+}
+#endif
+
+IOReturn IntelBluetoothHostController::ConfigureOffload()
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    BluetoothIntelOffloadUseCases cases;
+
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCIIntelReadOffloadUseCases(id, &cases);
+    lease.Release();
+
+    if ( cases.preset[0] & 0x03 )
+    {
+        /* Intel uses 1 as data path id for all the usecases */
+        //*data_path_id = 1;
+        //hdev->get_codec_config_data = btintel_get_codec_config_data;
+    }
+
+    return err;
+}
+
+IOReturn IntelBluetoothHostController::WaitForFirmwareDownload(AbsoluteTime callTime, UInt32 deadline)
+{
+    IOReturn err;
+    AbsoluteTime duration;
+    AbsoluteTime waitTime = mBluetoothFamily->GetCurrentTime();
+
+    mFirmwareLoaded = true;
+    setProperty("FirmwareLoaded", true);
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Waiting for firmware download to complete... ****\n");
+
+    err = WaitForSignal(kBluetoothIntelWaitFirmwareDownload, &mDownloading, deadline, false);
+    RecordSetupPhase(kBluetoothIntelSetupPhaseWaitForFirmwareDownload, waitTime);
+    if ( err == THREAD_INTERRUPTED )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loading interrupted! ****\n");
+        return THREAD_INTERRUPTED;
+    }
+    else if ( err == kIOReturnNoDevice )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Transport terminated during firmware loading! ****\n");
+        return err;
+    }
+    else if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loading timed out! ****\n");
+        return kIOReturnTimeout;
+    }
+
+    if ( mFirmwareLoadingFailed )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loading failed according to the vendor specific event, which could cause strange behavior. ****\n");
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loaded in %llu usecs. ****\n", duration / 1000);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::WaitForDeviceBoot(AbsoluteTime callTime, UInt32 deadline)
+{
+    IOReturn err;
+    AbsoluteTime duration;
+
+    err = WaitForSignal(kBluetoothIntelWaitDeviceBoot, &mBooting, deadline, false);
+    RecordSetupPhase(kBluetoothIntelSetupPhaseWaitForDeviceBoot, callTime);
+    if ( err == THREAD_INTERRUPTED )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Device boot interrupted! ****\n");
+        return THREAD_INTERRUPTED;
+    }
+    else if ( err == kIOReturnNoDevice )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Transport terminated during device boot! ****\n");
+        return err;
+    }
+    else if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Device boot timed out! ****\n");
+        return kIOReturnTimeout;
+    }
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Device booted in %llu usecs. ****\n", duration / 1000);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::BootDevice(UInt32 bootAddress)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    AbsoluteTime callTime = mBluetoothFamily->GetCurrentTime();
+
+    mBooting = true;
+
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        goto reset;
+    }
+    err = BluetoothHCISendIntelReset(id, 0, true, false, 1, bootAddress);
+    lease.Release();
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BootDevice] -- Soft reset failed: 0x%x ****\n", err);
+reset:
+        ResetToBootloader(false);
+        return err;
+    }
+
+    /* The bootloader will not indicate when the device is ready. This
+     * is done by the operational firmware sending bootup notification.
+     *
+     * Booting into operational firmware should not take longer than
+     * 1 second. However if that happens, then just fail the setup
+     * since something went wrong.
+     */
+    err = WaitForDeviceBoot(mBluetoothFamily->GetCurrentTime(), mHardwareVariantInfo ? mHardwareVariantInfo->deviceBootTimeout : kIntelDeviceBootTimeout);
+    if ( err == kIOReturnTimeout )
+        goto reset;
+
+    RecordSetupPhase(kBluetoothIntelSetupPhaseBootDevice, callTime);
+
+    return kIOReturnSuccess;
+}
+
+UInt32 IntelBluetoothHostController::GetWaitDeadline(BluetoothIntelWait wait, UInt32 deadline)
+{
+    static const UInt32 floors[kBluetoothIntelWaitCount] = { kIntelResetToBootloaderDelay, 500, 100 }; // milliseconds
+    BluetoothIntelWaitStatistics statistics;
+    UInt64 learned;
+    UInt64 longest;
+
+    sSharedStoreLock.Lock();
+    statistics = sWaitStatistics[wait];
+    sSharedStoreLock.Unlock();
+
+    if ( statistics.samples < kIntelAdaptiveWaitMinSamples )
+        return deadline;
+
+    learned = (statistics.maxObserved * kIntelAdaptiveWaitMultiplier + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+    longest = (statistics.maxObserved + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+    if ( learned < longest + kIntelAdaptiveWaitMargin )
+        learned = longest + kIntelAdaptiveWaitMargin;
+    if ( learned < floors[wait] + kIntelAdaptiveWaitMargin )
+        learned = floors[wait] + kIntelAdaptiveWaitMargin;
+    if ( learned > deadline )
+        learned = deadline;
+
+    return (UInt32) learned;
+}
+
+UInt64 IntelBluetoothHostController::RecordWait(BluetoothIntelWait wait, UInt32 deadline, UInt64 elapsed, IOReturn result, bool fixedDelay)
+{
+    BluetoothIntelWaitStatistics * statistics = &sWaitStatistics[wait];
+    UInt64 cost;
+    UInt64 saved = 0;
+
+    /* What the wait used to cost: the whole delay, or the whole
+     * static deadline whenever the signal did not come.
+     */
+    cost = elapsed;
+    if ( fixedDelay || result )
+        cost = (UInt64) deadline * NSEC_PER_MSEC;
+    if ( cost > elapsed )
+        saved = cost - elapsed;
+
+    sSharedStoreLock.Lock();
+    statistics->timeSaved += saved;
+    statistics->lastObserved = elapsed;
+
+    if ( result == kIOReturnSuccess )
+    {
+        ++statistics->samples;
+        if ( elapsed > statistics->maxObserved )
+            statistics->maxObserved = elapsed;
+    }
+    else if ( result == kIOReturnTimeout )
+    {
+        ++statistics->timeouts;
+        statistics->samples = 0;
+        statistics->maxObserved = 0;
+    }
+    sSharedStoreLock.Unlock();
+
+    return saved;
+}
+
+IOReturn IntelBluetoothHostController::WaitForSignal(BluetoothIntelWait wait, bool * pending, UInt32 deadline, bool fixedDelay)
+{
+    IOReturn err = kIOReturnSuccess;
+    AbsoluteTime waitTime = mBluetoothFamily->GetCurrentTime();
+    UInt32 waitDeadline = GetWaitDeadline(wait, deadline);
+    UInt64 elapsed;
+    UInt64 saved;
+
+    /* The signal may already have come in while the gate was open for
+     * the command that triggered it.
+     */
+    if ( *pending && !mTransportTerminating )
+        err = ControllerCommandSleep(pending, waitDeadline, (char *) __FUNCTION__, true);
+
+    if ( err != THREAD_INTERRUPTED )
+    {
+        if ( !*pending )
+            err = kIOReturnSuccess;
+        else if ( mTransportTerminating )
+            err = kIOReturnNoDevice;
+        else
+            err = kIOReturnTimeout;
+    }
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - waitTime, &elapsed);
+    saved = RecordWait(wait, deadline, elapsed, err, fixedDelay);
+    if ( mCurrentBootProfile )
+        mCurrentBootProfile->waitTimeSaved += saved;
+
+    if ( err == kIOReturnTimeout && waitDeadline < deadline )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForSignal] -- Wait %u timed out after the learned deadline of %u ms (static deadline: %u ms) ****\n", wait, waitDeadline, deadline);
+
+    PublishWaitStatistics();
+    return err;
+}
+
+void IntelBluetoothHostController::TransportWillTerminate()
+{
+    if ( mCommandGate )
+        mCommandGate->runAction(TransportWillTerminateAction);
+}
+
+IOReturn IntelBluetoothHostController::TransportWillTerminateAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    if ( !object )
+        return kIOReturnBadArgument;
+    object->TransportWillTerminateWL();
+    return kIOReturnSuccess;
+}
+
+void IntelBluetoothHostController::TransportWillTerminateWL()
+{
+    mTransportTerminating = true;
+
+    /* A terminating transport is what a reset to the bootloader is
+     * waiting for; every other wait is cut short.
+     */
+    mBootloaderResetPending = false;
+    mCommandGate->commandWakeup(&mBootloaderResetPending);
+    mCommandGate->commandWakeup(&mDownloading);
+    mCommandGate->commandWakeup(&mBooting);
+
+    if ( mFirmwareUpgradeThreadCall )
+        thread_call_cancel(mFirmwareUpgradeThreadCall);
+    if ( mStatisticsThreadCall )
+        thread_call_cancel(mStatisticsThreadCall);
+
+    /* Leases still held are returned as they end, and are deleted then. */
+    DrainRequestPool();
+}
+
+void IntelBluetoothHostController::PublishWaitStatistics()
+{
+    static const char * waitNames[kBluetoothIntelWaitCount] = { "ResetToBootloader", "FirmwareDownload", "DeviceBoot" };
+    static const UInt32 deadlines[kBluetoothIntelWaitCount] = { kIntelResetToBootloaderDelay, kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout };
+    OSDictionary * statistics;
+    OSDictionary * dict;
+    BluetoothIntelWaitStatistics snapshot[kBluetoothIntelWaitCount];
+    BluetoothIntelWaitStatistics * wait;
+
+    statistics = OSDictionary::withCapacity(kBluetoothIntelWaitCount);
+    if ( !statistics )
+        return;
+
+    sSharedStoreLock.Lock();
+    memcpy(snapshot, sWaitStatistics, sizeof(snapshot));
+    sSharedStoreLock.Unlock();
+
+    /* times in microseconds, deadlines in milliseconds */
+    for ( int i = 0; i < kBluetoothIntelWaitCount; ++i )
+    {
+        wait = &snapshot[i];
+
+        const BluetoothIntelStatistic waitStatistics[] =
+        {
+            { "Samples",      wait->samples,                                       32 },
+            { "Timeouts",     wait->timeouts,                                      32 },
+            { "LastObserved", wait->lastObserved / NSEC_PER_USEC,                  64 },
+            { "MaxObserved",  wait->maxObserved / NSEC_PER_USEC,                   64 },
+            { "Deadline",     GetWaitDeadline((BluetoothIntelWait) i, deadlines[i]), 32 },
+            { "TimeSaved",    wait->timeSaved / NSEC_PER_USEC,                     64 }
+        };
+
+        dict = CreateStatisticsDictionary(waitStatistics, sizeof(waitStatistics) / sizeof(waitStatistics[0]));
+        if ( !dict )
+            continue;
+
+        statistics->setObject(waitNames[i], dict);
+        dict->release();
+    }
+
+    setProperty("WaitStatistics", statistics);
+    statistics->release();
+}
+
+IOReturn IntelBluetoothHostController::WarmResumeController()
+{
+    IOReturn err;
+    AbsoluteTime phaseTime;
+    BluetoothIntelControllerFingerprint fingerprint;
+    IntelBluetoothManufacturerModeSession session(this);
+
+    /* The identity cache is bypassed: a controller that silently lost
+     * power comes back in the bootloader.
+     */
+    phaseTime = mBluetoothFamily->GetCurrentTime();
+    err = ReadControllerFingerprint(&fingerprint, false);
+    RecordSetupPhase(kBluetoothIntelSetupPhaseFingerprint, phaseTime);
+    if ( err )
+        return err;
+
+    if ( memcmp(&fingerprint, &mFingerprint, sizeof(BluetoothIntelControllerFingerprint)) )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WarmResumeController] -- Fingerprint mismatch: firmware variant 0x%02x build %u, expected 0x%02x build %u ****\n", fingerprint.firmwareVariant, fingerprint.firmwareBuild, mFingerprint.firmwareVariant, mFingerprint.firmwareBuild);
+        return kIOReturnNotFound;
+    }
+
+    /* Generation 1 controllers have neither a DDC file nor a quality
+     * report, which has to stay the last step.
+     */
+    BluetoothIntelSetupStep steps[] =
+    {
+        { "ReapplyDDCConfig", ReapplyDDCConfigStepAction, NULL, NULL, NULL, 0,      false },
+        { "EventMask",        EventMaskStepAction,        NULL, NULL, NULL, 0,      false },
+        { "QualityReport",    QualityReportStepAction,    NULL, NULL, NULL, 1 << 0, false }
+    };
+
+    /* Legacy ROM devices take the event mask in the manufacturer mode,
+     * which is held across all the steps.
+     */
+    if ( mGeneration == 1 )
+    {
+        err = session.Begin();
+        if ( err )
+            return err;
+    }
+
+    err = RunSetupSteps(steps, sizeof(steps) / sizeof(steps[0]) - (mGeneration < 2 ? 1 : 0));
+    if ( !err )
+        err = session.End();
+    if ( err )
+        return err;
+
+    if ( mCurrentBootProfile )
+        mCurrentBootProfile->warmResume = true;
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WarmResumeController] -- Controller kept its operational firmware, skipped full setup. ****\n");
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::ReadControllerFingerprint(BluetoothIntelControllerFingerprint * fingerprint, bool cached)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    BluetoothIntelVersionInfo * version;
+    BluetoothIntelVersionInfoTLV versionTLV;
+    IntelBluetoothHostControllerUSBTransport * transport = OSDynamicCast(IntelBluetoothHostControllerUSBTransport, mBluetoothTransport);
+
+    if ( !fingerprint || !transport || !mCachedVersionInfoTLV )
+        return kIOReturnInvalid;
+
+    /* Read straight into the identity cache, so that mVersionInfo
+     * keeps what the setup read last.
+     */
+    if ( cached && IsControllerIdentityCached(kBluetoothIntelIdentityCacheSlotVersionInfoTLV) )
+        ++mIdentityCacheHits;
+    else
+    {
+        err = lease.Acquire(&id);
+        if ( err )
+        {
+            REQUIRE_NO_ERR(err);
+            return err;
+        }
+        err = BluetoothHCIIntelReadVersionInfo(id, 0xFF, mCachedVersionInfoTLV);
+        lease.Release();
+        if ( err )
+            return err;
+
+        ++mIdentityCacheMisses;
+        mIdentityCache[kBluetoothIntelIdentityCacheSlotVersionInfoTLV].epoch = mIdentityEpoch;
+        mIdentityCache[kBluetoothIntelIdentityCacheSlotVersionInfoTLV].valid = true;
+    }
+    PublishIdentityCacheStatistics();
+
+    bzero(fingerprint, sizeof(BluetoothIntelControllerFingerprint));
+
+    /* Legacy devices answer with the legacy version information. */
+    version = (BluetoothIntelVersionInfo *) mCachedVersionInfoTLV;
+    if ( version->hardwarePlatform == 0x37 )
+    {
+        fingerprint->hardware = (version->hardwarePlatform << 16) | (version->hardwareVariant << 8) | version->hardwareRevision;
+        fingerprint->firmwareBuild = (version->firmwareBuildNum << 16) | (version->firmwareBuildWeek << 8) | version->firmwareBuildYear;
+        fingerprint->firmwareVariant = version->firmwareVariant;
+        fingerprint->patchVersion = version->firmwarePatchVersion;
+        fingerprint->operational = version->firmwareVariant == kBluetoothHCIIntelFirmwareVariantFirmware || version->firmwarePatchVersion;
+        return kIOReturnSuccess;
+    }
+
+    err = transport->ParseVersionInfoTLV(&versionTLV, mCachedVersionInfoTLV, kMaxHCIBufferLength * 4);
+    if ( err )
+        return err;
+
+    fingerprint->hardware = versionTLV.cnviBT;
+    fingerprint->firmwareBuild = versionTLV.buildNumber;
+    fingerprint->timestamp = versionTLV.timestamp;
+    fingerprint->firmwareVariant = versionTLV.imageType;
+    fingerprint->operational = versionTLV.imageType == kBluetoothHCIIntelImageTypeFirmware;
+    return kIOReturnSuccess;
+}
+
+void IntelBluetoothHostController::RecordControllerFingerprint()
+{
+    BluetoothIntelControllerFingerprint fingerprint;
+
+    mFingerprintValid = false;
+    if ( ReadControllerFingerprint(&fingerprint, true) )
+        return;
+
+    /* A controller left in the bootloader cannot be resumed. */
+    if ( !fingerprint.operational )
+        return;
+
+    mFingerprint = fingerprint;
+    mFingerprintValid = true;
+}
+
+void IntelBluetoothHostController::PublishWarmResumeStatistics()
+{
+    /* latencies in microseconds */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Resumes",     mWarmResumeStatistics.resumes,                     32 },
+        { "Fallbacks",   mWarmResumeStatistics.fallbacks,                   32 },
+        { "LastLatency", mWarmResumeStatistics.lastLatency / NSEC_PER_USEC, 64 },
+        { "MaxLatency",  mWarmResumeStatistics.maxLatency / NSEC_PER_USEC,  64 }
+    };
+
+    PublishStatistics("WarmResume", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+IOReturn IntelBluetoothHostController::ReplayPostBootConfig()
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    AbsoluteTime callTime;
+    UInt64 duration;
+    BluetoothIntelControllerFingerprint fingerprint;
+    BluetoothIntelConfigRecording * recording = mConfigRecording;
+    bool found = false;
+    BluetoothIntelVersionInfoTLV version;
+    BluetoothHCICommandOpCode opCode;
+    UInt8 paramSize = 0;
+    UInt8 * params;
+    UInt32 offset;
+    IntelBluetoothHostControllerUSBTransport * transport = (IntelBluetoothHostControllerUSBTransport *) mBluetoothTransport;
+
+    /* Only a hint, the recordings are looked up under the lock. */
+    if ( !transport || !recording || !sConfigRecordingCount )
+        return kIOReturnNotFound;
+
+    callTime = mBluetoothFamily->GetCurrentTime();
+
+    /* The operational firmware reports its own build, which is what the
+     * recordings are keyed by.
+     */
+    if ( mGeneration == 3 )
+    {
+        err = CallBluetoothHCIIntelReadVersionInfo(0xFF);
+        if ( err )
+            return err;
+    }
+    err = ReadControllerFingerprint(&fingerprint, true);
+    if ( err )
+        return err;
+
+    sSharedStoreLock.Lock();
+    for ( int i = 0; i < kIntelConfigRecordingSlots; ++i )
+    {
+        if ( sConfigRecordings[i].valid && !memcmp(&sConfigRecordings[i].fingerprint, &fingerprint, sizeof(BluetoothIntelControllerFingerprint)) )
+        {
+            memcpy(recording, &sConfigRecordings[i], sizeof(BluetoothIntelConfigRecording));
+            found = true;
+            break;
+        }
+    }
+    sSharedStoreLock.Unlock();
+    if ( !found )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ReplayPostBootConfig] -- No configuration recorded for firmware variant 0x%02x build %u ****\n", fingerprint.firmwareVariant, fingerprint.firmwareBuild);
+        return kIOReturnNotFound;
+    }
+
+    for ( offset = 0; offset + 3 <= recording->length; offset += 3 + paramSize )
+    {
+        opCode = OSReadLittleInt16(recording->commands, offset);
+        paramSize = recording->commands[offset + 2];
+        params = recording->commands + offset + 3;
+
+        err = lease.Acquire(&id);
+        if ( err )
+        {
+            REQUIRE_NO_ERR(err);
+            goto FALLBACK;
+        }
+        err = PrepareRequestForNewCommand(id, NULL, 0xFFFF);
+        if ( !err )
+            err = SendHCIRequestFormatted(id, opCode, 0, NULL, "Hbn", opCode, paramSize, paramSize, params);
+        lease.Release();
+        if ( err )
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ReplayPostBootConfig] -- opCode = 0x%04X failed: 0x%x ****\n", opCode, err);
+            goto FALLBACK;
+        }
+
+        /* Keep what the full configuration would have left behind. */
+        if ( opCode == 0xFC8B && paramSize >= sizeof(UInt8) + sizeof(UInt16) )
+            UpdateDDCCache(params);
+        else if ( opCode == 0xFC52 )
+            mSetupEventMaskSet = true;
+    }
+
+    if ( mGeneration == 2 )
+    {
+        err = CallBluetoothHCIIntelReadVersionInfo(0x00);
+        if ( err )
+            goto FALLBACK;
+        PrintVersionInfo((BluetoothIntelVersionInfo *) mVersionInfo);
+    }
+    else
+    {
+        /* The offload configuration only reads, so it is not in the
+         * recording, but the full configuration runs it on these.
+         */
+        err = ConfigureOffloadStepAction(this, NULL, NULL, NULL, NULL);
+        if ( err )
+            goto FALLBACK;
+        if ( !transport->ParseVersionInfoTLV(&version, mVersionInfo, kMaxHCIBufferLength * 4) )
+            PrintVersionInfo(&version);
+    }
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
+    ++sRecoveryStatistics.replays;
+    mConfigReplayed = true;
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ReplayPostBootConfig] -- Replayed %u recorded command(s) in %llu usecs ****\n", recording->numCommands, duration / 1000);
+    recording->valid = false;
+    return kIOReturnSuccess;
+
+FALLBACK:
+    /* Whatever was replayed is overwritten by the full configuration,
+     * which records it again.
+     */
+    sSharedStoreLock.Lock();
+    for ( int i = 0; i < kIntelConfigRecordingSlots; ++i )
+    {
+        if ( sConfigRecordings[i].valid && !memcmp(&sConfigRecordings[i].fingerprint, &fingerprint, sizeof(BluetoothIntelControllerFingerprint)) )
+            sConfigRecordings[i].valid = false;
+    }
+    sSharedStoreLock.Unlock();
+    recording->valid = false;
+    mSetupEventMaskSet = false;
+    InvalidateDDCCache(false);
+    ++sRecoveryStatistics.replayFallbacks;
+    return err;
+}
+
+void IntelBluetoothHostController::RecordConfigCommand(BluetoothHCICommandOpCode opCode, const UInt8 * params, UInt8 paramSize)
+{
+    if ( !mConfigRecording || !mConfigRecording->valid )
+        return;
+
+    /* A truncated recording is useless, drop it. */
+    if ( mConfigRecording->length + 3 + paramSize > kIntelConfigRecordingSize )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RecordConfigCommand] -- Configuration too large to record ****\n");
+        mConfigRecording->valid = false;
+        return;
+    }
+
+    OSWriteLittleInt16(mConfigRecording->commands, mConfigRecording->length, opCode);
+    mConfigRecording->commands[mConfigRecording->length + 2] = paramSize;
+    memcpy(mConfigRecording->commands + mConfigRecording->length + 3, params, paramSize);
+    mConfigRecording->length += 3 + paramSize;
+    ++mConfigRecording->numCommands;
+}
+
+void IntelBluetoothHostController::StoreConfigRecording()
+{
+    BluetoothIntelConfigRecording * slot = NULL;
+
+    if ( !mConfigRecording || !mConfigRecording->valid || !mFingerprintValid )
+        return;
+
+    mConfigRecording->fingerprint = mFingerprint;
+
+    /* Replace the recording of the same build, or the oldest one. */
+    sSharedStoreLock.Lock();
+    for ( int i = 0; i < kIntelConfigRecordingSlots; ++i )
+    {
+        if ( sConfigRecordings[i].valid && !memcmp(&sConfigRecordings[i].fingerprint, &mFingerprint, sizeof(BluetoothIntelControllerFingerprint)) )
+        {
+            slot = &sConfigRecordings[i];
+            break;
+        }
+    }
+    if ( !slot )
+        slot = &sConfigRecordings[sConfigRecordingCount++ % kIntelConfigRecordingSlots];
+
+    memcpy(slot, mConfigRecording, sizeof(BluetoothIntelConfigRecording));
+    sSharedStoreLock.Unlock();
+    mConfigRecording->valid = false;
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][StoreConfigRecording] -- Recorded %u configuration command(s) for firmware build %u ****\n", mConfigRecording->numCommands, mFingerprint.firmwareBuild);
+}
+
+bool IntelBluetoothHostController::DeferFirmwareUpgrade(UInt8 number, UInt8 week, UInt8 year)
+{
+    UInt64 deadline;
+
+    if ( !mDeferFirmwareUpgrade || mTransportTerminating )
+        return false;
+
+    if ( !mFirmwareUpgradeThreadCall )
+    {
+        mFirmwareUpgradeThreadCall = thread_call_allocate(FirmwareUpgradeThreadCall, this);
+        if ( !mFirmwareUpgradeThreadCall )
+            return false;
+    }
+
+    mFirmwareUpgrade.pending = true;
+    mFirmwareUpgrade.runningBuildNumber = number;
+    mFirmwareUpgrade.runningBuildWeek = week;
+    mFirmwareUpgrade.runningBuildYear = year;
+    mFirmwareUpgrade.idleChecks = 0;
+    mFirmwareUpgrade.deferredTime = 0;
+    mFirmwareUpgradeDeferTime = mBluetoothFamily->GetCurrentTime();
+
+    clock_interval_to_deadline(kIntelFirmwareUpgradeIdleInterval, kMillisecondScale, &deadline);
+    thread_call_enter_delayed(mFirmwareUpgradeThreadCall, deadline);
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][DeferFirmwareUpgrade] -- Running firmware %u-%u.%u, upgrade to %u-%u.%u deferred until idle ****\n", number, week, year, mFirmwareUpgrade.availableBuildNumber, mFirmwareUpgrade.availableBuildWeek, mFirmwareUpgrade.availableBuildYear);
+    PublishFirmwareUpgrade();
+    return true;
+}
+
+void IntelBluetoothHostController::FirmwareUpgradeThreadCall(thread_call_param_t owner, thread_call_param_t arg)
+{
+    IntelBluetoothHostController * that = (IntelBluetoothHostController *) owner;
+    that->mCommandGate->runAction(FirmwareUpgradeAction);
+}
+
+IOReturn IntelBluetoothHostController::FirmwareUpgradeAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    if ( !object )
+        return kIOReturnBadArgument;
+    object->RunDeferredFirmwareUpgradeWL();
+    return kIOReturnSuccess;
+}
+
+void IntelBluetoothHostController::RunDeferredFirmwareUpgradeWL()
+{
+    UInt64 deadline;
+    IOReturn err;
+
+    if ( !mFirmwareUpgrade.pending || mTransportTerminating )
+        return;
+
+    ++mFirmwareUpgrade.idleChecks;
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - mFirmwareUpgradeDeferTime, &mFirmwareUpgrade.deferredTime);
+
+    /* Not while the controller is being set up or has connections. */
+    if ( mSetupState != kBluetoothIntelSetupStateDone || mActiveConnections )
+    {
+        clock_interval_to_deadline(kIntelFirmwareUpgradeIdleInterval, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(mFirmwareUpgradeThreadCall, deadline);
+        PublishFirmwareUpgrade();
+        return;
+    }
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunDeferredFirmwareUpgradeWL] -- Controller idle, upgrading firmware to %u-%u.%u after %llu secs ****\n", mFirmwareUpgrade.availableBuildNumber, mFirmwareUpgrade.availableBuildWeek, mFirmwareUpgrade.availableBuildYear, mFirmwareUpgrade.deferredTime / NSEC_PER_SEC);
+
+    /* The controller comes back in the bootloader and re-enumerates,
+     * so the next setup downloads the new firmware. It must not be
+     * resumed on the old one.
+     */
+    mFirmwareUpgrade.pending = false;
+    mFingerprintValid = false;
+    PublishFirmwareUpgrade();
+
+    err = ResetToBootloader(false);
+    if ( err )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunDeferredFirmwareUpgradeWL] -- Failed to reset to bootloader: 0x%x ****\n", err);
+}
+
+void IntelBluetoothHostController::PublishFirmwareUpgrade()
+{
+    static const char * versionNames[2] = { "RunningFirmware", "AvailableFirmware" };
+    const UInt8 versions[2][3] =
+    {
+        { mFirmwareUpgrade.runningBuildNumber,   mFirmwareUpgrade.runningBuildWeek,   mFirmwareUpgrade.runningBuildYear   },
+        { mFirmwareUpgrade.availableBuildNumber, mFirmwareUpgrade.availableBuildWeek, mFirmwareUpgrade.availableBuildYear }
+    };
+    /* time in seconds */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "IdleChecks",   mFirmwareUpgrade.idleChecks,                  32 },
+        { "DeferredTime", mFirmwareUpgrade.deferredTime / NSEC_PER_SEC, 64 }
+    };
+    OSDictionary * upgrade;
+    OSString * string;
+    char version[16];
+
+    upgrade = CreateStatisticsDictionary(statistics, sizeof(statistics) / sizeof(statistics[0]));
+    if ( !upgrade )
+        return;
+
+    upgrade->setObject("Pending", mFirmwareUpgrade.pending ? kOSBooleanTrue : kOSBooleanFalse);
+    for ( int i = 0; i < 2; ++i )
+    {
+        snprintf(version, sizeof(version), "%u-%u.%u", versions[i][0], versions[i][1], versions[i][2]);
+        string = OSString::withCString(version);
+        if ( string )
+        {
+            upgrade->setObject(versionNames[i], string);
+            string->release();
+        }
+    }
+
+    setProperty("PendingFirmwareUpgrade", upgrade);
+    upgrade->release();
+}
+
+void IntelBluetoothHostController::NoteHardReset()
+{
+    sHardResetTime = mach_absolute_time();
+}
+
+static IOByteCount PackCommandFormatted(UInt8 * buffer, IOByteCount size, const char * format, ...)
+{
+    va_list va;
+    IOByteCount packed;
+
+    va_start(va, format);
+    packed = PackDataList(buffer, (UInt32) size, format, va);
+    va_end(va);
+
+    return packed;
+}
+
+OSDictionary * IntelBluetoothHostController::CreateStatisticsDictionary(const BluetoothIntelStatistic * statistics, UInt32 count)
+{
+    OSDictionary * dict;
+    OSNumber * number;
+
+    dict = OSDictionary::withCapacity(count);
+    if ( !dict )
+        return NULL;
+
+    for ( UInt32 i = 0; i < count; ++i )
+    {
+        number = OSNumber::withNumber(statistics[i].value, statistics[i].bits);
+        if ( !number )
+            continue;
+        dict->setObject(statistics[i].key, number);
+        number->release();
+    }
+
+    return dict;
+}
+
+void IntelBluetoothHostController::PublishStatistics(const char * key, const BluetoothIntelStatistic * statistics, UInt32 count)
+{
+    OSDictionary * dict = CreateStatisticsDictionary(statistics, count);
+
+    if ( !dict )
+        return;
+
+    setProperty(key, dict);
+    dict->release();
+}
+
+IOReturn IntelBluetoothHostController::setProperties(OSObject * properties)
+{
+    OSDictionary * dict = OSDynamicCast(OSDictionary, properties);
+    OSBoolean * measurePacking;
+    OSBoolean * measureDecoding;
+
+    if ( !dict )
+        return super::setProperties(properties);
+
+    measurePacking = OSDynamicCast(OSBoolean, dict->getObject("MeasureCommandPacking"));
+    measureDecoding = OSDynamicCast(OSBoolean, dict->getObject("MeasureResponseDecoding"));
+    if ( !measurePacking && !measureDecoding )
+        return super::setProperties(properties);
+
+    if ( IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) )
+        return kIOReturnNotPrivileged;
+
+    if ( measurePacking && measurePacking->isTrue() )
+        MeasureCommandPacking();
+    if ( measureDecoding && measureDecoding->isTrue() )
+        MeasureResponseDecoding();
+    return kIOReturnSuccess;
+}
+
+void IntelBluetoothHostController::MeasureCommandPacking()
+{
+    UInt8 buffer[kMaxHCIBufferLength];
+    UInt8 checksum = 0;
+    UInt8 seed;
+    AbsoluteTime startTime;
+    UInt64 elapsed;
+    BluetoothIntelCommandSetEventMask params;
+
+    /* Set Event Mask, the command sent most during setup, packed both
+     * ways into the same buffer. The last mask byte comes from the clock
+     * so that neither loop can be folded at compile time, and every byte
+     * packed goes into the checksum.
+     */
+    seed = (UInt8) mach_absolute_time();
+
+    startTime = mach_absolute_time();
+    for ( UInt32 i = 0; i < kIntelCommandPackingSamples; ++i )
+    {
+        params = IntelVendorEventMask(i & 1);
+        params.mask[7] = (UInt8) (seed + i);
+        PackCommandFormatted(buffer, sizeof(buffer), "Hbbbbbbbbb", 0xFC52, 8, params.mask[0], params.mask[1], params.mask[2], params.mask[3], params.mask[4], params.mask[5], params.mask[6], params.mask[7]);
+        for ( UInt32 j = 0; j < sizeof(BluetoothIntelSetEventMaskPacket); ++j )
+            checksum ^= buffer[j];
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsed);
+    sCommandPackingStatistics.formattedTime = elapsed / kIntelCommandPackingSamples;
+
+    startTime = mach_absolute_time();
+    for ( UInt32 i = 0; i < kIntelCommandPackingSamples; ++i )
+    {
+        params = IntelVendorEventMask(i & 1);
+        params.mask[7] = (UInt8) (seed + i);
+        BluetoothIntelSetEventMaskPacket packet(params);
+        memcpy(buffer, &packet, packet.Size());
+        for ( UInt32 j = 0; j < sizeof(BluetoothIntelSetEventMaskPacket); ++j )
+            checksum ^= buffer[j];
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsed);
+    sCommandPackingStatistics.typedTime = elapsed / kIntelCommandPackingSamples;
+    sCommandPackingStatistics.samples = kIntelCommandPackingSamples;
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][MeasureCommandPacking] -- Set Event Mask packed in %llu ns formatted, %llu ns typed (0x%02x) ****\n", sCommandPackingStatistics.formattedTime, sCommandPackingStatistics.typedTime, checksum);
+
+    /* times in nanoseconds per command */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Samples",           sCommandPackingStatistics.samples,       32 },
+        { "FormattedPackTime", sCommandPackingStatistics.formattedTime, 64 },
+        { "TypedPackTime",     sCommandPackingStatistics.typedTime,     64 }
+    };
+    PublishStatistics("CommandPacking", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+void IntelBluetoothHostController::MeasureResponseDecoding()
+{
+    BluetoothIntelRecordedResponse * corpus;
+    UInt32 count = 0;
+    UInt8 outData[kIntelCommandMaxParamLength];
+    UInt32 outDataSize;
+    UInt8 outStatus;
+    UInt32 rejected = 0;
+    AbsoluteTime startTime;
+    UInt64 elapsed;
+
+    corpus = IONewZero(BluetoothIntelRecordedResponse, kIntelRecordedResponseSlots);
+    if ( !corpus )
+        return;
+
+    mCommandGate->runAction(CopyRecordedResponsesAction, corpus, &count);
+    if ( !count )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][MeasureResponseDecoding] -- No vendor command response recorded yet ****\n");
+        IOSafeDeleteNULL(corpus, BluetoothIntelRecordedResponse, kIntelRecordedResponseSlots);
+        return;
+    }
+
+    startTime = mach_absolute_time();
+    for ( UInt32 i = 0; i < kIntelResponseDecodingSamples; ++i )
+    {
+        for ( UInt32 j = 0; j < count; ++j )
+        {
+            if ( ParseIntelVendorSpecificCommand(corpus[j].ocf, corpus[j].data, corpus[j].size, outData, &outDataSize, &outStatus) )
+                ++rejected;
+        }
+    }
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsed);
+    IOSafeDeleteNULL(corpus, BluetoothIntelRecordedResponse, kIntelRecordedResponseSlots);
+
+    sResponseDecodingStatistics.samples = kIntelResponseDecodingSamples * count;
+    sResponseDecodingStatistics.rejected = rejected;
+    sResponseDecodingStatistics.decodeTime = elapsed / sResponseDecodingStatistics.samples;
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][MeasureResponseDecoding] -- Decoded %u recorded responses in %llu ns each, %u rejected ****\n", sResponseDecodingStatistics.samples, sResponseDecodingStatistics.decodeTime, rejected);
+
+    /* times in nanoseconds per response */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Samples",    sResponseDecodingStatistics.samples,    32 },
+        { "Rejected",   sResponseDecodingStatistics.rejected,   32 },
+        { "DecodeTime", sResponseDecodingStatistics.decodeTime, 64 }
+    };
+
+    PublishStatistics("ResponseDecoding", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+void IntelBluetoothHostController::RecordVendorResponse(UInt16 ocf, const UInt8 * data, UInt32 size)
+{
+    BluetoothIntelRecordedResponse * response = NULL;
+
+    if ( !mRecordedResponses || !size || size > kIntelCommandMaxParamLength )
+        return;
+
+    for ( UInt32 i = 0; i < mRecordedResponseCount; ++i )
+    {
+        if ( mRecordedResponses[i].ocf == ocf )
+        {
+            response = &mRecordedResponses[i];
+            break;
+        }
+    }
+    if ( !response )
+    {
+        if ( mRecordedResponseCount >= kIntelRecordedResponseSlots )
+            return;
+        response = &mRecordedResponses[mRecordedResponseCount++];
+    }
+
+    response->ocf = ocf;
+    response->size = size;
+    memcpy(response->data, data, size);
+}
+
+IOReturn IntelBluetoothHostController::CopyRecordedResponsesAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    if ( !object || !object->mRecordedResponses )
+        return kIOReturnBadArgument;
+
+    memcpy(arg0, object->mRecordedResponses, object->mRecordedResponseCount * sizeof(BluetoothIntelRecordedResponse));
+    *(UInt32 *) arg1 = object->mRecordedResponseCount;
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::SendTeardownCommand(BluetoothHCICommandOpCode opCode, UInt32 timeout)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+
+    err = HCIRequestCreate(&id, true, timeout);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendTeardownCommand] -- HCIRequestCreate() failed: 0x%x ****\n", err);
+        return err;
     }
 
-    /* Patching completed successfully and disable the manufacturer mode
-     * with reset and activate the downloaded firmware patches.
-     */
-    err = HCIRequestCreate(&id);
+    err = PrepareRequestForNewCommand(id, NULL, 0xFFFF);
     if ( err )
     {
-        REQUIRE_NO_ERR(err);
-        return err;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendTeardownCommand] -- Failed to prepare request for new command: 0x%x ****\n", err);
+        goto OVER;
     }
-    err = BluetoothHCIIntelExitManufacturerMode(id, kBluetoothIntelManufacturingExitResetOptionResetActivatePatches);
+
+    err = SendHCIRequestFormatted(id, opCode, 0, NULL, "Hb", opCode, 0);
+    if ( err )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SendTeardownCommand] ### ERROR: opCode = 0x%04X -- send request failed within %u ms: 0x%x ****\n", opCode, timeout, err);
+
+OVER:
     HCIRequestDelete(NULL, id);
+    return err;
+}
+
+void IntelBluetoothHostController::RecordTeardown(UInt64 elapsed, bool expired, UInt32 skippedCommands)
+{
+    ++sTeardownStatistics.teardowns;
+    if ( expired )
+        ++sTeardownStatistics.expired;
+    sTeardownStatistics.skippedCommands += skippedCommands;
+    sTeardownStatistics.lastLatency = elapsed;
+    if ( elapsed > sTeardownStatistics.worstLatency )
+        sTeardownStatistics.worstLatency = elapsed;
+}
+
+void IntelBluetoothHostController::PublishTeardownStatistics()
+{
+    /* latencies in microseconds, the deadline in milliseconds */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Teardowns",       sTeardownStatistics.teardowns,                    32 },
+        { "Expired",         sTeardownStatistics.expired,                      32 },
+        { "SkippedCommands", sTeardownStatistics.skippedCommands,              32 },
+        { "LastLatency",     sTeardownStatistics.lastLatency / NSEC_PER_USEC,  64 },
+        { "WorstLatency",    sTeardownStatistics.worstLatency / NSEC_PER_USEC, 64 },
+        { "Deadline",        kIntelTeardownTimeout,                            32 }
+    };
+
+    PublishStatistics("TeardownStatistics", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+IOReturn IntelBluetoothHostController::AcquireRequest(BluetoothHCIRequestID * outID)
+{
+    IOReturn err;
+
+    if ( !outID )
+        return kIOReturnBadArgument;
+
+    IOLockLock(mRequestPoolLock);
+    if ( mRequestPoolCount )
+    {
+        *outID = mRequestPool[--mRequestPoolCount];
+        ++mRequestLeases;
+        ++sRequestPoolStatistics.hits;
+        IOLockUnlock(mRequestPoolLock);
+        return kIOReturnSuccess;
+    }
+    IOLockUnlock(mRequestPoolLock);
+
+    err = HCIRequestCreate(outID, true, kIntelRequestPoolTimeout);
     if ( err )
         return err;
 
-    /* Need build number for downloaded fw patches in
-     * every power-on boot
+    IOLockLock(mRequestPoolLock);
+    ++mRequestLeases;
+    ++sRequestPoolStatistics.misses;
+    IOLockUnlock(mRequestPoolLock);
+    return kIOReturnSuccess;
+}
+
+void IntelBluetoothHostController::ReleaseRequest(BluetoothHCIRequestID inID)
+{
+    IOBluetoothHCIRequest * request;
+    bool reusable;
+
+    /* A request whose command failed may still be waiting on the
+     * controller, so it is not handed out again. The timeout may have
+     * been tightened by SetHCIRequestRequireEvents.
      */
-    err = CallBluetoothHCIIntelReadVersionInfo(0x00);
-    if ( err )
-        return err;
+    reusable = !LookupRequest(inID, &request) && request && !request->mStatus && request->mState != kHCIRequestStateWaiting;
+    if ( reusable )
+        request->mTimeout = kIntelRequestPoolTimeout;
+
+    IOLockLock(mRequestPoolLock);
+    if ( mRequestLeases )
+        --mRequestLeases;
+    if ( reusable && !mTransportTerminating && mRequestPoolCount < kIntelRequestPoolSize )
+    {
+        mRequestPool[mRequestPoolCount++] = inID;
+        IOLockUnlock(mRequestPoolLock);
+        return;
+    }
+    ++sRequestPoolStatistics.discarded;
+    IOLockUnlock(mRequestPoolLock);
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen1Controller] -- Patch (0x%02x) completed and activated. ****\n", ((BluetoothIntelVersionInfo *) mVersionInfo)->firmwarePatchVersion);
+    HCIRequestDelete(NULL, inID);
+}
 
-complete:
-    CheckDeviceAddress();
+void IntelBluetoothHostController::DrainRequestPool()
+{
+    BluetoothHCIRequestID pool[kIntelRequestPoolSize];
+    UInt32 count;
 
-    return kIOReturnSuccess;
+    IOLockLock(mRequestPoolLock);
+    count = mRequestPoolCount;
+    memcpy(pool, mRequestPool, count * sizeof(BluetoothHCIRequestID));
+    mRequestPoolCount = 0;
+    IOLockUnlock(mRequestPoolLock);
+
+    while ( count )
+        HCIRequestDelete(NULL, pool[--count]);
 }
 
-IOReturn IntelBluetoothHostController::SetupGen2Controller()
+void IntelBluetoothHostController::PublishRequestPoolStatistics()
+{
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Hits",        sRequestPoolStatistics.hits,      32 },
+        { "Misses",      sRequestPoolStatistics.misses,    32 },
+        { "Discarded",   sRequestPoolStatistics.discarded, 32 },
+        { "Leaked",      sRequestPoolStatistics.leaked,    32 },
+        { "Outstanding", mRequestLeases,                   32 },
+        { "PoolSize",    kIntelRequestPoolSize,            32 }
+    };
+
+    PublishStatistics("RequestPool", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+void IntelBluetoothHostController::PublishRecoveryStatistics()
+{
+    /* recovery times in microseconds */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "Replays",                   sRecoveryStatistics.replays,                           32 },
+        { "FullSetups",                sRecoveryStatistics.fullSetups,                        32 },
+        { "ReplayFallbacks",           sRecoveryStatistics.replayFallbacks,                   32 },
+        { "LastReplayRecoveryTime",    sRecoveryStatistics.lastReplayTime / NSEC_PER_USEC,    64 },
+        { "LastFullSetupRecoveryTime", sRecoveryStatistics.lastFullSetupTime / NSEC_PER_USEC, 64 }
+    };
+
+    PublishStatistics("ConfigReplay", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+void IntelBluetoothHostController::PublishRadioToggleStatistics()
+{
+    /* latencies in microseconds */
+    const BluetoothIntelStatistic statistics[] =
+    {
+        { "FastToggles",     mRadioToggleStatistics.fastToggles,                     32 },
+        { "FullToggles",     mRadioToggleStatistics.fullToggles,                     32 },
+        { "Fallbacks",       mRadioToggleStatistics.fallbacks,                       32 },
+        { "LastFastLatency", mRadioToggleStatistics.lastFastLatency / NSEC_PER_USEC, 64 },
+        { "LastFullLatency", mRadioToggleStatistics.lastFullLatency / NSEC_PER_USEC, 64 }
+    };
+
+    PublishStatistics("RadioToggleStatistics", statistics, sizeof(statistics) / sizeof(statistics[0]));
+}
+
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
+IOReturn IntelBluetoothHostController::GetOpCodeAndEventCode(UInt8 * inDataPtr, UInt32 inDataSize, BluetoothHCICommandOpCode * outOpCode, UInt8 * numOpCodes, BluetoothHCIEventCode * eventCode, BluetoothHCIEventStatus * outStatus, BluetoothDeviceAddress * outDeviceAddress, BluetoothConnectionHandle * outConnectionHandle, bool * complete)
+{
+    if ( !inDataPtr || !inDataSize || !outOpCode || !numOpCodes || !eventCode || !outStatus || !outDeviceAddress || !outConnectionHandle || !complete )
+        return kIOReturnBadArgument;
+    
+    IOReturn err = super::GetOpCodeAndEventCode(inDataPtr, inDataSize, outOpCode, numOpCodes, eventCode, outStatus, outDeviceAddress, outConnectionHandle, complete);
+    
+    const BluetoothIntelOpCodeInfo * info = IntelLookupOpCode(*outOpCode);
+    if ( *eventCode == kBluetoothHCIEventCommandStatus && info && info->completeEvent == kBluetoothHCIEventCommandStatus )
+        *complete = true;
+    
+    return err;
+}
+#endif
+
+void IntelBluetoothHostController::ProcessEventDataWL(UInt8 * inDataPtr, UInt32 inDataSize, UInt32 sequenceNumber)
 {
     IOReturn err;
-    BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) mVersionInfo;
-    BluetoothIntelBootParams params;
-    UInt32 bootAddress;
-    OSData * fwData;
-    IntelGen2BluetoothHostControllerUSBTransport * transport = (IntelGen2BluetoothHostControllerUSBTransport *) mBluetoothTransport;
-    if ( !transport )
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    BluetoothIntelExceptionInfo info;
+    BluetoothHCICommandOpCode opCode;
+
+    if ( inDataSize <= kBluetoothHCIEventPacketHeaderSize )
+        return;
+
+    BluetoothHCIEventPacketHeader * event = (BluetoothHCIEventPacketHeader *) inDataPtr;
+    if ( event->dataSize != inDataSize - sizeof(BluetoothHCIEventPacketHeader) )
+        return;
+
+    if ( event->eventCode == kBluetoothHCIEventHardwareError )
     {
-        REQUIRE("( transport != NULL )");
-        return kIOReturnError;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ProcessEventDataWL] -- Received hardware error: 0x%02x ****\n", *(UInt8 *) (inDataPtr + kBluetoothHCIEventPacketHeaderSize));
+        mActiveConnections = 0;
+        InvalidateCommandCache("Hardware Error");
+
+        err = lease.Acquire(&id);
+        if ( err )
+        {
+            REQUIRE_NO_ERR(err);
+            return;
+        }
+        err = BluetoothHCIIntelReadExceptionInfo(id, &info);
+        if ( err )
+            return;
+        lease.Release();
     }
 
-    mGeneration = 2;
+    if ( event->dataSize > 0 && event->eventCode == kBluetoothHCIEventVendorSpecific )
+    {
+        UInt8 * param = inDataPtr + kBluetoothHCIEventPacketHeaderSize + 1;
+        UInt32 paramSize = inDataSize - kBluetoothHCIEventPacketHeaderSize - 1;
 
-    if ( version->hardwareVariant == kBluetoothIntelHardwareVariantJfP || version->hardwareVariant == kBluetoothIntelHardwareVariantThP )
-        mValidLEStates = true;
+        switch ( inDataPtr[2] )
+        {
+            case kBluetoothHCIEventIntelBootup:
+                /* When switching to the operational firmware
+                 * the device sends a vendor specific event
+                 * indicating that the bootup completed. The
+                 * operational firmware sends it again after
+                 * every later reset, e.g. a watchdog reset.
+                 */
+                if ( paramSize != sizeof(BluetoothIntelBootupEventParams) )
+                    break;
 
-    mWidebandSpeechSupported = true;
+                RecordBootupEvent((BluetoothIntelBootupEventParams *) param);
 
-    /* Setup MSFT Extension support */
-    SetMicrosoftExtensionOpCode(version->hardwareVariant);
+                if ( mBootloaderMode && mBooting )
+                {
+                    mBooting = false;
+                    mCommandGate->commandWakeup(&mBooting);
+                }
+                break;
 
-    /* Set the default boot parameter to 0x0 and it is updated to
-     * SKU specific boot parameter after reading Intel_Write_Boot_Params
-     * command while downloading the firmware.
-     */
-    bootAddress = 0x00000000;
+            case kBluetoothHCIEventIntelSecureSendCommandsResult:
+                /* When the firmware loading completes the
+                 * device sends out a vendor specific event
+                 * indicating the result of the firmware
+                 * loading.
+                 */
+                BluetoothIntelSecureSendResultEventParams * eventParam = (BluetoothIntelSecureSendResultEventParams *) param;
 
-    mBootloaderMode = true;
+                if ( !mBootloaderMode )
+                    break;
 
-    err = transport->DownloadFirmware(version, &params, &bootAddress);
-    if ( err )
-        return err;
+                if ( paramSize != sizeof(BluetoothIntelSecureSendResultEventParams) )
+                    break;
 
-    /* controller is already having an operational firmware */
-    if ( version->firmwareVariant == kBluetoothHCIIntelFirmwareVariantFirmware )
-        return kIOReturnSuccess;
+                if ( eventParam->result )
+                    mFirmwareLoadingFailed = true;
 
-    err = BootDevice(bootAddress);
-    if ( err )
-        return err;
+                if ( mDownloading && mFirmwareLoaded )
+                {
+                    mDownloading = false;
+                    mCommandGate->commandWakeup(&mDownloading);
+                }
+                break;
+        }
+    }
 
-    mBootloaderMode = false;
+    /* Asynchronous requests leave their lane once the controller took
+     * them.
+     */
+    if ( event->eventCode == kBluetoothHCIEventCommandComplete && event->dataSize >= sizeof(UInt8) + sizeof(UInt16) )
+    {
+        opCode = OSReadLittleInt16(inDataPtr, kBluetoothHCIEventPacketHeaderSize + 1);
+        CompleteCommandLane(opCode);
+        if ( BluetoothHCIExtractCommandOpCodeGroup(opCode) == kBluetoothHCICommandGroupVendorSpecific )
+            RecordVendorResponse(BluetoothHCIExtractCommandOpCodeCommand(opCode), inDataPtr + kBluetoothHCIEventPacketHeaderSize + sizeof(UInt8) + sizeof(UInt16), event->dataSize - sizeof(UInt8) - sizeof(UInt16));
+    }
+    else if ( event->eventCode == kBluetoothHCIEventCommandStatus && event->dataSize >= sizeof(UInt8) * 2 + sizeof(UInt16) )
+        CompleteCommandLane(OSReadLittleInt16(inDataPtr, kBluetoothHCIEventPacketHeaderSize + 2));
 
-    /* Once the device is running in operational mode, it needs to
-     * apply the device configuration (DDC) parameters.
-     *
-     * The device can work without DDC parameters, so even if it
-     * fails to load the file, no need to fail the setup.
+    /* Count the open connections, a deferred firmware upgrade waits
+     * for none to be left.
      */
-    err = transport->GetFirmware(version, &params, "ddc", &fwData);
-    if ( !err )
-        LoadDDCConfig(fwData);
+    if ( event->dataSize > 0 )
+    {
+        UInt8 * param = inDataPtr + kBluetoothHCIEventPacketHeaderSize;
 
-    SetQualityReport(mQualityReportSet);
+        switch ( event->eventCode )
+        {
+            case kBluetoothHCIEventConnectionComplete:
+            case kBluetoothHCIEventSynchronousConnectionComplete:
+                if ( !param[0] )
+                    ++mActiveConnections;
+                break;
 
-    /* Read the Intel version information after loading the FW */
-    err = CallBluetoothHCIIntelReadVersionInfo(0x00);
-    if ( err )
-        return err;
+            case kBluetoothHCIEventLEMetaEvent:
+                if ( event->dataSize > 1 && (param[0] == kBluetoothHCISubEventLEConnectionComplete || param[0] == kBluetoothHCISubEventLEEnhancedConnectionComplete) && !param[1] )
+                    ++mActiveConnections;
+                break;
 
-    version = (BluetoothIntelVersionInfo *) mVersionInfo;
-    PrintVersionInfo(version);
+            case kBluetoothHCIEventDisconnectionComplete:
+                if ( !param[0] && mActiveConnections )
+                    --mActiveConnections;
+                break;
+        }
+    }
 
-    return kIOReturnSuccess;
+    super::ProcessEventDataWL(inDataPtr, inDataSize, sequenceNumber);
 }
 
-IOReturn IntelBluetoothHostController::SetupGen3Controller()
+void IntelBluetoothHostController::RecordBootupEvent(const BluetoothIntelBootupEventParams * params)
 {
-    IOReturn err;
-    BluetoothIntelVersionInfoTLV version;
-    OSData * fwData;
-    UInt32 bootAddress;
+    BluetoothIntelResetHistoryEntry * entry;
+    UInt64 timestamp;
+    UInt32 recent;
 
-    if ( !mBluetoothTransport )
-        return kIOReturnError;
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime(), &timestamp);
 
-    IntelGen3BluetoothHostControllerUSBTransport * transport = (IntelGen3BluetoothHostControllerUSBTransport *) mBluetoothTransport;
-    if ( !transport )
-    {
-        REQUIRE("( transport != NULL )");
-        return kIOReturnError;
-    }
+    mBootupEvent = *params;
+    mBootupEventValid = true;
 
-    err = transport->ParseVersionInfoTLV(&version, mVersionInfo, kMaxHCIBufferLength * 4);
-    if ( err )
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RecordBootupEvent] -- Device booted: resetType = 0x%02x, resetReason = 0x%02x, ddcStatus = 0x%02x ****\n", params->resetType, params->resetReason, params->ddcStatus);
+
+    /* The DDC values only survive in the persistent RAM, anything the
+     * cache knows about is gone otherwise and the firmware defaults apply.
+     */
+    if ( !IsDDCPersistent() )
+        InvalidateDDCCache(true);
+    InvalidateControllerIdentity("Bootup Event");
+
+    entry = &mResetHistory[mResetHistoryCount % kIntelResetHistorySize];
+    entry->timestamp = timestamp;
+    entry->resetType = params->resetType;
+    entry->resetReason = params->resetReason;
+    entry->ddcStatus = params->ddcStatus;
+    ++mResetHistoryCount;
+
+    if ( params->resetReason == kBluetoothHCIIntelResetReaonWatchdog || params->resetType == kBluetoothHCIIntelResetTypeSoftWatchdogReset || params->resetType == kBluetoothHCIIntelResetTypeHardWatchdogReset )
+        ++mWatchdogResetCount;
+    else if ( params->resetReason == kBluetoothHCIIntelResetReaonFatalException || params->resetReason == kBluetoothHCIIntelResetReaonSystemException )
+        ++mExceptionResetCount;
+    else
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Failed to parse TLV version information! ****\n");
-        return err;
+        PublishResetHistory();
+        return;
     }
 
-    if ( IntelCNVXExtractHardwarePlatform(version.cnviBT) != 0x37 )
+    /* Count the watchdog and exception resets in the recent history so
+     * that a controller stuck in a crash loop is easy to spot.
+     */
+    recent = 0;
+    for ( UInt32 i = 0; i < min(mResetHistoryCount, kIntelResetHistorySize); ++i )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Unsupported hardware platform: 0x%02x ****\n", IntelCNVXExtractHardwarePlatform(version.cnviBT));
-        return kIOReturnInvalid;
+        entry = &mResetHistory[i];
+        if ( timestamp - entry->timestamp > kIntelRepeatedResetWindowSeconds * NSEC_PER_SEC )
+            continue;
+        if ( entry->resetReason == kBluetoothHCIIntelResetReaonWatchdog || entry->resetType == kBluetoothHCIIntelResetTypeSoftWatchdogReset || entry->resetType == kBluetoothHCIIntelResetTypeHardWatchdogReset
+            || entry->resetReason == kBluetoothHCIIntelResetReaonFatalException || entry->resetReason == kBluetoothHCIIntelResetReaonSystemException )
+            ++recent;
     }
+    if ( recent >= kIntelRepeatedResetThreshold )
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RecordBootupEvent] -- WARNING: %u watchdog or exception resets within the last %u seconds (watchdog: %u, exception: %u in total) ****\n", recent, kIntelRepeatedResetWindowSeconds, mWatchdogResetCount, mExceptionResetCount);
 
-    /* Check for supported iBT hardware variants of this firmware
-     * loading method.
-     *
-     * This check has been put in place to ensure correct forward
-     * compatibility options when newer hardware variants come
-     * along.
+    PublishResetHistory();
+}
+
+bool IntelBluetoothHostController::IsDDCPersistent()
+{
+    /* After a soft reset the controller may keep the DDC parameters
+     * applied before the reset in its persistent RAM, in which case
+     * there is no need to load them again.
      */
-    switch ( IntelCNVXExtractHardwareVariant(version.cnviBT) )
+    if ( !mBootupEventValid || mBootupEvent.ddcStatus != kBluetoothHCIIntelDDCStatusPersistentRAM )
+        return false;
+
+    if ( mBootupEvent.resetType != kBluetoothHCIIntelResetTypeSoftWatchdogReset && mBootupEvent.resetType != kBluetoothHCIIntelResetTypeSoftSoftwareReset )
+        return false;
+
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][IsDDCPersistent] -- DDC parameters persisted across the soft reset (resetType = 0x%02x) ****\n", mBootupEvent.resetType);
+    return true;
+}
+
+void IntelBluetoothHostController::PublishResetHistory()
+{
+    OSDictionary * history;
+    OSArray * entries;
+    OSDictionary * dict;
+    BluetoothIntelResetHistoryEntry * entry;
+    UInt32 count;
+    const BluetoothIntelStatistic totals[] =
     {
-        case kBluetoothIntelHardwareVariantJfP:
-        case kBluetoothIntelHardwareVariantThP:
-        case kBluetoothIntelHardwareVariantHrP:
-        case kBluetoothIntelHardwareVariantCcP:
-        {
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- This controller is not an Intel new bootloader device!!! ****\n");
-            mGeneration = 2;
-            return kIOReturnUnsupported;
-        }
+        { "TotalResets",     mResetHistoryCount,   32 },
+        { "WatchdogResets",  mWatchdogResetCount,  32 },
+        { "ExceptionResets", mExceptionResetCount, 32 }
+    };
+
+    history = CreateStatisticsDictionary(totals, sizeof(totals) / sizeof(totals[0]));
+    entries = OSArray::withCapacity(kIntelResetHistorySize);
+    if ( !history || !entries )
+        goto done;
+
+    /* oldest first */
+    count = min(mResetHistoryCount, kIntelResetHistorySize);
+    for ( UInt32 i = mResetHistoryCount - count; i < mResetHistoryCount; ++i )
+    {
+        entry = &mResetHistory[i % kIntelResetHistorySize];
 
-        case kBluetoothIntelHardwareVariantSlr:
-            /* Valid LE States quirk for GfP */
-            mValidLEStates = true;
-        case kBluetoothIntelHardwareVariantTyP:
-        case kBluetoothIntelHardwareVariantSlrF:
+        const BluetoothIntelStatistic reset[] =
         {
-            mGeneration = 3;
+            { "Timestamp",   entry->timestamp / NSEC_PER_MSEC, 64 },
+            { "ResetType",   entry->resetType,                 8  },
+            { "ResetReason", entry->resetReason,               8  },
+            { "DDCStatus",   entry->ddcStatus,                 8  }
+        };
+
+        dict = CreateStatisticsDictionary(reset, sizeof(reset) / sizeof(reset[0]));
+        if ( !dict )
+            continue;
+
+        entries->setObject(dict);
+        dict->release();
+    }
 
-            /* Display version information of TLV type */
-            PrintVersionInfo(&version);
+    history->setObject("History", entries);
+    setProperty("ResetHistory", history);
 
-            /* Apply the device specific HCI quirks for TLV based devices
-             *
-             * All TLV based devices support WBS
-             */
-            mWidebandSpeechSupported = true;
+done:
+    OSSafeReleaseNULL(entries);
+    OSSafeReleaseNULL(history);
+}
 
-            /* Setup MSFT Extension support */
-            SetMicrosoftExtensionOpCode(IntelCNVXExtractHardwareVariant(version.cnviBT));
+IOReturn IntelBluetoothHostController::RunSetupSteps(BluetoothIntelSetupStep * inSteps, UInt32 numSteps)
+{
+    IOReturn err = kIOReturnSuccess;
+    int sleepResult;
+    BluetoothIntelSetupStep * steps = mSetupSteps;
+    BluetoothIntelSetupStep * step;
+    UInt32 completed = 0;
+    UInt32 completedMask = 0;
+    UInt32 limit;
+    UInt32 i;
+    bool issued;
+    AbsoluteTime callTime;
+    UInt64 duration;
+    UInt64 sequentialDuration = 0;
+
+    if ( !inSteps || !numSteps || numSteps > kIntelMaxSetupSteps )
+        return kIOReturnBadArgument;
 
-            /* Set the default boot parameter to 0x0 and it is updated to
-             * SKU specific boot parameter after reading Intel_Write_Boot_Params
-             * command while downloading the firmware.
-             */
-            bootAddress = 0x00000000;
+    /* Steps abandoned by an earlier run still own their slots. */
+    if ( !ReapSetupStepThreadCalls(false) )
+        return kIOReturnBusy;
+    memcpy(steps, inSteps, numSteps * sizeof(BluetoothIntelSetupStep));
 
-            mBootloaderMode = true;
+    /* Every running step has at most one command outstanding, so
+     * staying within the command credits of the controller keeps the
+     * commands from queueing up in the family instead.
+     */
+    limit = 1;
+    if ( mConcurrentSetupSteps )
+        limit = max(1, min(mNumberOfCommandsAllowedByHardware, kIntelMaxConcurrentSetupSteps));
 
-            err = transport->DownloadFirmware(&version, NULL, &bootAddress);
-            if ( err )
-                return err;
+    for ( i = 0; i < numSteps; ++i )
+    {
+        steps[i].state = kBluetoothIntelSetupStepStatePending;
+        steps[i].result = kIOReturnSuccess;
+        steps[i].duration = 0;
+        steps[i].threadCall = NULL;
+    }
+    mSetupStepsRunning = 0;
+    callTime = mBluetoothFamily->GetCurrentTime();
+
+    /* With a single credit nothing can overlap, and the list order
+     * already satisfies the dependencies.
+     */
+    if ( limit == 1 )
+    {
+        for ( i = 0; !err && i < numSteps; ++i )
+        {
+            step = &steps[i];
+            step->state = kBluetoothIntelSetupStepStateRunning;
+            ++mSetupStepsRunning;
+            RunSetupStepWL(step);
+
+            ++completed;
+            sequentialDuration += step->duration;
+            if ( step->result )
+            {
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunSetupSteps] -- %s failed: 0x%x ****\n", step->name, step->result);
+                if ( step->required )
+                    err = step->result;
+            }
+        }
+        goto DONE;
+    }
 
-            /* check if controller is already having an operational firmware */
-            if ( version.imageType == kBluetoothHCIIntelImageTypeFirmware )
-                return kIOReturnSuccess;
+    while ( completed < numSteps )
+    {
+        issued = false;
 
-            err = BootDevice(bootAddress);
-            if ( err )
-                return err;
+        /* Do not start anything new once a required step failed. */
+        for ( i = 0; !err && i < numSteps && mSetupStepsRunning < limit; ++i )
+        {
+            step = &steps[i];
+            if ( step->state != kBluetoothIntelSetupStepStatePending || (step->dependencies & ~completedMask) )
+                continue;
 
-            mBootloaderMode = false;
+            step->state = kBluetoothIntelSetupStepStateRunning;
+            ++mSetupStepsRunning;
+            issued = true;
 
-            /* Once the device is running in operational mode, it needs to
-             * apply the device configuration (DDC) parameters.
-             *
-             * The device can work without DDC parameters, so even if it
-             * fails to load the file, no need to fail the setup.
-             */
-            err = transport->GetFirmware(&version, NULL, "ddc", &fwData);
-            if ( !err )
-                LoadDDCConfig(fwData);
+            step->threadCall = thread_call_allocate(SetupStepThreadCall, this);
 
-            /* Read supported use cases and set callbacks to fetch datapath id */
-            ConfigureOffload();
+            if ( step->threadCall )
+                thread_call_enter1(step->threadCall, step);
+            else
+                RunSetupStepWL(step);
+        }
 
-            SetQualityReport(mQualityReportSet);
+        for ( i = 0; i < numSteps; ++i )
+        {
+            step = &steps[i];
+            if ( step->state != kBluetoothIntelSetupStepStateDone || (completedMask & (1 << i)) )
+                continue;
 
-            /* Read the Intel version information after loading the FW  */
-            err = CallBluetoothHCIIntelReadVersionInfo(0xFF);
-            if ( err )
-                return err;
+            completedMask |= 1 << i;
+            ++completed;
+            sequentialDuration += step->duration;
 
-            err = transport->ParseVersionInfoTLV(&version, mVersionInfo, kMaxHCIBufferLength * 4);
-            if ( err )
+            if ( step->result )
             {
-                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Failed to parse TLV version information! ****\n");
-                return err;
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunSetupSteps] -- %s failed: 0x%x ****\n", step->name, step->result);
+                if ( step->required && !err )
+                    err = step->result;
             }
+        }
 
-            PrintVersionInfo(&version);
+        if ( completed == numSteps )
+            break;
 
-            return kIOReturnSuccess;
+        if ( !mSetupStepsRunning )
+        {
+            if ( issued )
+                continue;
+
+            /* Nothing is running and nothing can be started: either a
+             * required step failed or the dependencies cannot be met.
+             */
+            if ( !err )
+            {
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunSetupSteps] -- %u step(s) have unmet dependencies! ****\n", numSteps - completed);
+                err = kIOReturnInvalid;
+            }
+            break;
         }
 
-        default:
+        /* The running steps live in mSetupSteps, so they can be left
+         * to finish on their own once the transport is gone.
+         */
+        sleepResult = ControllerCommandSleep(&mSetupStepsRunning, kIntelSetupStepWaitTimeout, (char *) __FUNCTION__, true);
+        if ( mTransportTerminating || sleepResult == THREAD_INTERRUPTED )
         {
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetupGen3Controller] -- Unsupported hardware variant: %u ****\n", IntelCNVXExtractHardwareVariant(version.cnviBT));
-            return kIOReturnInvalid;
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunSetupSteps] -- Left %u running step(s) behind: %s ****\n", mSetupStepsRunning, mTransportTerminating ? "transport terminated" : "wait interrupted");
+            if ( !err )
+                err = mTransportTerminating ? kIOReturnNoDevice : kIOReturnAborted;
+            break;
         }
     }
+
+    ReapSetupStepThreadCalls(false);
+
+DONE:
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][RunSetupSteps] -- Ran %u step(s) %s in %llu usecs, %llu usecs back to back ****\n", completed, limit > 1 ? "concurrently" : "sequentially", duration / 1000, sequentialDuration / 1000);
+
+    return err;
 }
 
-bool IntelBluetoothHostController::InitializeHostControllerVariables(bool setup)
+bool IntelBluetoothHostController::ReapSetupStepThreadCalls(bool all)
 {
-    if ( !super::InitializeHostControllerVariables(setup) )
-        return false;
+    bool reaped = true;
 
-    if ( mBluetoothTransport )
-        mSupportWoBT = mBluetoothTransport->ControllerSupportWoBT();
+    /* A step is done before its callout returns from the command gate,
+     * so wait for the callout before freeing it. Steps that are still
+     * running need the gate, which the caller may hold, and are only
+     * waited for when all is set.
+     */
+    for ( int i = 0; i < kIntelMaxSetupSteps; ++i )
+    {
+        if ( !mSetupSteps[i].threadCall )
+            continue;
+        if ( !all && mSetupSteps[i].state == kBluetoothIntelSetupStepStateRunning )
+        {
+            reaped = false;
+            continue;
+        }
 
-    setProperty("ActiveBluetoothControllerVendor", "Intel");
-    setProperty("BluetoothVendor", "Intel");
-    return true;
+        thread_call_cancel_wait(mSetupSteps[i].threadCall);
+        thread_call_free(mSetupSteps[i].threadCall);
+        mSetupSteps[i].threadCall = NULL;
+    }
+
+    return reaped;
 }
 
-IOReturn IntelBluetoothHostController::SetTransportRadioPowerState(UInt8 inState)
+void IntelBluetoothHostController::RunSetupStepWL(BluetoothIntelSetupStep * step)
 {
-    if ( !mBluetoothTransport )
-        return kIOReturnInvalid;
-    mBluetoothTransport->SetRadioPowerState(inState);
-    return kIOReturnSuccess;
+    AbsoluteTime callTime = mBluetoothFamily->GetCurrentTime();
+
+    step->result = (*step->action)(this, step->arg0, step->arg1, step->arg2, NULL);
+
+    /* A configuration missing a command cannot be replayed. */
+    if ( step->result && mConfigRecordingActive && mConfigRecording )
+        mConfigRecording->valid = false;
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &step->duration);
+    step->state = kBluetoothIntelSetupStepStateDone;
+
+    --mSetupStepsRunning;
+    mCommandGate->commandWakeup(&mSetupStepsRunning);
 }
 
-IOReturn IntelBluetoothHostController::GetTransportRadioPowerState(UInt8 * outState)
+void IntelBluetoothHostController::SetupStepThreadCall(thread_call_param_t owner, thread_call_param_t step)
 {
-    if ( !mBluetoothTransport )
-        return kIOReturnInvalid;
-    *outState = mBluetoothTransport->GetRadioPowerState();
-    return kIOReturnSuccess;
+    IntelBluetoothHostController * that = (IntelBluetoothHostController *) owner;
+    that->mCommandGate->runAction(RunSetupStepAction, step);
 }
 
-IOReturn IntelBluetoothHostController::CallPowerRadio(bool)
+IOReturn IntelBluetoothHostController::RunSetupStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    if ( !object )
+        return kIOReturnBadArgument;
+    object->RunSetupStepWL((BluetoothIntelSetupStep *) arg0);
     return kIOReturnSuccess;
 }
 
-void IntelBluetoothHostController::SetMicrosoftExtensionOpCode(UInt8 hardwareVariant)
+IOReturn IntelBluetoothHostController::LoadDDCConfigStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
-    switch ( hardwareVariant )
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    IntelBluetoothHostControllerUSBTransport * transport = (IntelBluetoothHostControllerUSBTransport *) arg0;
+    AbsoluteTime callTime;
+    OSData * fwData;
+    IOReturn err = kIOReturnSuccess;
+
+    if ( !object || !transport )
+        return kIOReturnBadArgument;
+
+    callTime = object->mBluetoothFamily->GetCurrentTime();
+    if ( !object->IsDDCPersistent() )
     {
-        /* Legacy bootloader devices that supports MSFT Extension */
-        case kBluetoothIntelHardwareVariantJfP:
-        case kBluetoothIntelHardwareVariantThP:
-        case kBluetoothIntelHardwareVariantHrP:
-        case kBluetoothIntelHardwareVariantCcP:
-        /* All Intel new genration controllers support the Microsoft vendor
-         * extension are using 0xFC1E for VsMsftOpCode.
+        err = transport->GetFirmware(arg1, (BluetoothIntelBootParams *) arg2, "ddc", &fwData);
+        if ( !err )
+            err = object->LoadDDCConfig(fwData);
+
+        /* Kept for a warm resume, which has no boot parameters to
+         * look the file up with.
          */
-        case kBluetoothIntelHardwareVariantTyP:
-        case kBluetoothIntelHardwareVariantSlr:
-        case kBluetoothIntelHardwareVariantSlrF:
-            mMicrosoftExtensionOpCode = 0xFC1E;
-            // What operations need to be done?
-            break;
-        default:
-            /* Not supported */
-            break;
+        if ( !err )
+        {
+            OSSafeReleaseNULL(object->mDDCConfigData);
+            fwData->retain();
+            object->mDDCConfigData = fwData;
+        }
     }
+    object->RecordSetupPhase(kBluetoothIntelSetupPhaseLoadDDCConfig, callTime);
+
+    return err;
 }
 
-IOReturn IntelBluetoothHostController::ResetToBootloader(bool retry)
+IOReturn IntelBluetoothHostController::ReapplyDDCConfigStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
-    IOReturn err;
-    BluetoothHCIRequestID id;
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    AbsoluteTime callTime;
+    IOReturn err = kIOReturnSuccess;
 
-    mBootloaderMode = true;
-    mDownloading = true;
-    mBooting = false;
-    
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCISendIntelReset(id, 0x01, true, true, 0x00, 0x00000000);
-    HCIRequestDelete(NULL, id);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetToBootloader] -- BluetoothHCISendIntelReset() failed -- cannot deliver Intel reset: 0x%x ****\n", err);
-        return err;
-    }
-    
-    if ( retry )
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetToBootloader] -- Reset is sent successfully. Retrying firmware download... ****\n");
-    
-    /* Current Intel BT controllers(ThP/JfP) hold the USB reset
-     * lines for 2ms when it receives Intel Reset in bootloader mode.
-     * Whereas, the upcoming Intel BT controllers will hold USB reset
-     * for 150ms. To keep the delay generic, 150ms is chosen here.
-     */
-    IOSleep(150);
+    if ( !object )
+        return kIOReturnBadArgument;
 
-    return kIOReturnSuccess;
+    /* Records the DDC cache still holds cost no command. */
+    callTime = object->mBluetoothFamily->GetCurrentTime();
+    if ( object->mDDCConfigData && !object->IsDDCPersistent() )
+        err = object->LoadDDCConfig(object->mDDCConfigData);
+    object->RecordSetupPhase(kBluetoothIntelSetupPhaseLoadDDCConfig, callTime);
+
+    return err;
 }
 
-IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadExceptionInfo(BluetoothHCIRequestID inID, BluetoothIntelExceptionInfo * info)
+IOReturn IntelBluetoothHostController::ConfigureOffloadStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    AbsoluteTime callTime;
     IOReturn err;
 
-    err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadExceptionInfo] -- Failed to prepare request for new command: 0x%x ****\n", err);
-        return err;
-    }
-
-    err = SendHCIRequestFormatted(inID, 0xFC22, sizeof(BluetoothIntelExceptionInfo), info, "Hbb", 0xFC22, 1, 0x00);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadExceptionInfo] ### ERROR: opCode = 0x%04X -- send request failed -- Unable to obtain exception info: 0x%x ****\n", 0xFC22, err);
-        return err;
-    }
+    if ( !object )
+        return kIOReturnBadArgument;
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadExceptionInfo] -- Exception Info: %s ****\n", info->info);
+    /* Read supported use cases and set callbacks to fetch datapath id */
+    callTime = object->mBluetoothFamily->GetCurrentTime();
+    err = object->ConfigureOffload();
+    object->RecordSetupPhase(kBluetoothIntelSetupPhaseConfigureOffload, callTime);
 
-    return kIOReturnSuccess;
+    return err;
 }
 
-IOReturn IntelBluetoothHostController::WriteDeviceAddress(BluetoothHCIRequestID inID, BluetoothDeviceAddress * inAddress)
+IOReturn IntelBluetoothHostController::QualityReportStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    AbsoluteTime callTime;
     IOReturn err;
-    
-    err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WriteDeviceAddress] -- Failed to prepare request for new command: 0x%x ****\n", err);
-        return err;
-    }
-    
-    err = SendHCIRequestFormatted(inID, 0xFC31, 0, NULL, "Hb^", 0xFC31, 6, inAddress);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WriteDeviceAddress] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC31, err);
-        return err;
-    }
-    
-    return kIOReturnSuccess;
+
+    if ( !object )
+        return kIOReturnBadArgument;
+
+    callTime = object->mBluetoothFamily->GetCurrentTime();
+    err = object->SetQualityReport(object->mQualityReportSet);
+    object->RecordSetupPhase(kBluetoothIntelSetupPhaseQualityReport, callTime);
+
+    return err;
 }
 
-IOReturn IntelBluetoothHostController::CheckDeviceAddress()
+IOReturn IntelBluetoothHostController::EventMaskStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    AbsoluteTime callTime;
     IOReturn err;
-    BluetoothDeviceAddress address;
-    BluetoothDeviceAddress defaultAddress = (BluetoothDeviceAddress) {0x00, 0x8B, 0x9E, 0x19, 0x03, 0x00};
-    BluetoothHCIRequestID id;
-
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCIReadDeviceAddress(id, &address);
-    HCIRequestDelete(NULL, id);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckDeviceAddress] -- BluetoothHCIReadDeviceAddress() failed -- cannot read device address: 0x%x ****\n", err);
-        return err;
-    }
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckDeviceAddress] -- Printing device address: 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x, 0x%02x ****\n", address.data[0], address.data[1], address.data[2], address.data[3], address.data[4], address.data[5]);
+    if ( !object )
+        return kIOReturnBadArgument;
 
-    /* For some Intel based controllers, the default Bluetooth device
-     * address 00:03:19:9E:8B:00 can be found. These controllers are
-     * fully operational, but have the danger of duplicate addresses
-     * and that in turn can cause problems with Bluetooth operation.
+    /* SetupController does not need to set it again, whatever the
+     * outcome: the device functions correctly without these events.
      */
-    if ( !memcmp(&address, &defaultAddress, 6) )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckDeviceAddress] -- Default device address (%pMR) found! ****\n", &address);
-        mInvalidDeviceAddress = true;
-    }
+    callTime = object->mBluetoothFamily->GetCurrentTime();
+    err = object->CallBluetoothHCIIntelSetEventMask(false);
+    object->RecordSetupPhase(kBluetoothIntelSetupPhaseEventMask, callTime);
+    object->mSetupEventMaskSet = true;
 
-    return kIOReturnSuccess;
+    return err;
 }
 
-IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelReadVersionInfo(UInt8 param)
+IOReturn IntelBluetoothHostController::ReadVersionInfoStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
 {
+    IntelBluetoothHostController * object = OSDynamicCast(IntelBluetoothHostController, owner);
+    AbsoluteTime callTime;
     IOReturn err;
-    BluetoothHCIRequestID id;
 
-    if ( !mVersionInfo )
-        return kIOReturnInvalid;
-    
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCIIntelReadVersionInfo(id, param, mVersionInfo);
-    HCIRequestDelete(NULL, id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
+    if ( !object )
+        return kIOReturnBadArgument;
+
+    callTime = object->mBluetoothFamily->GetCurrentTime();
+    err = object->CallBluetoothHCIIntelReadVersionInfo((UInt8) (uintptr_t) arg0);
+    object->RecordSetupPhase(kBluetoothIntelSetupPhaseReadVersionInfo, callTime);
 
     return err;
 }
 
-const char * IntelBluetoothHostController::ConvertFirmwareVariantToString(BluetoothHCIIntelFirmwareVariant firmwareVariant)
+void IntelBluetoothHostController::BeginBootProfile()
 {
-    switch ( firmwareVariant )
-    {
-        case kBluetoothHCIIntelFirmwareVariantLegacyROM2_5:
-            return "Legacy ROM 2.5";
-            
-        case kBluetoothHCIIntelFirmwareVariantBootloader:
-            return "Bootloader";
-            
-        case kBluetoothHCIIntelFirmwareVariantLegacyROM2_X:
-            return "Legacy ROM 2.x";
-            
-        case kBluetoothHCIIntelFirmwareVariantFirmware:
-            return "Firmware";
-            
-        default:
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ConvertFirmwareVariantToString] -- Unsupported firmware variant: %02x ****\n", firmwareVariant);
-            return "Unknown";
-    }
-}
+    mBootProfileStartTime = mBluetoothFamily->GetCurrentTime();
 
-const char * IntelBluetoothHostController::ConvertImageTypeToString(BluetoothHCIIntelImageType imageType)
-{
-    switch ( imageType )
-    {
-        case kBluetoothHCIIntelImageTypeBootloader:
-            return "Bootloader";
-            
-        case kBluetoothHCIIntelImageTypeFirmware:
-            return "Firmware";
-            
-        default:
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ConvertImageTypeToString] -- Unsupported image type: %02x ****\n", imageType);
-            return "Unknown";
-    }
+    mCurrentBootProfile = &mBootProfiles[mBootProfileCount % kIntelBootProfileHistorySize];
+    bzero(mCurrentBootProfile, sizeof(BluetoothIntelBootProfile));
+    absolutetime_to_nanoseconds(mBootProfileStartTime, &mCurrentBootProfile->startTime);
 }
 
-IOReturn IntelBluetoothHostController::PrintVersionInfo(BluetoothIntelVersionInfo * version)
+void IntelBluetoothHostController::RecordSetupPhase(BluetoothIntelSetupPhase phase, AbsoluteTime startTime)
 {
-    /* The hardware platform number has a fixed value of 0x37 and
-     * for now only accept this single value.
-     */
-    if ( version->hardwarePlatform != 0x37 )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware platform: %u ****\n", version->hardwarePlatform);
-        return kIOReturnInvalid;
-    }
+    AbsoluteTime now;
+    UInt64 offset;
+    UInt64 duration;
 
-    /* Check for supported iBT hardware variants of this firmware
-     * loading method.
-     *
-     * This check has been put in place to ensure correct forward
-     * compatibility options when newer hardware variants come along.
+    if ( !mCurrentBootProfile || phase >= kBluetoothIntelSetupPhaseCount )
+        return;
+
+    now = mBluetoothFamily->GetCurrentTime();
+    absolutetime_to_nanoseconds(now - startTime, &duration);
+    absolutetime_to_nanoseconds(startTime - mBootProfileStartTime, &offset);
+
+    /* A phase may run more than once, e.g. reading the version
+     * information again after falling back to the legacy setup, so
+     * keep the first start and add up the durations.
      */
-    if ( version->hardwareVariant != kBluetoothIntelHardwareVariantWP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantStP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantSfP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantWsP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantJfP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantThP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantHrP
-      && version->hardwareVariant != kBluetoothIntelHardwareVariantCcP )
+    if ( !mCurrentBootProfile->phaseDuration[phase] )
+        mCurrentBootProfile->phaseStart[phase] = offset;
+    mCurrentBootProfile->phaseDuration[phase] += duration ? duration : 1;
+}
+
+void IntelBluetoothHostController::EndBootProfile(IOReturn result)
+{
+    if ( !mCurrentBootProfile )
+        return;
+
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - mBootProfileStartTime, &mCurrentBootProfile->duration);
+    mCurrentBootProfile->generation = mGeneration;
+    mCurrentBootProfile->result = result;
+
+    if ( mCurrentBootProfile->warmResume && !result )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware variant: %u ****\n", version->hardwareVariant);
-        return kIOReturnInvalid;
+        ++mWarmResumeStatistics.resumes;
+        mWarmResumeStatistics.lastLatency = mCurrentBootProfile->duration;
+        if ( mCurrentBootProfile->duration > mWarmResumeStatistics.maxLatency )
+            mWarmResumeStatistics.maxLatency = mCurrentBootProfile->duration;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][EndBootProfile] -- Warm resume to ready in %llu usecs ****\n", mCurrentBootProfile->duration / 1000);
+        PublishWarmResumeStatistics();
     }
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- %s -- Firmware Revision: %u.%u -- Firmware Build: %u - week: %u - year: %u ****\n", ConvertFirmwareVariantToString(version->firmwareVariant), version->firmwareRevision >> 4, version->firmwareRevision & 0x0F, version->firmwareBuildNum, version->firmwareBuildWeek, 2000 + version->firmwareBuildYear);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][EndBootProfile] -- Setup of generation %u controller took %llu usecs: 0x%x ****\n", mGeneration, mCurrentBootProfile->duration / 1000, result);
 
-    return kIOReturnSuccess;
+    mCurrentBootProfile = NULL;
+    ++mBootProfileCount;
+
+    PublishBootProfiles();
 }
 
-IOReturn IntelBluetoothHostController::PrintVersionInfo(BluetoothIntelVersionInfoTLV * version)
+void IntelBluetoothHostController::PublishBootProfiles()
 {
-    /* The hardware platform number has a fixed value of 0x37 and
-     * for now only accept this single value.
-     */
-    if ( IntelCNVXExtractHardwarePlatform(version->cnviBT) != 0x37 )
+    static const char * phaseNames[kBluetoothIntelSetupPhaseCount] =
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware platform: 0x%02x ****\n", IntelCNVXExtractHardwarePlatform(version->cnviBT));
-        return kIOReturnInvalid;
-    }
+        "HCIReset", "ReadVersionInfo", "ReadBootParams", "FirmwareLookup", "ResetToBootloader", "FirmwareDownload", "WaitForFirmwareDownload",
+        "BootDevice", "WaitForDeviceBoot", "LoadDDCConfig", "ConfigureOffload", "QualityReport", "EventMask", "GeneralSetup", "Fingerprint"
+    };
+    OSArray * profiles;
+    OSDictionary * dict;
+    OSDictionary * phases;
+    OSDictionary * phase;
+    BluetoothIntelBootProfile * profile;
+    UInt32 count;
+
+    profiles = OSArray::withCapacity(kIntelBootProfileHistorySize);
+    if ( !profiles )
+        return;
 
-    /* Check for supported iBT hardware variants of this firmware
-     * loading method.
-     *
-     * This check has been put in place to ensure correct forward
-     * compatibility options when newer hardware variants come along.
-     */
-    switch ( IntelCNVXExtractHardwareVariant(version->cnviBT) )
+    /* oldest first, times in microseconds except for the start time */
+    count = min(mBootProfileCount, kIntelBootProfileHistorySize);
+    for ( UInt32 i = mBootProfileCount - count; i < mBootProfileCount; ++i )
     {
-        case kBluetoothIntelHardwareVariantTyP:
-        case kBluetoothIntelHardwareVariantSlr:
-        case kBluetoothIntelHardwareVariantSlrF:
-            break;
-        default:
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported hardware variant: 0x%x ****\n", IntelCNVXExtractHardwareVariant(version->cnviBT));
-            return kIOReturnInvalid;
-    }
+        profile = &mBootProfiles[i % kIntelBootProfileHistorySize];
 
-    if ( version->imageType == kBluetoothHCIIntelImageTypeBootloader )
-    {
-        /* It is required that every single firmware fragment is acknowledged
-         * with a command complete event. If the boot parameters indicate
-         * that this bootloader does not send them, then abort the setup.
-         */
-        if ( version->limitedCCE != 0x00 )
+        const BluetoothIntelStatistic totals[] =
         {
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported firmware loading method: 0x%x ****\n", version->limitedCCE);
-            return kIOReturnInvalid;
+            { "StartTime",     profile->startTime / NSEC_PER_MSEC,     64 },
+            { "Duration",      profile->duration / NSEC_PER_USEC,      64 },
+            { "Generation",    profile->generation,                    32 },
+            { "Result",        (UInt32) profile->result,               32 },
+            { "WaitTimeSaved", profile->waitTimeSaved / NSEC_PER_USEC, 64 }
+        };
+
+        dict = CreateStatisticsDictionary(totals, sizeof(totals) / sizeof(totals[0]));
+        phases = OSDictionary::withCapacity(kBluetoothIntelSetupPhaseCount);
+        if ( !dict || !phases )
+        {
+            OSSafeReleaseNULL(dict);
+            OSSafeReleaseNULL(phases);
+            continue;
         }
 
-        /* Secure boot engine type should be either 1 (ECDSA) or 0 (RSA) */
-        if ( version->sbeType > 0x01 )
+        dict->setObject("WarmResume", profile->warmResume ? kOSBooleanTrue : kOSBooleanFalse);
+
+        for ( int j = 0; j < kBluetoothIntelSetupPhaseCount; ++j )
         {
-            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Unsupported secure boot engine type: 0x%x ****\n", version->sbeType);
-            return kIOReturnInvalid;
+            if ( !profile->phaseDuration[j] )
+                continue;
+
+            const BluetoothIntelStatistic timing[] =
+            {
+                { "Start",    profile->phaseStart[j] / NSEC_PER_USEC,    64 },
+                { "Duration", profile->phaseDuration[j] / NSEC_PER_USEC, 64 }
+            };
+
+            phase = CreateStatisticsDictionary(timing, sizeof(timing) / sizeof(timing[0]));
+            if ( !phase )
+                continue;
+
+            phases->setObject(phaseNames[j], phase);
+            phase->release();
         }
 
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Device revision is %u ****\n", version->deviceRevisionID);
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Secure boot is %s ****\n", version->secureBoot ? "enabled" : "disabled");
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- OTP lock is %s ****\n", version->otpLock ? "enabled" : "disabled");
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- API lock is %s ****\n", version->apiLock ? "enabled" : "disabled");
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Debug lock is %s ****\n", version->debugLock ? "enabled" : "disabled");
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- Minimum firmware build %u week %u %u ****\n", version->firmwareBuildNumber, version->firmwareBuildWeek, 2000 + version->firmwareBuildYear);
+        dict->setObject("Phases", phases);
+        phases->release();
+        profiles->setObject(dict);
+        dict->release();
     }
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][PrintVersionInfo] -- %s -- Timestamp: %u.%u -- Build Type: %u -- Build Number: %u ****\n", ConvertImageTypeToString(version->imageType), 2000 + (version->timestamp >> 8), version->timestamp & 0xFF, version->buildType, version->buildNumber);
-
-    return kIOReturnSuccess;
+    setProperty("BootProfiles", profiles);
+    profiles->release();
 }
 
-IOReturn IntelBluetoothHostController::SetQualityReport(bool enable)
+bool IntelBluetoothHostController::SetHCIRequestRequireEvents(BluetoothHCICommandOpCode opCode, IOBluetoothHCIRequest * request)
 {
-    IOReturn err;
-    BluetoothHCIRequestID id;
-    BluetoothIntelDebugFeatures features;
+    const BluetoothIntelOpCodeInfo * info;
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetQualityReport] -- %s quality report... ****\n", enable ? "Setting" : "Resetting");
+    if ( !request )
+        return false;
 
-     /* Read the Intel supported features and if new exception formats
-      * supported, need to load the additional DDC config to enable.
-      */
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCIIntelReadDebugFeatures(id, &features);
-    HCIRequestDelete(NULL, id);
-    if ( err )
-        return err;
+    info = IntelLookupOpCode(opCode);
+    if ( !info || !info->completeEvent )
+        return super::SetHCIRequestRequireEvents(opCode, request);
 
-    /* Set or reset the debug features. */
-    if ( enable )
-        err = SetDebugFeatures(&features);
-    else
-        err = ResetDebugFeatures(&features);
+    request->mExpectedEvent = (info->completeEvent == kBluetoothHCIEventCommandStatus) ? 5 : 2; // command status : command complete
+    request->mNumberOfExpectedExplicitCompleteEvents = 0;
+    if ( info->explicitEvent )
+        request->mExpectedExplicitCompleteEvents[request->mNumberOfExpectedExplicitCompleteEvents++] = info->explicitEvent;
 
-    return err;
+    /* Never loosen a timeout the caller chose, e.g. during teardown. */
+    if ( info->timeout && (!request->mTimeout || request->mTimeout > info->timeout) )
+        request->mTimeout = info->timeout;
+
+    return true;
 }
 
-#if 0
-static int btintel_get_codec_config_data(struct hci_dev *hdev,
-                   __u8 link, struct bt_codec *codec,
-                   __u8 *ven_len, __u8 **ven_data)
+bool IntelBluetoothHostController::GetCompleteCodeForCommand(BluetoothHCICommandOpCode inOpCode, BluetoothHCIEventCode * outEventCode)
 {
-    int err = 0;
+    const BluetoothIntelOpCodeInfo * info;
 
-    if ( !ven_data || !ven_len )
-        return -EINVAL;
+    info = IntelLookupOpCode(inOpCode);
+    if ( !info || !info->completeEvent )
+        return super::GetCompleteCodeForCommand(inOpCode, outEventCode);
 
-    *ven_len = 0;
-    *ven_data = NULL;
+    if ( outEventCode )
+        *outEventCode = info->completeEvent;
 
-    if ( link != ESCO_LINK ) {
-        bt_dev_err(hdev, "Invalid link type(%u)", link);
-        return -EINVAL;
-    }
+    return true;
+}
 
-    *ven_data = kmalloc(sizeof(__u8), GFP_KERNEL);
-    if ( !*ven_data ) {
-        err = -ENOMEM;
-        goto error;
-    }
+IOReturn IntelBluetoothHostController::LoadDDCConfig(OSData * fwData)
+{
+    IOReturn err;
+    BluetoothIntelDDCSyncStatistics before;
+    BluetoothIntelDDCSyncStatistics * after;
+    AbsoluteTime callTime;
+    AbsoluteTime duration;
 
-    // supports only CVSD and mSBC offload codecs
-    switch ( codec->id )
-    {
-        case 0x02:
-            **ven_data = 0x00;
-            break;
-        case 0x05:
-            **ven_data = 0x01;
-            break;
-        default:
-            err = -EINVAL;
-            bt_dev_err(hdev, "Invalid codec id(%u)", codec->id);
-            goto error;
-    }
+    if ( !fwData )
+        return kIOReturnBadArgument;
 
-    /* codec and its capabilities are pre-defined to ids
-     * preset id = 0x00 represents CVSD codec with sampling rate 8K
-     * preset id = 0x01 represents mSBC codec with sampling rate 16K
+    before = mDDCStatistics[kBluetoothIntelDDCSyncPathLoadConfig];
+    after = &mDDCStatistics[kBluetoothIntelDDCSyncPathLoadConfig];
+    callTime = mBluetoothFamily->GetCurrentTime();
+
+    /* DDC file contains one or more DDC structure which has
+     * Length (1 byte), DDC ID (2 bytes), and DDC value (Length - 2).
      */
+    err = SyncDDCConfig((UInt8 *) fwData->getBytesNoCopy(), fwData->getLength(), kBluetoothIntelDDCSyncPathLoadConfig);
+    if ( err )
+        return err;
 
-    *ven_len = sizeof(__u8);
-    return err;
+    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][LoadDDCConfig] -- Successfully applied %u DDC parameters (%u unchanged) with %u read and %u write command(s) in %llu usecs! ****\n", after->records - before.records, after->skipped - before.skipped, after->readCommands - before.readCommands, after->writeCommands - before.writeCommands, duration / 1000);
 
-error:
-    kfree(*ven_data);
-    *ven_data = NULL;
-    return err;
+    return kIOReturnSuccess;
 }
-#endif
 
-IOReturn IntelBluetoothHostController::ConfigureOffload()
+IOReturn IntelBluetoothHostController::SyncDDCConfig(const UInt8 * data, UInt32 dataSize, BluetoothIntelDDCSyncPath path)
 {
     IOReturn err;
-    BluetoothHCIRequestID id;
-    BluetoothIntelOffloadUseCases cases;
+    UInt8 batch[kIntelDDCMaxParamLength];
+    UInt32 batchSize;
+    UInt32 batchOffset;
+    UInt32 offset;
+    UInt32 numRecords;
+    UInt32 recordSize;
+    UInt16 ddcID;
+    bool fingerprintValid;
+    BluetoothIntelControllerFingerprint fingerprint;
+    BluetoothIntelDDCCacheEntry defaultEntry;
+    BluetoothIntelDDCCacheEntry * entry;
+    BluetoothIntelDDCSyncStatistics * stats;
+
+    if ( path >= kBluetoothIntelDDCSyncPathCount )
+        return kIOReturnBadArgument;
 
-    err = HCIRequestCreate(&id);
+    /* Walk the whole list once before sending anything so that a
+     * truncated or corrupted file never leaves the controller with
+     * only part of its configuration applied. This also bounds every
+     * record to a single Write Config DDC command.
+     */
+    err = ValidateDDCConfig(data, dataSize, &numRecords);
     if ( err )
     {
-        REQUIRE_NO_ERR(err);
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SyncDDCConfig] -- DDC data is corrupted, no parameters applied: 0x%x ****\n", err);
         return err;
     }
-    err = BluetoothHCIIntelReadOffloadUseCases(id, &cases);
-    HCIRequestDelete(NULL, id);
 
-    if ( cases.preset[0] & 0x03 )
+    stats = &mDDCStatistics[path];
+    stats->records += numRecords;
+
+    /* The firmware defaults are only looked up while the controller
+     * still holds them, under the build it runs.
+     */
+    fingerprintValid = mDDCSyncMode && mDDCBootDefaults && !ReadControllerFingerprint(&fingerprint, true) && fingerprint.operational;
+
+    batchSize = 0;
+    for ( offset = 0; offset <= dataSize; offset += recordSize )
     {
-        /* Intel uses 1 as data path id for all the usecases */
-        //*data_path_id = 1;
-        //hdev->get_codec_config_data = btintel_get_codec_config_data;
+        recordSize = offset < dataSize ? data[offset] + sizeof(UInt8) : 0;
+
+        /* Flush the pending records once the next one no longer fits
+         * into the parameter block, or when the list is exhausted.
+         */
+        if ( batchSize && ( offset == dataSize || !mDDCBatchWrites || batchSize + recordSize > kIntelDDCMaxParamLength ) )
+        {
+            err = CallBluetoothHCIIntelWriteDDC(batch, batchSize);
+            ++stats->writeCommands;
+
+            /* Nothing documents that every firmware takes more than one
+             * DDC structure per command, so a rejected batch is written
+             * again record by record.
+             */
+            if ( err && batch[0] + sizeof(UInt8) < batchSize )
+            {
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SyncDDCConfig] -- Batched write of DDC parameters failed: 0x%x -- writing them one at a time ****\n", err);
+                ++stats->batchFallbacks;
+                for ( batchOffset = 0; batchOffset < batchSize; batchOffset += batch[batchOffset] + sizeof(UInt8) )
+                {
+                    err = CallBluetoothHCIIntelWriteDDC(batch + batchOffset, batch[batchOffset] + sizeof(UInt8));
+                    ++stats->writeCommands;
+                    if ( err )
+                        break;
+                }
+                if ( !err )
+                    mDDCBatchWrites = false;
+            }
+
+            PublishDDCStatistics();
+            if ( err )
+            {
+                /* Part of the records may have been applied. */
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SyncDDCConfig] -- Failed to write DDC parameters: 0x%x ****\n", err);
+                InvalidateDDCCache(false);
+                return err;
+            }
+
+            for ( batchOffset = 0; batchOffset < batchSize; batchOffset += batch[batchOffset] + sizeof(UInt8) )
+                UpdateDDCCache(batch + batchOffset);
+            batchSize = 0;
+        }
+
+        if ( offset == dataSize )
+            break;
+
+        ddcID = OSReadLittleInt16(data, offset + 1);
+        entry = LookupDDCCacheEntry(ddcID);
+
+        if ( !entry && fingerprintValid && mDDCBootDefaults && LookupDDCDefault(&fingerprint, ddcID, &defaultEntry) )
+            entry = &defaultEntry;
+
+        if ( !entry && mDDCSyncMode )
+        {
+            err = CallBluetoothHCIIntelReadConfigDDC(ddcID);
+            ++stats->readCommands;
+            if ( err )
+            {
+                /* Not every firmware implements Read Config DDC, in which
+                 * case this record is simply written.
+                 */
+                os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SyncDDCConfig] -- Failed to read DDC 0x%04x, writing it: 0x%x ****\n", ddcID, err);
+            }
+            entry = LookupDDCCacheEntry(ddcID);
+            if ( entry && fingerprintValid && mDDCBootDefaults )
+                StoreDDCDefault(&fingerprint, entry);
+        }
+
+        if ( mDDCSyncMode && entry && entry->length == data[offset] - sizeof(UInt16) && !memcmp(entry->value, data + offset + sizeof(UInt8) + sizeof(UInt16), entry->length) )
+        {
+            ++stats->skipped;
+            continue;
+        }
+
+        memcpy(batch + batchSize, data + offset, recordSize);
+        batchSize += recordSize;
     }
 
-    return err;
+    PublishDDCStatistics();
+    return kIOReturnSuccess;
 }
 
-IOReturn IntelBluetoothHostController::WaitForFirmwareDownload(UInt32 callTime, UInt32 deadline)
+IOReturn IntelBluetoothHostController::ValidateDDCConfig(const UInt8 * data, UInt32 dataSize, UInt32 * numRecords)
 {
-    IOReturn err;
-    AbsoluteTime duration;
-
-    mFirmwareLoaded = true;
-    setProperty("FirmwareLoaded", true);
+    UInt32 badOffset = 0;
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Waiting for firmware download to complete... ****\n");
+    if ( !data || !numRecords )
+        return kIOReturnBadArgument;
 
-    err = ControllerCommandSleep(&mDownloading, deadline, (char *) __FUNCTION__, true);
-    if ( err == THREAD_INTERRUPTED )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loading interrupted! ****\n");
-        return THREAD_INTERRUPTED;
-    }
-    else if ( err )
+    if ( !IntelValidateDDCConfig(data, dataSize, *numRecords, badOffset) )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loading timed out! ****\n");
-        return kIOReturnTimeout;
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ValidateDDCConfig] -- Invalid DDC record at offset %u (length %u, file size %u) ****\n", badOffset, data[badOffset], dataSize);
+        return kIOReturnInvalid;
     }
 
-    if ( mFirmwareLoadingFailed )
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loading failed according to the vendor specific event, which could cause strange behavior. ****\n");
-
-    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForFirmwareDownload] -- Firmware loaded in %llu usecs. ****\n", duration >> 10);
-
     return kIOReturnSuccess;
 }
 
-IOReturn IntelBluetoothHostController::WaitForDeviceBoot(UInt32 callTime, UInt32 deadline)
+IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelWriteDDC(UInt8 * data, UInt8 dataSize)
 {
     IOReturn err;
-    AbsoluteTime duration;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
 
-    err = ControllerCommandSleep(&mBooting, deadline, (char *) __FUNCTION__, true);
-    if ( err == THREAD_INTERRUPTED )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Device boot interrupted! ****\n");
-        return THREAD_INTERRUPTED;
-    }
-    else if ( err )
+    err = lease.Acquire(&id);
+    if ( err )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Device boot timed out! ****\n");
-        return kIOReturnTimeout;
+        REQUIRE_NO_ERR(err);
+        return err;
     }
+    err = BluetoothHCIIntelWriteDDC(id, data, dataSize);
+    lease.Release();
 
-    absolutetime_to_nanoseconds(mBluetoothFamily->GetCurrentTime() - callTime, &duration);
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][WaitForDeviceBoot] -- Device booted in %llu usecs. ****\n", duration >> 10);
-
-    return kIOReturnSuccess;
+    return err;
 }
 
-IOReturn IntelBluetoothHostController::BootDevice(UInt32 bootAddress)
+IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelReadConfigDDC(UInt16 ddcID)
 {
     IOReturn err;
     BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    UInt8 record[kIntelDDCMaxParamLength];
 
-    mBooting = true;
+    static_assert(sizeof(record) >= kIntelResponseMaxSize, "Read Config DDC response does not fit the record");
+    bzero(record, sizeof(record));
 
-    err = HCIRequestCreate(&id);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
-        goto reset;
+        return err;
     }
-    err = BluetoothHCISendIntelReset(id, 0, true, false, 1, bootAddress);
-    HCIRequestDelete(NULL, id);
+    err = BluetoothHCIIntelReadConfigDDC(id, ddcID, record, sizeof(record));
+    lease.Release();
     if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BootDevice] -- Soft reset failed: 0x%x ****\n", err);
-reset:
-        ResetToBootloader(false);
         return err;
-    }
 
-    /* The bootloader will not indicate when the device is ready. This
-     * is done by the operational firmware sending bootup notification.
-     *
-     * Booting into operational firmware should not take longer than
-     * 1 second. However if that happens, then just fail the setup
-     * since something went wrong.
-     */
-    err = WaitForDeviceBoot(mBluetoothFamily->GetCurrentTime(), 1000);
-    if ( err == kIOReturnTimeout )
-        goto reset;
+    if ( record[0] < sizeof(UInt16) || record[0] + sizeof(UInt8) > kIntelResponseMaxSize || OSReadLittleInt16(record, 1) != ddcID )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CallBluetoothHCIIntelReadConfigDDC] -- Unexpected response for DDC 0x%04x: length = %u, ID = 0x%04x ****\n", ddcID, record[0], OSReadLittleInt16(record, 1));
+        return kIOReturnInvalid;
+    }
 
+    UpdateDDCCache(record);
     return kIOReturnSuccess;
 }
 
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
-IOReturn IntelBluetoothHostController::GetOpCodeAndEventCode(UInt8 * inDataPtr, UInt32 inDataSize, BluetoothHCICommandOpCode * outOpCode, UInt8 * numOpCodes, BluetoothHCIEventCode * eventCode, BluetoothHCIEventStatus * outStatus, BluetoothDeviceAddress * outDeviceAddress, BluetoothConnectionHandle * outConnectionHandle, bool * complete)
+BluetoothIntelDDCCacheEntry * IntelBluetoothHostController::LookupDDCCacheEntry(UInt16 ddcID)
 {
-    if ( !inDataPtr || !inDataSize || !outOpCode || !numOpCodes || !eventCode || !outStatus || !outDeviceAddress || !outConnectionHandle || !complete )
-        return kIOReturnBadArgument;
-    
-    IOReturn err = super::GetOpCodeAndEventCode(inDataPtr, inDataSize, outOpCode, numOpCodes, eventCode, outStatus, outDeviceAddress, outConnectionHandle, complete);
-    
-    if ( *eventCode == kBluetoothHCIEventCommandStatus && *outOpCode == 0xFC2F )
-        *complete = true;
-    
-    return err;
+    for ( int i = 0; i < kIntelDDCCacheSize; ++i )
+    {
+        if ( mDDCCache[i].valid && mDDCCache[i].id == ddcID )
+            return &mDDCCache[i];
+    }
+    return NULL;
 }
-#endif
 
-void IntelBluetoothHostController::ProcessEventDataWL(UInt8 * inDataPtr, UInt32 inDataSize, UInt32 sequenceNumber)
+void IntelBluetoothHostController::UpdateDDCCache(const UInt8 * record)
 {
-    IOReturn err;
-    BluetoothHCIRequestID id;
-    BluetoothIntelExceptionInfo info;
-
-    if ( inDataSize <= kBluetoothHCIEventPacketHeaderSize )
-        return;
-
-    BluetoothHCIEventPacketHeader * event = (BluetoothHCIEventPacketHeader *) inDataPtr;
-    if ( event->dataSize != inDataSize - sizeof(BluetoothHCIEventPacketHeader) )
-        return;
+    BluetoothIntelDDCCacheEntry * entry;
+    UInt16 ddcID = OSReadLittleInt16(record, 1);
+    UInt8 length = record[0] - sizeof(UInt16);
 
-    if ( event->eventCode == kBluetoothHCIEventHardwareError )
+    entry = LookupDDCCacheEntry(ddcID);
+    if ( !entry )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ProcessEventDataWL] -- Received hardware error: 0x%02x ****\n", *(UInt8 *) (inDataPtr + kBluetoothHCIEventPacketHeaderSize));
-
-        err = HCIRequestCreate(&id);
-        if ( err )
+        for ( int i = 0; i < kIntelDDCCacheSize; ++i )
         {
-            REQUIRE_NO_ERR(err);
-            return;
+            if ( !mDDCCache[i].valid )
+            {
+                entry = &mDDCCache[i];
+                break;
+            }
         }
-        err = BluetoothHCIIntelReadExceptionInfo(id, &info);
-        if ( err )
-            return;
-        HCIRequestDelete(NULL, id);
     }
 
-    if ( mBootloaderMode && event->dataSize > 0 && event->eventCode == kBluetoothHCIEventVendorSpecific )
+    /* Values that do not fit are simply not cached, they will be
+     * written every time. The controller no longer holds its defaults
+     * for every value the cache does not know.
+     */
+    if ( !entry )
     {
-        UInt8 * param = inDataPtr + kBluetoothHCIEventPacketHeaderSize + 1;
-        UInt32 paramSize = inDataSize - kBluetoothHCIEventPacketHeaderSize - 1;
-
-        switch ( inDataPtr[2] )
-        {
-            case kBluetoothHCIEventIntelBootup:
-                /* When switching to the operational firmware
-                 * the device sends a vendor specific event
-                 * indicating that the bootup completed.
-                 */
-                if ( paramSize != sizeof(BluetoothIntelBootupEventParams) )
-                    return;
-
-                if ( mBooting )
-                {
-                    mBooting = false;
-                    mCommandGate->commandWakeup(&mBooting);
-                }
-                break;
+        mDDCBootDefaults = false;
+        return;
+    }
+    if ( length > kIntelDDCMaxValueLength )
+    {
+        entry->valid = false;
+        mDDCBootDefaults = false;
+        return;
+    }
 
-            case kBluetoothHCIEventIntelSecureSendCommandsResult:
-                /* When the firmware loading completes the
-                 * device sends out a vendor specific event
-                 * indicating the result of the firmware
-                 * loading.
-                 */
-                BluetoothIntelSecureSendResultEventParams * eventParam = (BluetoothIntelSecureSendResultEventParams *) param;
+    entry->id = ddcID;
+    entry->length = length;
+    memcpy(entry->value, record + sizeof(UInt8) + sizeof(UInt16), length);
+    entry->valid = true;
+}
 
-                if ( paramSize != sizeof(BluetoothIntelSecureSendResultEventParams) )
-                    return;
+void IntelBluetoothHostController::InvalidateDDCCache(bool booted)
+{
+    for ( int i = 0; i < kIntelDDCCacheSize; ++i )
+        mDDCCache[i].valid = false;
+    mDDCBootDefaults = booted;
+}
 
-                if ( eventParam->result )
-                    mFirmwareLoadingFailed = true;
+bool IntelBluetoothHostController::LookupDDCDefault(const BluetoothIntelControllerFingerprint * fingerprint, UInt16 ddcID, BluetoothIntelDDCCacheEntry * outEntry)
+{
+    bool found = false;
 
-                if ( mDownloading && mFirmwareLoaded )
-                {
-                    mDownloading = false;
-                    mCommandGate->commandWakeup(&mDownloading);
-                }
+    sSharedStoreLock.Lock();
+    if ( sDDCDefaults.valid && !memcmp(&sDDCDefaults.fingerprint, fingerprint, sizeof(BluetoothIntelControllerFingerprint)) )
+    {
+        for ( int i = 0; i < kIntelDDCCacheSize; ++i )
+        {
+            if ( sDDCDefaults.entries[i].valid && sDDCDefaults.entries[i].id == ddcID )
+            {
+                *outEntry = sDDCDefaults.entries[i];
+                found = true;
                 break;
+            }
         }
     }
+    sSharedStoreLock.Unlock();
 
-    super::ProcessEventDataWL(inDataPtr, inDataSize, sequenceNumber);
+    return found;
 }
 
-bool IntelBluetoothHostController::SetHCIRequestRequireEvents(BluetoothHCICommandOpCode opCode, IOBluetoothHCIRequest * request)
+void IntelBluetoothHostController::StoreDDCDefault(const BluetoothIntelControllerFingerprint * fingerprint, const BluetoothIntelDDCCacheEntry * entry)
 {
-    if ( !request )
-        return false;
+    BluetoothIntelDDCCacheEntry * slot = NULL;
 
-    switch ( opCode )
-    {
-        case 0xFC01:
-        case 0xFC05:
-        case 0xFC09:
-        case 0xFC0D:
-        case 0xFC11:
-        case 0xFC52:
-        case 0xFC60:
-        case 0xFC86:
-        case 0xFC8B:
-        case 0xFC8E:
-        case 0xFCA1:
-        case 0xFCA6:
-            request->mExpectedEvent = 2; // command complete
-            request->mNumberOfExpectedExplicitCompleteEvents = 0;
-            return true;
-            
-        case 0xFC2F:
-            request->mExpectedEvent = 5; // command status
-            request->mNumberOfExpectedExplicitCompleteEvents = 1;
-            request->mExpectedExplicitCompleteEvents[0] = kBluetoothHCIEventVendorSpecific;
-            return true;
+    sSharedStoreLock.Lock();
 
-        default:
-            return super::SetHCIRequestRequireEvents(opCode, request);
+    /* A different firmware build has different defaults. */
+    if ( !sDDCDefaults.valid || memcmp(&sDDCDefaults.fingerprint, fingerprint, sizeof(BluetoothIntelControllerFingerprint)) )
+    {
+        bzero(&sDDCDefaults, sizeof(sDDCDefaults));
+        sDDCDefaults.fingerprint = *fingerprint;
+        sDDCDefaults.valid = true;
     }
-}
-
-bool IntelBluetoothHostController::GetCompleteCodeForCommand(BluetoothHCICommandOpCode inOpCode, BluetoothHCIEventCode * outEventCode)
-{
-    BluetoothHCIEventCode eventCode;
-
-    switch ( inOpCode )
-    {
-        case 0xFC01:
-        case 0xFC05:
-        case 0xFC09:
-        case 0xFC0D:
-        case 0xFC11:
-        case 0xFC52:
-        case 0xFC60:
-        case 0xFC86:
-        case 0xFC8B:
-        case 0xFC8E:
-        case 0xFCA1:
-        case 0xFCA6:
-            eventCode = kBluetoothHCIEventCommandComplete;
-            break;
 
-        case 0xFC2F:
-            eventCode = kBluetoothHCIEventCommandStatus;
+    for ( int i = 0; i < kIntelDDCCacheSize; ++i )
+    {
+        if ( sDDCDefaults.entries[i].valid && sDDCDefaults.entries[i].id == entry->id )
+        {
+            slot = &sDDCDefaults.entries[i];
             break;
-            
-        default:
-            return super::GetCompleteCodeForCommand(inOpCode, outEventCode);
+        }
+        if ( !slot && !sDDCDefaults.entries[i].valid )
+            slot = &sDDCDefaults.entries[i];
     }
+    if ( slot )
+        *slot = *entry;
 
-    if ( outEventCode )
-        *outEventCode = eventCode;
-
-    return true;
+    sSharedStoreLock.Unlock();
 }
 
-IOReturn IntelBluetoothHostController::LoadDDCConfig(OSData * fwData)
+void IntelBluetoothHostController::PublishDDCStatistics()
 {
-    IOReturn err;
-    BluetoothHCIRequestID id;
-    UInt8 * fwPtr;
-    UInt8 cmdDataSize;
+    static const char * pathNames[kBluetoothIntelDDCSyncPathCount] = { "LoadDDCConfig", "SetDebugFeatures", "ResetDebugFeatures" };
+    OSDictionary * statistics;
+    OSDictionary * pathStatistics;
 
-    fwPtr = (UInt8 *) fwData->getBytesNoCopy();
+    statistics = OSDictionary::withCapacity(kBluetoothIntelDDCSyncPathCount + 2);
+    if ( !statistics )
+        return;
 
-    /* DDC file contains one or more DDC structure which has
-     * Length (1 byte), DDC ID (2 bytes), and DDC value (Length - 2).
-     */
-    while ( fwData->getLength() > fwPtr - (UInt8 *) fwData->getBytesNoCopy() )
-    {
-        cmdDataSize = fwPtr[0] + sizeof(UInt8);
+    statistics->setObject("SyncMode", mDDCSyncMode ? kOSBooleanTrue : kOSBooleanFalse);
+    statistics->setObject("BatchWrites", mDDCBatchWrites ? kOSBooleanTrue : kOSBooleanFalse);
 
-        err = HCIRequestCreate(&id);
-        if ( err )
+    for ( int i = 0; i < kBluetoothIntelDDCSyncPathCount; ++i )
+    {
+        const BluetoothIntelStatistic path[] =
         {
-            REQUIRE_NO_ERR(err);
-            return err;
-        }
-        err = BluetoothHCIIntelWriteDDC(id, fwPtr, cmdDataSize);
-        if ( err )
-            return err;
-        HCIRequestDelete(NULL, id);
-
-        fwPtr += cmdDataSize;
+            { "Records",        mDDCStatistics[i].records,        32 },
+            { "Skipped",        mDDCStatistics[i].skipped,        32 },
+            { "ReadCommands",   mDDCStatistics[i].readCommands,   32 },
+            { "WriteCommands",  mDDCStatistics[i].writeCommands,  32 },
+            { "BatchFallbacks", mDDCStatistics[i].batchFallbacks, 32 }
+        };
+
+        pathStatistics = CreateStatisticsDictionary(path, sizeof(path) / sizeof(path[0]));
+        if ( !pathStatistics )
+            continue;
+
+        statistics->setObject(pathNames[i], pathStatistics);
+        pathStatistics->release();
     }
 
-    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][LoadDDCConfig] -- Successfully applied DDC parameters! ****\n");
-
-    return kIOReturnSuccess;
+    setProperty("DDCStatistics", statistics);
+    statistics->release();
 }
 
 IOReturn IntelBluetoothHostController::BluetoothHCIIntelSecureSend(BluetoothHCIIntelSecureSendFragmentType fragmentType, UInt32 paramSize, const UInt8 * param)
@@ -1527,12 +4718,19 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelSecureSend(BluetoothHCII
     IOReturn err;
     UInt8 fragmentSize;
     BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+    BluetoothIntelSecureSendPacket packet;
+    UInt8 type = fragmentType;
 
     while ( paramSize > 0 )
     {
-        fragmentSize = (paramSize > 252) ? 252 : paramSize;
+        fragmentSize = (paramSize > kIntelSecureSendMaxFragmentLength) ? kIntelSecureSendMaxFragmentLength : paramSize;
+
+        packet.paramSize = 0;
+        packet.Append(&type, sizeof(type));
+        packet.Append(param, fragmentSize);
 
-        err = HCIRequestCreate(&id);
+        err = lease.Acquire(&id);
         if ( err )
         {
             REQUIRE_NO_ERR(err);
@@ -1544,8 +4742,8 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelSecureSend(BluetoothHCII
             os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelSecureSend] -- Failed to prepare request for new command: 0x%x ****\n", err);
             return err;
         }
-        err = SendHCIRequestFormatted(id, 0xFC09, 0, NULL, "Hbbn", 0xFC09, fragmentSize + 1, fragmentType, fragmentSize, param);
-        HCIRequestDelete(NULL, id);
+        err = SendIntelCommand(id, packet);
+        lease.Release();
         if ( err )
         {
             REQUIRE_NO_ERR(err);
@@ -1570,7 +4768,14 @@ IOReturn IntelBluetoothHostController::BluetoothHCISendIntelReset(BluetoothHCIRe
         return err;
     }
     
-    err = SendHCIRequestFormatted(inID, 0xFC01, 0, NULL, "HbbbbbW", 0xFC01, 8, resetType, enablePatch, reloadDDC, bootOption, bootAddress);
+    /* Whatever the outcome, the controller may be rebooting now. The
+     * bootup event it sends afterwards tells what survived the reset.
+     */
+    InvalidateDDCCache(false);
+    InvalidateControllerIdentity("Intel Reset");
+    mBootupEventValid = false;
+
+    err = SendIntelCommand(inID, BluetoothIntelResetPacket({ resetType, enablePatch, reloadDDC, bootOption, OSSwapHostToLittleInt32(bootAddress) }));
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCISendIntelReset] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC01, err);
@@ -1591,7 +4796,7 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelEnterManufacturerMode(Bl
         return err;
     }
     
-    err = SendHCIRequestFormatted(inID, 0xFC11, 0, NULL, "Hbbb", 0xFC11, 2, 0x01, 0x00);
+    err = SendIntelCommand(inID, BluetoothIntelManufacturerModePacket({ 0x01, 0x00 }));
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelEnterManufacturerMode] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC11, err);
@@ -1612,7 +4817,13 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelExitManufacturerMode(Blu
         return err;
     }
 
-    err = SendHCIRequestFormatted(inID, 0xFC11, 0, NULL, "Hbbb", 0xFC11, 2, 0x00, resetOption);
+    if ( resetOption )
+    {
+        InvalidateDDCCache(false);
+        InvalidateControllerIdentity("Manufacturer Mode Reset");
+    }
+
+    err = SendIntelCommand(inID, BluetoothIntelManufacturerModePacket({ 0x00, (UInt8) resetOption }));
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelExitManufacturerMode] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC11, err);
@@ -1622,56 +4833,82 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelExitManufacturerMode(Blu
     return kIOReturnSuccess;
 }
 
-IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelSetEventMask(bool debug)
+IOReturn IntelBluetoothHostController::BeginManufacturerMode()
 {
     IOReturn err;
     BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
 
-    if ( mGeneration == 1 )
+    if ( mManufacturerModeDepth )
     {
-        err = HCIRequestCreate(&id);
-        if ( err )
-        {
-            REQUIRE_NO_ERR(err);
-            return err;
-        }
-        err = BluetoothHCIIntelEnterManufacturerMode(id);
-        HCIRequestDelete(NULL, id);
-        if ( err )
-            return err;
+        ++mManufacturerModeDepth;
+        return kIOReturnSuccess;
     }
 
-    err = HCIRequestCreate(&id);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
         return err;
     }
-    err = BluetoothHCIIntelSetEventMask(id, debug);
-    HCIRequestDelete(NULL, id);
+    err = BluetoothHCIIntelEnterManufacturerMode(id);
+    lease.Release();
     if ( err )
         return err;
 
-    if ( mGeneration == 1 )
+    mManufacturerModeDepth = 1;
+    mManufacturerModeResetOption = kBluetoothIntelManufacturingExitResetOptionsNoReset;
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::EndManufacturerMode(BluetoothIntelManufacturingExitResetOption resetOption)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+
+    if ( !mManufacturerModeDepth )
+        return kIOReturnNotOpen;
+
+    if ( resetOption != kBluetoothIntelManufacturingExitResetOptionsNoReset && mManufacturerModeResetOption != kBluetoothIntelManufacturingExitResetOptionResetDeactivatePatches )
+        mManufacturerModeResetOption = resetOption;
+
+    if ( --mManufacturerModeDepth )
+        return kIOReturnSuccess;
+
+    err = lease.Acquire(&id);
+    if ( err )
     {
-        err = HCIRequestCreate(&id);
-        if ( err )
-        {
-            REQUIRE_NO_ERR(err);
-            return err;
-        }
-        err = BluetoothHCIIntelExitManufacturerMode(id, kBluetoothIntelManufacturingExitResetOptionsNoReset);
-        HCIRequestDelete(NULL, id);
-        if ( err )
-            return err;
+        REQUIRE_NO_ERR(err);
+        return err;
     }
+    err = BluetoothHCIIntelExitManufacturerMode(id, mManufacturerModeResetOption);
+    lease.Release();
+    return err;
+}
 
-    return kIOReturnSuccess;
+IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelSetEventMask(bool debug)
+{
+    IOReturn err;
+    BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
+
+    err = lease.Acquire(&id);
+    if ( err )
+    {
+        REQUIRE_NO_ERR(err);
+        return err;
+    }
+    err = BluetoothHCIIntelSetEventMask(id, debug);
+    lease.Release();
+
+    return err;
 }
 
 IOReturn IntelBluetoothHostController::BluetoothHCIIntelSetEventMask(BluetoothHCIRequestID inID, bool debug)
 {
     IOReturn err;
+    BluetoothIntelSetEventMaskPacket packet(IntelVendorEventMask(debug));
     
     err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
     if ( err )
@@ -1680,13 +4917,16 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelSetEventMask(BluetoothHC
         return err;
     }
     
-    err = SendHCIRequestFormatted(inID, 0xFC52, 0, NULL, "Hbbbbbbbbb", 0xFC52, 8, 0x87, debug ? 0x6E : 0x0C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+    err = SendIntelCommand(inID, packet);
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelSetEventMask] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC52, err);
         return err;
     }
 
+    if ( mConfigRecordingActive )
+        RecordConfigCommand(packet.OpCode(), packet.params.mask, sizeof(packet.params));
+
     return kIOReturnSuccess;
 }
 
@@ -1694,57 +4934,27 @@ IOReturn IntelBluetoothHostController::CallBluetoothHCIIntelSetDiagnosticMode(bo
 {
     IOReturn err;
     BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
 
-    /* Legacy ROM device needs to be in the manufacturer mode to apply
-     * diagnostic settings.
-     */
-    if ( mGeneration == 1 )
-    {
-        err = HCIRequestCreate(&id);
-        if ( err )
-        {
-            REQUIRE_NO_ERR(err);
-            return err;
-        }
-        err = BluetoothHCIIntelEnterManufacturerMode(id);
-        HCIRequestDelete(NULL, id);
-        if ( err )
-            return err;
-    }
-
-    err = HCIRequestCreate(&id);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
         return err;
     }
     err = BluetoothHCIIntelSetDiagnosticMode(id, enable);
-    HCIRequestDelete(NULL, id);
+    lease.Release();
     if ( err )
         return err;
 
-    err = HCIRequestCreate(&id);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
         return err;
     }
     BluetoothHCIIntelSetEventMask(id, enable);
-    HCIRequestDelete(NULL, id);
-
-    if ( mGeneration == 1 )
-    {
-        err = HCIRequestCreate(&id);
-        if ( err )
-        {
-            REQUIRE_NO_ERR(err);
-            return err;
-        }
-        err = BluetoothHCIIntelExitManufacturerMode(id, kBluetoothIntelManufacturingExitResetOptionsNoReset);
-        HCIRequestDelete(NULL, id);
-        if ( err )
-            return err;
-    }
+    lease.Release();
 
     return kIOReturnSuccess;
 }
@@ -1761,9 +4971,9 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelSetDiagnosticMode(Blueto
     }
 
     if ( enable )
-        err = SendHCIRequestFormatted(inID, 0xFC43, 0, NULL, "Hbbbb", 0xFC43, 3, 0x03, 0x03, 0x03);
+        err = SendIntelCommand(inID, BluetoothIntelSetDiagnosticModePacket(BluetoothIntelCommandSetDiagnosticMode { { 0x03, 0x03, 0x03 } }));
     else
-        err = SendHCIRequestFormatted(inID, 0xFC43, 0, NULL, "Hbbbb", 0xFC43, 3, 0x00, 0x00, 0x00);
+        err = SendIntelCommand(inID, BluetoothIntelSetDiagnosticModePacket(BluetoothIntelCommandSetDiagnosticMode { { 0x00, 0x00, 0x00 } }));
 
     if ( err ) // && err != -ENODATA
     {
@@ -1785,7 +4995,7 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadBootParams(Bluetooth
         return err;
     }
 
-    err = SendHCIRequestFormatted(inID, 0xFC0D, sizeof(BluetoothIntelBootParams), params, "Hb", 0xFC0D, 0);
+    err = SendIntelCommand(inID, BluetoothIntelReadBootParamsPacket(), sizeof(BluetoothIntelBootParams), params);
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadBootParams] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC0D, err);
@@ -1812,9 +5022,9 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadVersionInfo(Bluetoot
     }
 
     if ( param == 0x00 )
-        err = SendHCIRequestFormatted(inID, 0xFC05, sizeof(BluetoothIntelVersionInfo), response, "Hb", 0xFC05, 0);
+        err = SendIntelCommand(inID, BluetoothIntelReadVersionInfoPacket(), sizeof(BluetoothIntelVersionInfo), response);
     else if ( param == 0xFF )
-        err = SendHCIRequestFormatted(inID, 0xFC05, kMaxHCIBufferLength * 4, response, "Hbb", 0xFC05, 1, 0xFF);
+        err = SendIntelCommand(inID, BluetoothIntelReadVersionInfoTLVPacket({ 0xFF }), kMaxHCIBufferLength * 4, response);
     else
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadVersionInfo] -- Invalid parameter (0x%02X), should be either 0x00 or 0xFF. ****\n", param);
@@ -1847,7 +5057,7 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadDebugFeatures(Blueto
     /* Intel controller supports two pages, each page is of 128-bit
      * feature bit mask. And each bit defines specific feature support
      */
-    err = SendHCIRequestFormatted(inID, 0xFCA6, sizeof(BluetoothIntelDebugFeatures), features, "Hbb", 0xFCA6, 1, 1);
+    err = SendIntelCommand(inID, BluetoothIntelReadDebugFeaturesPacket({ 0x01 }), sizeof(BluetoothIntelDebugFeatures), features);
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadDebugFeatures] ### ERROR: opCode = 0x%04X -- send request failed -- failed to read supported features for page 1: 0x%x ****\n", 0xFCA6, err);
@@ -1861,8 +5071,10 @@ IOReturn IntelBluetoothHostController::SetDebugFeatures(const BluetoothIntelDebu
 {
     IOReturn err;
     BluetoothHCIRequestID id;
-    UInt8 mask[11] = { 0x0a, 0x92, 0x02, 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-    UInt8 period[5] = { 0x04, 0x91, 0x02, 0x05, 0x00 };
+    IntelBluetoothHCIRequestLease lease(this);
+    /* telemetry DDC event mask followed by the periodicity for link statistics traces */
+    UInt8 ddc[16] = { 0x0a, 0x92, 0x02, 0x7f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                      0x04, 0x91, 0x02, 0x05, 0x00 };
 
     if ( !features )
     {
@@ -1876,42 +5088,21 @@ IOReturn IntelBluetoothHostController::SetDebugFeatures(const BluetoothIntelDebu
         return kIOReturnSuccess;
     }
 
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCIIntelWriteDDC(id, mask, 11);
-    HCIRequestDelete(NULL, id);
-    if ( err )
-    {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetDebugFeatures] -- BluetoothHCIIntelWriteDDC() failed -- telemetry DDC event mask not set: 0x%x ****\n", err);
-        return err;
-    }
-
-    err = HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = BluetoothHCIIntelWriteDDC(id, period, 5);
-    HCIRequestDelete(NULL, id);
+    err = SyncDDCConfig(ddc, sizeof(ddc), kBluetoothIntelDDCSyncPathSetDebugFeatures);
     if ( err )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetDebugFeatures] -- BluetoothHCIIntelWriteDDC() failed -- periodicity for link statistics traces not set: 0x%x ****\n", err);
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][SetDebugFeatures] -- SyncDDCConfig() failed -- telemetry DDC event mask and periodicity for link statistics traces not set: 0x%x ****\n", err);
         return err;
     }
 
-    err = HCIRequestCreate(&id);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
         return err;
     }
     err = BluetoothHCIIntelSetLinkStatisticsEventsTracing(id, 0x02);
-    HCIRequestDelete(NULL, id);
+    lease.Release();
     if ( err )
         return err;
 
@@ -1924,6 +5115,7 @@ IOReturn IntelBluetoothHostController::ResetDebugFeatures(const BluetoothIntelDe
 {
     IOReturn err;
     BluetoothHCIRequestID id;
+    IntelBluetoothHCIRequestLease lease(this);
     UInt8 mask[11] = { 0x0a, 0x92, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
     if ( !features )
@@ -1938,7 +5130,7 @@ IOReturn IntelBluetoothHostController::ResetDebugFeatures(const BluetoothIntelDe
         return kIOReturnSuccess;
     }
 
-    err = HCIRequestCreate(&id);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
@@ -1946,22 +5138,14 @@ IOReturn IntelBluetoothHostController::ResetDebugFeatures(const BluetoothIntelDe
     }
 
     err = BluetoothHCIIntelSetLinkStatisticsEventsTracing(id, 0x00);
-    HCIRequestDelete(NULL, id);
-    if ( err )
-        return err;
-
-    err = HCIRequestCreate(&id);
+    lease.Release();
     if ( err )
-    {
-        REQUIRE_NO_ERR(err);
         return err;
-    }
 
-    err = BluetoothHCIIntelWriteDDC(id, mask, 11);
-    HCIRequestDelete(NULL, id);
+    err = SyncDDCConfig(mask, sizeof(mask), kBluetoothIntelDDCSyncPathResetDebugFeatures);
     if ( err )
     {
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetDebugFeatures] -- BluetoothHCIIntelWriteDDC() failed -- telemetry DDC event mask not set: 0x%x ****\n", err);
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][ResetDebugFeatures] -- SyncDDCConfig() failed -- telemetry DDC event mask not set: 0x%x ****\n", err);
         return err;
     }
 
@@ -1981,7 +5165,7 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelTurnOffDeviceLED(Bluetoo
         return err;
     }
 
-    err = SendHCIRequestFormatted(inID, 0xFC3F, 0, NULL, "Hb", 0xFC3F, 0);
+    err = SendIntelCommand(inID, BluetoothIntelSWRFKillPacket());
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelTurnOffDeviceLED] ### ERROR: opCode = 0x%04X -- send request failed -- failed to turn off device LED: 0x%x ****\n", 0xFC3F, err);
@@ -1994,6 +5178,7 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelTurnOffDeviceLED(Bluetoo
 IOReturn IntelBluetoothHostController::BluetoothHCIIntelWriteDDC(BluetoothHCIRequestID inID, UInt8 * data, UInt8 dataSize)
 {
     IOReturn err;
+    BluetoothIntelWriteDDCPacket packet;
 
     err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
     if ( err )
@@ -2002,13 +5187,45 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelWriteDDC(BluetoothHCIReq
         return err;
     }
 
-    err = SendHCIRequestFormatted(inID, 0xFC8B, 0, NULL, "Hbn", 0xFC8B, dataSize, dataSize, data);
+    packet.Append(data, dataSize);
+    err = SendIntelCommand(inID, packet);
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelWriteDDC] ### ERROR: opCode = 0x%04X -- send request failed: 0x%x ****\n", 0xFC8B, err);
         return err;
     }
-    
+
+    if ( mConfigRecordingActive )
+        RecordConfigCommand(0xFC8B, data, dataSize);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadConfigDDC(BluetoothHCIRequestID inID, UInt16 ddcID, UInt8 * record, UInt8 recordSize)
+{
+    IOReturn err;
+
+    if ( !record )
+        return kIOReturnInvalid;
+
+    /* The response is returned whole, whatever length it claims. */
+    if ( recordSize < kIntelResponseMaxSize )
+        return kIOReturnNoSpace;
+
+    err = PrepareRequestForNewCommand(inID, NULL, 0xFFFF);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadConfigDDC] -- Failed to prepare request for new command: 0x%x ****\n", err);
+        return err;
+    }
+
+    err = SendIntelCommand(inID, BluetoothIntelReadConfigDDCPacket({ OSSwapHostToLittleInt16(ddcID) }), recordSize, record);
+    if ( err )
+    {
+        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadConfigDDC] ### ERROR: opCode = 0x%04X -- send request failed -- failed to read DDC 0x%04x: 0x%x ****\n", 0xFC8C, ddcID, err);
+        return err;
+    }
+
     return kIOReturnSuccess;
 }
 
@@ -2023,7 +5240,7 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelReadOffloadUseCases(Blue
         return err;
     }
 
-    err = SendHCIRequestFormatted(inID, 0xFC86, sizeof(BluetoothIntelOffloadUseCases), cases, "Hb", 0xFC86, 0);
+    err = SendIntelCommand(inID, BluetoothIntelReadOffloadUseCasesPacket(), sizeof(BluetoothIntelOffloadUseCases), cases);
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelReadOffloadUseCases] ### ERROR: opCode = 0x%04X -- send request failed -- failed to read offload use cases: 0x%x ****\n", 0xFC86, err);
@@ -2044,13 +5261,16 @@ IOReturn IntelBluetoothHostController::BluetoothHCIIntelSetLinkStatisticsEventsT
         return err;
     }
 
-    err = SendHCIRequestFormatted(inID, 0xFCA1, 0, NULL, "Hbb", 0xFCA1, 1, param);
+    err = SendIntelCommand(inID, BluetoothIntelSetLinkStatisticsTracingPacket({ param }));
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][BluetoothHCIIntelSetLinkStatisticsEventsTracing] ### ERROR: opCode = 0x%04X -- send request failed -- failed to %s tracing of link statistics events: 0x%x ****\n", 0xFCA1, param ? "enable" : "disable", err);
         return err;
     }
 
+    if ( mConfigRecordingActive )
+        RecordConfigCommand(0xFCA1, &param, sizeof(param));
+
     return kIOReturnSuccess;
 }
 
@@ -2187,6 +5407,9 @@ bool IntelBluetoothHostController::CheckFirmwareVersion(UInt8 number, UInt8 week
             BluetoothIntelCommandWriteBootParams * params = (BluetoothIntelCommandWriteBootParams *) (fwPtr + kBluetoothHCICommandPacketHeaderSize);
 
             *bootAddress = params->bootAddress;
+            mFirmwareUpgrade.availableBuildNumber = params->firmwareBuildNumber;
+            mFirmwareUpgrade.availableBuildWeek = params->firmwareBuildWeek;
+            mFirmwareUpgrade.availableBuildYear = params->firmwareBuildYear;
             os_log(mInternalOSLogObject, "**** [IntelBluetoothHostController][CheckFirmwareVersion] -- Boot Address: 0x%x -- Firmware Version: %u-%u.%u ****\n", *bootAddress, params->firmwareBuildNumber, params->firmwareBuildWeek, params->firmwareBuildYear);
 
             return (number == params->firmwareBuildNumber && week == params->firmwareBuildWeek && year == params->firmwareBuildYear);
@@ -26,10 +26,38 @@
 #include <IOKit/bluetooth/IOBluetoothHCIController.h>
 #include <IOKit/bluetooth/IOBluetoothHCIRequest.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/IOUserClient.h>
 #include "IntelBluetoothHostControllerTypes.h"
 
 class IntelBluetoothHostControllerUSBTransport;
 
+enum BluetoothIntelSetupStepStates
+{
+    kBluetoothIntelSetupStepStatePending = 0x00,
+    kBluetoothIntelSetupStepStateRunning,
+    kBluetoothIntelSetupStepStateDone
+};
+
+/* A setup step run by RunSetupSteps(). The action is called on the
+ * workloop as action(controller, arg0, arg1, arg2, NULL). Steps whose
+ * dependencies have all completed may run concurrently.
+ */
+struct BluetoothIntelSetupStep
+{
+    const char *          name;
+    IOCommandGate::Action action;
+    void *                arg0;
+    void *                arg1;
+    void *                arg2;
+    UInt32                dependencies;     // bit mask of the indexes of the steps to complete first
+    bool                  required;         // fail the setup if the step fails
+
+    UInt8                 state;
+    IOReturn              result;
+    UInt64                duration;         // nanoseconds
+    thread_call_t         threadCall;
+};
+
 IOBLUETOOTH_EXPORT IOReturn ParseIntelVendorSpecificCommand(UInt16 ocf, UInt8 * inData, UInt32 inDataSize, UInt8 * outData, UInt32 * outDataSize, UInt8 * outStatus);
 
 class IntelBluetoothHostController : public IOBluetoothHostController
@@ -69,32 +97,280 @@ public:
     virtual IOReturn SetupGen1Controller();
     virtual IOReturn SetupGen2Controller();
     virtual IOReturn SetupGen3Controller();
+
+    /*! @function StepSetupState
+     *   @abstract Runs the current state of the setup state machine and moves on to the next one.
+     *   @discussion SetupController resets the machine and steps it until it reaches kBluetoothIntelSetupStateDone or kBluetoothIntelSetupStateFailed. A failed state is retried from its retry state while it has retries and budget left, see sSetupStatePolicies, so a failure after BootDevice no longer means starting over. The states run one after another on the calling thread: a budget is not a timeout, nothing cuts a state short but the timeouts of its own commands and waits, and a state that runs over its budget is only counted.
+     *   @result The next state.
+     */
+
+    virtual BluetoothIntelSetupState StepSetupState();
+    virtual BluetoothIntelSetupState GetSetupState();
+    virtual void ResetSetupState();
     virtual bool     InitializeHostControllerVariables(bool setup) APPLE_KEXT_OVERRIDE;
 
     virtual IOReturn SendHCIRequestFormatted(BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, IOByteCount outResultsSize, void * outResultsPtr, const char * inFormat, ...) APPLE_KEXT_OVERRIDE;
 
+    /*! @function SendHCIRequestPacked
+     *   @abstract Sends a command that is already laid out on the wire, without going through PackDataList.
+     *   @discussion Apart from copying the command into the request, this is SendHCIRequestFormatted.
+     *   @param command The opcode, the parameter length and the parameters.
+     *   @param commandSize The size of command in bytes.
+     */
+
+    virtual IOReturn SendHCIRequestPacked(BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, IOByteCount outResultsSize, void * outResultsPtr, const UInt8 * command, IOByteCount commandSize);
+    virtual IOReturn SendHCIRequestCommon(BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, IOByteCount outResultsSize, void * outResultsPtr, const UInt8 * command, IOByteCount commandSize, const char * inFormat, va_list * va);
+
+    template <typename Packet>
+    IOReturn SendIntelCommand(BluetoothHCIRequestID inID, const Packet & packet, IOByteCount outResultsSize = 0, void * outResultsPtr = NULL)
+    {
+        return SendHCIRequestPacked(inID, Packet::OpCode(), outResultsSize, outResultsPtr, (const UInt8 *) &packet, packet.Size());
+    }
+
+    /*! @function LogHCIRequestError
+     *   @abstract Logs a failure of SendHCIRequestCommon, resolving the opcode, process and error names only then.
+     *   @param message What failed.
+     *   @param err The error, or kIOReturnSuccess if there is none to name.
+     */
+
+    virtual void LogHCIRequestError(const char * message, BluetoothHCIRequestID inID, BluetoothHCICommandOpCode inOpCode, int PID, IOReturn err);
+    virtual void RecordCommandOverhead(UInt64 overhead);
+
+    /*! @function RecordCommandLatency
+     *   @abstract Accounts a synchronous request from its enqueue to its completion in the latency histogram of its opcode.
+     *   @discussion The latency, lane and process statistics are not published here but from mStatisticsThreadCall, at most once every kIntelStatisticsPublishInterval milliseconds and only while commands are sent.
+     *   @param latency The time from the enqueue to the completion, in absolute time units.
+     *   @param status The status of the completed request.
+     *   @param timedOut Whether the request was aborted waiting for the controller.
+     */
+
+    virtual void RecordCommandLatency(BluetoothHCICommandOpCode opCode, UInt64 latency, IOReturn status, bool timedOut);
+    static void StatisticsThreadCall(thread_call_param_t owner, thread_call_param_t arg);
+    virtual void PublishCommandLatencyStatistics();
+
+    /*! @function EnterCommandLane
+     *   @abstract Admits a command to the controller queue according to its lane.
+     *   @discussion The family queue is first come, first served, so priority is given before a command reaches it: a background command yields the gate while interactive commands are in flight, for at most kIntelBackgroundLaneMaxWait milliseconds so that it is never starved. Each EnterCommandLane is paired with an ExitCommandLane once the request completed or failed to enqueue, which for an asynchronous request is when its Command Complete or Command Status event arrives.
+     *   @result The nanoseconds the command was held back.
+     */
+
+    virtual UInt64 EnterCommandLane(BluetoothIntelCommandLane lane);
+    virtual void ExitCommandLane(BluetoothIntelCommandLane lane, UInt64 waitTime, UInt64 latency);
+
+    /*! @function DeferCommandLaneExit
+     *   @abstract Holds the lane of an asynchronous request until its completion event.
+     *   @discussion Lanes held longer than kIntelAsyncLaneTimeout milliseconds are given up, since a reset or an aborted request never completes. Without a free slot the lane is left at once.
+     */
+
+    virtual void DeferCommandLaneExit(BluetoothIntelCommandLane lane, BluetoothHCICommandOpCode opCode, UInt64 waitTime, UInt64 enqueueTime);
+    virtual void CompleteCommandLane(BluetoothHCICommandOpCode opCode);
+    virtual void PublishCommandLaneStatistics();
+
+    /*! @function RecordProcessCommand
+     *   @abstract Charges a command to the process that sent it.
+     *   @discussion The table holds kIntelProcessAccountingSlots processes; when it is full, the one with the fewest commands is replaced. Counters are halved every kIntelProcessAccountingHalfLife milliseconds when the table is published, so processes that stopped sending commands drop out. The table is only touched under mProcessAccountingLock, since commands are sent from many threads.
+     *   @param latency The time from the enqueue to the completion in absolute time units, or 0 for an asynchronous request.
+     */
+
+    virtual void RecordProcessCommand(int PID, IOByteCount bytes, UInt64 latency, bool timedOut);
+    virtual void DecayProcessAccounting();
+    virtual void PublishProcessAccounting();
+
+    /*! @function CompleteCachedCommand
+     *   @abstract Completes a synchronous request locally if it repeats, byte for byte, the last successful command of its opcode.
+     *   @discussion Only done when the transport personality sets SuppressRepeatCommands to true, and only for the commands of IntelLookupCommandCacheSlot. The request gets a success status without reaching the controller. The cache is only touched under mCommandCacheLock, since commands are sent from many threads.
+     *   @result Whether the request was completed.
+     */
+
+    virtual bool CompleteCachedCommand(IOBluetoothHCIRequest * request, IOByteCount outResultsSize, void * outResultsPtr);
+    virtual void UpdateCommandCache(IOBluetoothHCIRequest * request, IOReturn status);
+
+    /*! @function InvalidateCommandCache
+     *   @abstract Forgets every cached command, after the controller was reset or changed its power state.
+     *   @param reason Logged along with the invalidation.
+     */
+
+    virtual void InvalidateCommandCache(const char * reason);
+    virtual void PublishCommandCacheStatistics();
+    virtual void PublishCommandOverheadStatistics();
+
+    /*! @function CreateStatisticsDictionary
+     *   @abstract Builds a dictionary holding one OSNumber per statistic.
+     *   @discussion A number that cannot be allocated is left out.
+     *   @param statistics The keys, values and sizes in bits.
+     *   @param count The number of statistics.
+     *   @result The dictionary, to be released by the caller, or NULL.
+     */
+
+    static OSDictionary * CreateStatisticsDictionary(const BluetoothIntelStatistic * statistics, UInt32 count);
+
+    /*! @function PublishStatistics
+     *   @abstract Sets the property key to the dictionary of CreateStatisticsDictionary.
+     */
+
+    virtual void PublishStatistics(const char * key, const BluetoothIntelStatistic * statistics, UInt32 count);
+
+    /*! @function setProperties
+     *   @abstract Runs the diagnostic measurements an administrator asks for.
+     *   @discussion Setting MeasureCommandPacking or MeasureResponseDecoding to true measures the command packing or the response decoding and publishes the result. The measurements never run while the driver starts. Any other property is left to the superclass.
+     */
+
+    virtual IOReturn setProperties(OSObject * properties) APPLE_KEXT_OVERRIDE;
+    virtual void MeasureCommandPacking();
+
+    /*! @function MeasureResponseDecoding
+     *   @abstract Times ParseIntelVendorSpecificCommand on the vendor command responses this controller sent.
+     *   @discussion RecordVendorResponse keeps the last response of each OCF seen in a Command Complete event. They are copied on the command gate and replayed outside of it, kIntelResponseDecodingSamples times each. Nothing is measured before the controller answered a vendor command.
+     */
+
+    virtual void MeasureResponseDecoding();
+    virtual void RecordVendorResponse(UInt16 ocf, const UInt8 * data, UInt32 size);
+    static IOReturn CopyRecordedResponsesAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+
     virtual IOReturn SetTransportRadioPowerState(UInt8 inState) APPLE_KEXT_OVERRIDE;
     virtual IOReturn GetTransportRadioPowerState(UInt8 * outState) APPLE_KEXT_OVERRIDE;
-    virtual IOReturn CallPowerRadio(bool) APPLE_KEXT_OVERRIDE;
+
+    /*! @function CallPowerRadio
+     *   @abstract Turns the radio off or on with the Intel SW RF kill command, leaving the firmware and its configuration resident.
+     *   @discussion Radio off is only done for a controller that completed setup and runs operational firmware. Radio on lifts the kill with an HCI reset and checks the fingerprint before reapplying the volatile configuration, see WarmResumeController.
+     *   @param powerOn Whether the radio is turned on.
+     *   @result kIOReturnSuccess, or an error after which SetTransportRadioPowerState takes the full power path.
+     */
+
+    virtual IOReturn CallPowerRadio(bool powerOn) APPLE_KEXT_OVERRIDE;
 
     virtual void SetMicrosoftExtensionOpCode(UInt8 hardwareVariant); // implement in 1.0.1
     virtual IOReturn ResetToBootloader(bool retry);
     virtual IOReturn WriteDeviceAddress(BluetoothHCIRequestID inID, BluetoothDeviceAddress * inAddress) APPLE_KEXT_OVERRIDE;
     virtual IOReturn CheckDeviceAddress();
     virtual IOReturn CallBluetoothHCIIntelReadVersionInfo(UInt8 param);
+    virtual IOReturn CallBluetoothHCIIntelReadBootParams(BluetoothIntelBootParams * params);
     virtual IOReturn PrintVersionInfo(BluetoothIntelVersionInfo * version);
     virtual IOReturn PrintVersionInfo(BluetoothIntelVersionInfoTLV * version);
     virtual IOReturn ConfigureOffload(); // implement in 1.0.1
     virtual IOReturn SetQualityReport(bool enable);
     virtual IOReturn SetDebugFeatures(const BluetoothIntelDebugFeatures * features);
     virtual IOReturn ResetDebugFeatures(const BluetoothIntelDebugFeatures * features);
+
+    /*! @function CallBluetoothHCIIntelSetEventMask
+     *   @abstract Sets the mask of the Intel vendor events.
+     *   @discussion Legacy ROM (generation 1) devices only take it in the manufacturer mode, which the caller opens with an IntelBluetoothManufacturerModeSession so that it is shared with the other operations needing it.
+     *   @param debug Whether the debugging related events are enabled as well.
+     */
+
     virtual IOReturn CallBluetoothHCIIntelSetEventMask(bool debug);
+
+    /*! @function CallBluetoothHCIIntelSetDiagnosticMode
+     *   @abstract Turns the diagnostic traces on or off, followed by the matching event mask.
+     *   @discussion Legacy ROM (generation 1) devices need the manufacturer mode, opened by the caller as for CallBluetoothHCIIntelSetEventMask.
+     *   @param enable Whether the traces are turned on.
+     */
+
     virtual IOReturn CallBluetoothHCIIntelSetDiagnosticMode(bool enable);
 
-    virtual IOReturn WaitForFirmwareDownload(UInt32 callTime, UInt32 deadline);
-    virtual IOReturn WaitForDeviceBoot(UInt32 callTime, UInt32 deadline);
+    /*! @function BeginManufacturerMode
+     *   @abstract Opens a manufacturer mode session, entering the mode unless a session is already open.
+     *   @discussion Sessions nest: only the outermost one sends the enter and exit commands, so operations that each need the mode share a single enter/exit pair. Use IntelBluetoothManufacturerModeSession rather than calling this directly, it always closes the session.
+     *   @result kIOReturnSuccess, or the error of the enter command, in which case no session is open.
+     */
+
+    virtual IOReturn BeginManufacturerMode();
+
+    /*! @function EndManufacturerMode
+     *   @abstract Closes a manufacturer mode session, exiting the mode when the outermost one closes.
+     *   @discussion A reset requested by a nested session is deferred to the exit of the outermost one. Deactivating patches wins over activating them.
+     *   @param resetOption What shall be done besides exiting the mode.
+     *   @result kIOReturnSuccess, kIOReturnNotOpen without an open session, or the error of the exit command.
+     */
+
+    virtual IOReturn EndManufacturerMode(BluetoothIntelManufacturingExitResetOption resetOption);
+
+    virtual IOReturn WaitForFirmwareDownload(AbsoluteTime callTime, UInt32 deadline);
+    virtual IOReturn WaitForDeviceBoot(AbsoluteTime callTime, UInt32 deadline);
     virtual IOReturn BootDevice(UInt32 bootAddress);
 
+    /*! @function GetWaitDeadline
+     *   @abstract Returns the deadline to use for a wait, learned from the latencies observed so far.
+     *   @discussion Once kIntelAdaptiveWaitMinSamples waits ended by their signal, the deadline is kIntelAdaptiveWaitMultiplier times the longest of them. It is kept kIntelAdaptiveWaitMargin milliseconds above both a per-wait floor and that longest wait, and never exceeds the static deadline. A timeout discards what was learned. The reset to the bootloader has its static delay as floor, since later controllers hold the USB reset for the whole of it. The reset to the bootloader re-enumerates the device, so the statistics are class-static and shared by every controller instance under a lock.
+     *   @param wait The wait.
+     *   @param deadline The static deadline in milliseconds.
+     */
+
+    virtual UInt32 GetWaitDeadline(BluetoothIntelWait wait, UInt32 deadline);
+    virtual UInt64 RecordWait(BluetoothIntelWait wait, UInt32 deadline, UInt64 elapsed, IOReturn result, bool fixedDelay);
+
+    /*! @function WaitForSignal
+     *   @abstract Sleeps on the command gate until pending is cleared, the transport terminates or the learned deadline expires.
+     *   @param wait The wait, used to learn its deadline and to account the time saved.
+     *   @param pending The flag cleared by whoever signals the end of the wait.
+     *   @param deadline The static deadline in milliseconds.
+     *   @param fixedDelay Whether the wait replaces a delay that always ran to the end.
+     *   @result kIOReturnSuccess once signaled, kIOReturnTimeout, kIOReturnNoDevice if the transport terminated first, or THREAD_INTERRUPTED.
+     */
+
+    virtual IOReturn WaitForSignal(BluetoothIntelWait wait, bool * pending, UInt32 deadline, bool fixedDelay);
+    virtual void TransportWillTerminate();
+    static IOReturn TransportWillTerminateAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    virtual void TransportWillTerminateWL();
+    virtual void PublishWaitStatistics();
+    static void NoteHardReset();
+
+    /*! @function SendTeardownCommand
+     *   @abstract Sends a command without parameters from a transport that is stopping, bounded by the time left of its teardown.
+     *   @param opCode The command, HCI Reset or Intel SW RF Kill.
+     *   @param timeout The request timeout in milliseconds.
+     *   @result kIOReturnSuccess, or the error of the request.
+     */
+
+    virtual IOReturn SendTeardownCommand(BluetoothHCICommandOpCode opCode, UInt32 timeout);
+    static void RecordTeardown(UInt64 elapsed, bool expired, UInt32 skippedCommands);
+    virtual void PublishTeardownStatistics();
+
+    /*! @function AcquireRequest
+     *   @abstract Leases an HCI request, from the pool of the controller if one is free.
+     *   @discussion Pooled requests were created with the default flags and timeout, and are prepared again by PrepareRequestForNewCommand like any other. Use IntelBluetoothHCIRequestLease rather than calling this directly, it always returns the request.
+     *   @param outID The leased request.
+     *   @result kIOReturnSuccess, or the error of HCIRequestCreate.
+     */
+
+    virtual IOReturn AcquireRequest(BluetoothHCIRequestID * outID);
+
+    /*! @function ReleaseRequest
+     *   @abstract Returns a leased HCI request, keeping it in the pool unless the pool is full or draining, or the last command of the request failed.
+     *   @param inID The leased request.
+     */
+
+    virtual void ReleaseRequest(BluetoothHCIRequestID inID);
+    virtual void DrainRequestPool();
+    virtual void PublishRequestPoolStatistics();
+
+    /*! @function WarmResumeController
+     *   @abstract Restores a controller that kept its operational firmware across a wake or a soft reset.
+     *   @discussion The fingerprint recorded after the last full setup is compared against a fresh TLV version read. On a match only the volatile settings are applied again: the DDC configuration (through the DDC cache), the Intel event mask and the quality report.
+     *   @result kIOReturnSuccess, or an error after which SetupController runs the full setup.
+     */
+
+    virtual IOReturn WarmResumeController();
+    virtual IOReturn ReadControllerFingerprint(BluetoothIntelControllerFingerprint * fingerprint, bool cached);
+    virtual void RecordControllerFingerprint();
+    virtual void PublishWarmResumeStatistics();
+    static IOReturn ReapplyDDCConfigStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+
+    /*! @function DeferFirmwareUpgrade
+     *   @abstract Decides whether a controller running outdated operational firmware comes up on it instead of being reflashed right away.
+     *   @discussion Only when the transport personality sets DeferFirmwareUpgrade to true. The upgrade is then left pending, published in the PendingFirmwareUpgrade property, and carried out by resetting the controller to the bootloader in the first idle window without any connection, looked for every kIntelFirmwareUpgradeIdleInterval milliseconds.
+     *   @param number The firmware build number the controller runs.
+     *   @param week The firmware build week the controller runs.
+     *   @param year The firmware build year the controller runs.
+     *   @result true if the upgrade was deferred, false if the firmware has to be downloaded now.
+     */
+
+    virtual bool DeferFirmwareUpgrade(UInt8 number, UInt8 week, UInt8 year);
+    static void FirmwareUpgradeThreadCall(thread_call_param_t owner, thread_call_param_t arg);
+    static IOReturn FirmwareUpgradeAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    virtual void RunDeferredFirmwareUpgradeWL();
+    virtual void PublishFirmwareUpgrade();
+
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_14
     virtual IOReturn GetOpCodeAndEventCode(UInt8 * inDataPtr, UInt32 inDataSize, BluetoothHCICommandOpCode * outOpCode, UInt8 * numOpCodes, BluetoothHCIEventCode * eventCode, BluetoothHCIEventStatus * outStatus, BluetoothDeviceAddress * outDeviceAddress, BluetoothConnectionHandle * outConnectionHandle, bool * complete) APPLE_KEXT_OVERRIDE;
 #endif
@@ -103,6 +379,33 @@ public:
     virtual bool SetHCIRequestRequireEvents(BluetoothHCICommandOpCode opCode, IOBluetoothHCIRequest * request) APPLE_KEXT_OVERRIDE;
 
     virtual IOReturn LoadDDCConfig(OSData * fwData);
+    virtual IOReturn CallBluetoothHCIIntelWriteDDC(UInt8 * data, UInt8 dataSize);
+    virtual IOReturn CallBluetoothHCIIntelReadConfigDDC(UInt16 ddcID);
+
+    /*! @function SyncDDCConfig
+     *   @abstract Applies a list of DDC structures, skipping the ones the controller already holds.
+     *   @discussion Every record is compared against the value the controller holds, and only the ones that differ are written, in as few Write Config DDC commands as possible. If the controller rejects several DDC structures in one command, they are written again one at a time, and batching stays off for the controller once that works. That value comes from the DDC cache, from the firmware defaults recorded for this firmware build while the controller still holds them, or else from a Read Config DDC. A record that cannot be read back is simply written.
+     *   @param data The DDC structures, each made of Length (1 byte), DDC ID (2 bytes) and value (Length - 2).
+     *   @param dataSize The size of data in bytes.
+     *   @param path The caller, used to account the command counts published in the DDCStatistics property.
+     */
+
+    virtual IOReturn SyncDDCConfig(const UInt8 * data, UInt32 dataSize, BluetoothIntelDDCSyncPath path);
+
+    /*! @function InvalidateDDCCache
+     *   @abstract Forgets the DDC values the controller was known to hold.
+     *   @param booted Whether the controller has just booted its firmware without persistent DDC values, so that it holds the firmware defaults.
+     */
+
+    virtual void InvalidateDDCCache(bool booted);
+
+    /*! @function InvalidateControllerIdentity
+     *   @abstract Starts a new identity epoch, discarding the cached version information and boot parameters.
+     *   @discussion Only events that can change what the controller reports should call this: an Intel reset, a bootup event, a manufacturer mode exit with reset and a radio power off. None of the links survive these, so the connection count is cleared as well.
+     *   @param reason The event, for logging.
+     */
+
+    virtual void InvalidateControllerIdentity(const char * reason);
 
     virtual IOReturn BluetoothHCIIntelSecureSend(BluetoothHCIIntelSecureSendFragmentType fragmentType, UInt32 paramSize, const UInt8 * param);
     
@@ -126,6 +429,7 @@ public:
     virtual IOReturn BluetoothHCIIntelReadDebugFeatures(BluetoothHCIRequestID inID, BluetoothIntelDebugFeatures * features);
     virtual IOReturn BluetoothHCIIntelTurnOffDeviceLED(BluetoothHCIRequestID inID);
     virtual IOReturn BluetoothHCIIntelWriteDDC(BluetoothHCIRequestID inID, UInt8 * data, UInt8 dataSize);
+    virtual IOReturn BluetoothHCIIntelReadConfigDDC(BluetoothHCIRequestID inID, UInt16 ddcID, UInt8 * record, UInt8 recordSize);
     virtual IOReturn BluetoothHCIIntelReadOffloadUseCases(BluetoothHCIRequestID inID, BluetoothIntelOffloadUseCases * cases);
     virtual IOReturn BluetoothHCIIntelSetLinkStatisticsEventsTracing(BluetoothHCIRequestID inID, UInt8 param);
     virtual IOReturn BluetoothHCIIntelReadExceptionInfo(BluetoothHCIRequestID inID, BluetoothIntelExceptionInfo * info);
@@ -137,6 +441,70 @@ protected:
     virtual IOReturn SecureSendSFIRSAFirmwareHeader(OSData * fwData);
     virtual IOReturn SecureSendSFIECDSAFirmwareHeader(OSData * fwData);
     virtual bool CheckFirmwareVersion(UInt8 number, UInt8 week, UInt8 year, OSData * fwData, UInt32 * bootAddress);
+    virtual IOReturn ValidateDDCConfig(const UInt8 * data, UInt32 dataSize, UInt32 * numRecords);
+    virtual BluetoothIntelDDCCacheEntry * LookupDDCCacheEntry(UInt16 ddcID);
+    virtual void UpdateDDCCache(const UInt8 * record);
+    virtual bool LookupDDCDefault(const BluetoothIntelControllerFingerprint * fingerprint, UInt16 ddcID, BluetoothIntelDDCCacheEntry * outEntry);
+    virtual void StoreDDCDefault(const BluetoothIntelControllerFingerprint * fingerprint, const BluetoothIntelDDCCacheEntry * entry);
+    virtual void PublishDDCStatistics();
+    virtual bool IsControllerIdentityCached(BluetoothIntelIdentityCacheSlot slot);
+    virtual void PublishIdentityCacheStatistics();
+
+    /*! @function RecordBootupEvent
+     *   @abstract Captures the reset type, reset reason and DDC status reported by the Intel bootup event.
+     *   @discussion The event is appended to the reset history published in the ResetHistory property, and repeated watchdog or exception resets are logged.
+     */
+
+    virtual void RecordBootupEvent(const BluetoothIntelBootupEventParams * params);
+    virtual bool IsDDCPersistent();
+    virtual void PublishResetHistory();
+
+    /*! @function RecordSetupPhase
+     *   @abstract Adds the time spent in a setup phase to the boot profile of the setup in progress.
+     *   @discussion Nothing is recorded outside of SetupController. Phases may nest, e.g. WaitForDeviceBoot is part of BootDevice.
+     *   @param phase The setup phase that just completed.
+     *   @param startTime The time at which the phase started, as returned by GetCurrentTime().
+     */
+
+    virtual void RecordSetupPhase(BluetoothIntelSetupPhase phase, AbsoluteTime startTime);
+    virtual void BeginBootProfile();
+    virtual void EndBootProfile(IOReturn result);
+    virtual void PublishBootProfiles();
+
+    virtual IOReturn LoadControllerFirmware();
+    virtual IOReturn ConfigurePostBoot();
+
+    /*! @function ReplayPostBootConfig
+     *   @abstract Replays the configuration commands recorded by the last full post-boot configuration of the same firmware build.
+     *   @discussion The controller is fingerprinted first, and nothing is sent unless a recording matches. The matching recording is copied out of the shared store under its lock, since every controller instance records into it. The debug feature and DDC read-back reads, as well as the DDC file lookup, are skipped; the offload configuration is run again after the recorded commands, as it does not send any. A failed command abandons the replay.
+     *   @result kIOReturnSuccess, or an error after which the full post-boot configuration runs.
+     */
+
+    virtual IOReturn ReplayPostBootConfig();
+    virtual void RecordConfigCommand(BluetoothHCICommandOpCode opCode, const UInt8 * params, UInt8 paramSize);
+    virtual void StoreConfigRecording();
+    virtual void PublishRecoveryStatistics();
+    virtual void PublishRadioToggleStatistics();
+    virtual void PublishSetupStateStatistics();
+
+    /*! @function RunSetupSteps
+     *   @abstract Runs a dependency graph of setup steps and returns once all of them completed.
+     *   @discussion Unless mConcurrentSetupSteps is false, independent steps are issued back to back from separate threads, at most as many at a time as the controller has command credits. Each step enters the command gate, so they only overlap while waiting for their HCI commands to complete. Intel controllers usually report a single credit, in which case nothing can overlap and the steps simply run in list order on the caller. The steps are copied into mSetupSteps, which outlives any step still running when the transport terminates.
+     *   @param steps The steps, in an order that satisfies their dependencies.
+     *   @param numSteps The number of steps, at most kIntelMaxSetupSteps.
+     *   @result The error of the first required step that failed, kIOReturnNoDevice or kIOReturnAborted if the wait was cut short, kIOReturnBusy while steps of an earlier run are still running, or kIOReturnSuccess.
+     */
+
+    virtual IOReturn RunSetupSteps(BluetoothIntelSetupStep * steps, UInt32 numSteps);
+    virtual void RunSetupStepWL(BluetoothIntelSetupStep * step);
+    virtual bool ReapSetupStepThreadCalls(bool all);
+    static void SetupStepThreadCall(thread_call_param_t owner, thread_call_param_t step);
+    static IOReturn RunSetupStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    static IOReturn LoadDDCConfigStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    static IOReturn ConfigureOffloadStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    static IOReturn QualityReportStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    static IOReturn EventMaskStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+    static IOReturn ReadVersionInfoStepAction(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
     
     OSMetaClassDeclareReservedUnused(IntelBluetoothHostController, 0);
     OSMetaClassDeclareReservedUnused(IntelBluetoothHostController, 1);
@@ -182,6 +550,115 @@ protected:
     bool mFirmwareLoadingFailed;
     bool mQualityReportSet;
 
+    bool mDDCSyncMode;
+    bool mDDCBatchWrites;
+    BluetoothIntelDDCCacheEntry mDDCCache[kIntelDDCCacheSize];
+    BluetoothIntelDDCSyncStatistics mDDCStatistics[kBluetoothIntelDDCSyncPathCount];
+    bool mDDCBootDefaults;
+    static BluetoothIntelDDCDefaults sDDCDefaults;
+
+    BluetoothIntelBootupEventParams mBootupEvent;
+    bool mBootupEventValid;
+    BluetoothIntelResetHistoryEntry mResetHistory[kIntelResetHistorySize];
+    UInt32 mResetHistoryCount;
+    UInt32 mWatchdogResetCount;
+    UInt32 mExceptionResetCount;
+
+    BluetoothIntelBootProfile mBootProfiles[kIntelBootProfileHistorySize];
+    BluetoothIntelBootProfile * mCurrentBootProfile;
+    AbsoluteTime mBootProfileStartTime;
+    UInt32 mBootProfileCount;
+
+    bool mConcurrentSetupSteps;
+    bool mSetupEventMaskSet;
+    UInt32 mSetupStepsRunning;
+    BluetoothIntelSetupStep mSetupSteps[kIntelMaxSetupSteps];
+
+    UInt32 mIdentityEpoch;
+    BluetoothIntelIdentityCacheEntry mIdentityCache[kBluetoothIntelIdentityCacheSlotCount];
+    BluetoothIntelVersionInfo mCachedVersionInfo;
+    UInt8 * mCachedVersionInfoTLV;
+    BluetoothIntelBootParams mCachedBootParams;
+    UInt32 mIdentityCacheHits;
+    UInt32 mIdentityCacheMisses;
+    UInt32 mIdentityCacheInvalidations;
+
+    bool mBootloaderResetPending;
+    bool mTransportTerminating;
+    static BluetoothIntelWaitStatistics sWaitStatistics[kBluetoothIntelWaitCount];
+
+    BluetoothIntelControllerFingerprint mFingerprint;
+    bool mFingerprintValid;
+    OSData * mDDCConfigData;
+    BluetoothIntelWarmResumeStatistics mWarmResumeStatistics;
+
+    BluetoothIntelSetupState mSetupState;
+    IOReturn mSetupResult;
+    bool mSetupHardReset;
+    bool mPostBootConfigPending;
+    UInt8 mSetupStateRetries[kBluetoothIntelSetupStateCount];
+    UInt64 mSetupStateTime[kBluetoothIntelSetupStateCount];
+    BluetoothIntelSetupStateStatistics mSetupStateStatistics[kBluetoothIntelSetupStateCount];
+    BluetoothIntelBootParams mBootParams;
+    BluetoothIntelVersionInfo mBootloaderVersionInfo;
+    BluetoothIntelVersionInfoTLV mBootloaderVersionInfoTLV;
+    static const BluetoothIntelSetupStatePolicy sSetupStatePolicies[kBluetoothIntelSetupStateCount];
+
+    BluetoothIntelConfigRecording * mConfigRecording;
+    bool mConfigRecordingActive;
+    bool mConfigReplayed;
+    static BluetoothIntelConfigRecording sConfigRecordings[kIntelConfigRecordingSlots];
+    static UInt32 sConfigRecordingCount;
+    static AbsoluteTime sHardResetTime;
+    static BluetoothIntelRecoveryStatistics sRecoveryStatistics;
+
+    bool mDeferFirmwareUpgrade;
+    BluetoothIntelFirmwareUpgrade mFirmwareUpgrade;
+    AbsoluteTime mFirmwareUpgradeDeferTime;
+    thread_call_t mFirmwareUpgradeThreadCall;
+    UInt32 mActiveConnections;
+
+    const BluetoothIntelHardwareVariantInfo * mHardwareVariantInfo;
+
+    UInt32 mManufacturerModeDepth;
+    BluetoothIntelManufacturingExitResetOption mManufacturerModeResetOption;
+
+    bool mFastRadioToggle;
+    bool mRadioKilled;
+    AbsoluteTime mRadioOffTime;
+    static BluetoothIntelTeardownStatistics sTeardownStatistics;
+
+    IOLock * mRequestPoolLock;
+    BluetoothHCIRequestID mRequestPool[kIntelRequestPoolSize];
+    UInt32 mRequestPoolCount;
+    UInt32 mRequestLeases;
+    static BluetoothIntelRequestPoolStatistics sRequestPoolStatistics;
+
+    static BluetoothIntelCommandPackingStatistics sCommandPackingStatistics;
+
+    bool mVerboseCommandDiagnostics;
+    bool mMeasureCommandOverhead;
+    BluetoothIntelCommandOverheadStatistics mCommandOverheadStatistics;
+    BluetoothIntelCommandLatency mCommandLatency[kIntelCommandLatencySlots];
+    thread_call_t mStatisticsThreadCall;
+    volatile UInt32 mStatisticsPublishPending;
+    volatile SInt32 mInteractiveCommands;
+    IOLock * mCommandLaneLock;
+    BluetoothIntelCommandLaneStatistics mCommandLaneStatistics[kBluetoothIntelCommandLaneCount];
+    BluetoothIntelAsyncLaneEntry mAsyncLanes[kIntelAsyncLaneSlots];
+    IOLock * mProcessAccountingLock;
+    BluetoothIntelProcessAccounting mProcessAccounting[kIntelProcessAccountingSlots];
+    UInt64 mProcessAccountingDecayTime;
+
+    bool mSuppressRepeatCommands;
+    IOLock * mCommandCacheLock;
+    BluetoothIntelCommandCacheEntry mCommandCache[kBluetoothIntelCommandCacheSlotCount];
+    BluetoothIntelCommandCacheStatistics mCommandCacheStatistics;
+    static BluetoothIntelResponseDecodingStatistics sResponseDecodingStatistics;
+    BluetoothIntelRecordedResponse * mRecordedResponses;
+    UInt32 mRecordedResponseCount;
+    BluetoothIntelRadioToggleStatistics mRadioToggleStatistics;
+
     struct ExpansionData
     {
         void * mRefCon;
@@ -189,4 +666,81 @@ protected:
     ExpansionData * mExpansionData;
 };
 
+/*! @class IntelBluetoothManufacturerModeSession
+ *   @abstract Scoped manufacturer mode session of an IntelBluetoothHostController.
+ *   @discussion Begin opens the session, and it is closed by End or, at the latest, when the object goes out of scope, so the mode is left on every error path.
+ */
+
+class IntelBluetoothManufacturerModeSession
+{
+public:
+    IntelBluetoothManufacturerModeSession(IntelBluetoothHostController * controller) : mController(controller), mOpen(false), mResetOption(kBluetoothIntelManufacturingExitResetOptionsNoReset) {}
+    ~IntelBluetoothManufacturerModeSession() { End(); }
+
+    IOReturn Begin()
+    {
+        IOReturn err;
+
+        if ( mOpen )
+            return kIOReturnSuccess;
+        err = mController->BeginManufacturerMode();
+        mOpen = !err;
+        return err;
+    }
+
+    IOReturn End()
+    {
+        if ( !mOpen )
+            return kIOReturnSuccess;
+        mOpen = false;
+        return mController->EndManufacturerMode(mResetOption);
+    }
+
+    void SetResetOption(BluetoothIntelManufacturingExitResetOption resetOption) { mResetOption = resetOption; }
+
+private:
+    IntelBluetoothHostController * mController;
+    bool mOpen;
+    BluetoothIntelManufacturingExitResetOption mResetOption;
+};
+
+/*! @class IntelBluetoothHCIRequestLease
+ *   @abstract Scoped HCI request of an IntelBluetoothHostController.
+ *   @discussion Acquire leases a request, returning the one held before, and it is returned by Release or, at the latest, when the object goes out of scope, so no error path leaks it.
+ */
+
+class IntelBluetoothHCIRequestLease
+{
+public:
+    IntelBluetoothHCIRequestLease(IntelBluetoothHostController * controller) : mController(controller), mID(0), mHeld(false) {}
+    ~IntelBluetoothHCIRequestLease() { Release(); }
+
+    IOReturn Acquire(BluetoothHCIRequestID * outID)
+    {
+        IOReturn err;
+
+        Release();
+        err = mController->AcquireRequest(&mID);
+        mHeld = !err;
+        if ( !err && outID )
+            *outID = mID;
+        return err;
+    }
+
+    void Release()
+    {
+        if ( !mHeld )
+            return;
+        mHeld = false;
+        mController->ReleaseRequest(mID);
+    }
+
+    BluetoothHCIRequestID ID() const { return mID; }
+
+private:
+    IntelBluetoothHostController * mController;
+    BluetoothHCIRequestID mID;
+    bool mHeld;
+};
+
 #endif
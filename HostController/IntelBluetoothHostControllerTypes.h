@@ -23,6 +23,60 @@
 #pragma once
 
 #include <IOKit/bluetooth/Bluetooth.h>
+#include <libkern/OSByteOrder.h>
+#include <sys/param.h>
+
+#define kIntelDDCMaxParamLength    255
+#define kIntelDDCMaxValueLength    32
+#define kIntelDDCCacheSize         32
+
+#define kIntelResetHistorySize            16
+#define kIntelRepeatedResetThreshold      3
+#define kIntelRepeatedResetWindowSeconds  600
+
+#define kIntelBootProfileHistorySize      8
+
+#define kIntelMaxSetupSteps               32
+#define kIntelMaxConcurrentSetupSteps     4
+#define kIntelSetupStepWaitTimeout        1000  // milliseconds
+
+#define kIntelAdaptiveWaitMinSamples      4
+#define kIntelAdaptiveWaitMultiplier      4
+#define kIntelAdaptiveWaitMargin          50    // milliseconds a learned deadline keeps above the floor of its wait and the longest wait observed
+#define kIntelResetToBootloaderDelay      150   // milliseconds
+#define kIntelFirmwareDownloadTimeout     5000  // milliseconds
+#define kIntelDeviceBootTimeout           1000  // milliseconds
+#define kIntelConfigurePMTimeout          30000 // milliseconds
+
+#define kIntelConfigRecordingSize         2048
+#define kIntelConfigRecordingSlots        2
+
+#define kIntelFirmwareUpgradeIdleInterval 60000 // milliseconds
+
+#define kIntelTeardownTimeout             1000  // milliseconds
+
+#define kIntelRequestPoolSize             4
+#define kIntelRequestPoolTimeout          5000  // milliseconds, the HCIRequestCreate default
+
+#define kIntelCommandMaxParamLength       255
+#define kIntelSecureSendMaxFragmentLength 252
+#define kIntelCommandPackingSamples       1000
+#define kIntelResponseDecodingSamples     1000
+#define kIntelRecordedResponseSlots       8     // vendor command responses kept for MeasureResponseDecoding, one per OCF
+#define kIntelCommandOverheadSamples      256   // commands between two publications
+#define kIntelLatencyHistogramBuckets     24    // bucket n > 0 counts [2^(n - 1), 2^n) microseconds, the last one is open ended from about 4 seconds
+#define kIntelCommandLatencySamples       64    // commands between two publications
+#define kIntelStatisticsPublishInterval   5000  // milliseconds between two publications of the latency, lane and process statistics
+#define kIntelBackgroundLaneMaxWait       100   // milliseconds a background command yields at most
+#define kIntelAsyncLaneSlots              8     // asynchronous commands whose lane is held until their completion event
+#define kIntelAsyncLaneTimeout            2000  // milliseconds after which a lane held for a lost completion is given up
+#define kIntelProcessAccountingSlots      16
+#define kIntelProcessAccountingHalfLife   60000 // milliseconds after which the counters of every process are halved
+#define kIntelCommandCacheMaxParamLength  32
+
+#define kIntelOpCodeIndexSize             0x100
+#define kIntelOpCodeNone                  0xFF
+#define kIntelMaxTeardownCommands         2
 
 enum BluetoothHCIIntelResetTypes
 {
@@ -87,6 +141,67 @@ enum BluetoothHCIIntelDDCStatus
     kBluetoothHCIIntelDDCStatusReserved
 };
 
+typedef enum BluetoothIntelDDCSyncPath
+{
+    kBluetoothIntelDDCSyncPathLoadConfig         = 0x00,
+    kBluetoothIntelDDCSyncPathSetDebugFeatures   = 0x01,
+    kBluetoothIntelDDCSyncPathResetDebugFeatures = 0x02,
+    kBluetoothIntelDDCSyncPathCount
+} BluetoothIntelDDCSyncPath;
+
+typedef enum BluetoothIntelSetupPhase
+{
+    kBluetoothIntelSetupPhaseHCIReset = 0x00,
+    kBluetoothIntelSetupPhaseReadVersionInfo,
+    kBluetoothIntelSetupPhaseReadBootParams,
+    kBluetoothIntelSetupPhaseFirmwareLookup,
+    kBluetoothIntelSetupPhaseResetToBootloader,
+    kBluetoothIntelSetupPhaseFirmwareDownload,
+    kBluetoothIntelSetupPhaseWaitForFirmwareDownload,
+    kBluetoothIntelSetupPhaseBootDevice,
+    kBluetoothIntelSetupPhaseWaitForDeviceBoot,
+    kBluetoothIntelSetupPhaseLoadDDCConfig,
+    kBluetoothIntelSetupPhaseConfigureOffload,
+    kBluetoothIntelSetupPhaseQualityReport,
+    kBluetoothIntelSetupPhaseEventMask,
+    kBluetoothIntelSetupPhaseGeneralSetup,
+    kBluetoothIntelSetupPhaseFingerprint,
+    kBluetoothIntelSetupPhaseCount
+} BluetoothIntelSetupPhase;
+
+typedef enum BluetoothIntelSetupState
+{
+    kBluetoothIntelSetupStateIdle = 0x00,
+    kBluetoothIntelSetupStateHCIReset,
+    kBluetoothIntelSetupStateWarmResume,
+    kBluetoothIntelSetupStateReadVersionInfo,
+    kBluetoothIntelSetupStateLoadFirmware,
+    kBluetoothIntelSetupStatePostBootConfig,
+    kBluetoothIntelSetupStateFingerprint,
+    kBluetoothIntelSetupStateEventMask,
+    kBluetoothIntelSetupStateGeneralSetup,
+    kBluetoothIntelSetupStateHardReset,
+    kBluetoothIntelSetupStateDone,
+    kBluetoothIntelSetupStateFailed,
+    kBluetoothIntelSetupStateCount
+} BluetoothIntelSetupState;
+
+typedef enum
+{
+    kBluetoothIntelIdentityCacheSlotVersionInfo,
+    kBluetoothIntelIdentityCacheSlotVersionInfoTLV,
+    kBluetoothIntelIdentityCacheSlotBootParams,
+    kBluetoothIntelIdentityCacheSlotCount
+} BluetoothIntelIdentityCacheSlot;
+
+typedef enum
+{
+    kBluetoothIntelWaitResetToBootloader,
+    kBluetoothIntelWaitFirmwareDownload,
+    kBluetoothIntelWaitDeviceBoot,
+    kBluetoothIntelWaitCount
+} BluetoothIntelWait;
+
 enum BluetoothHCIIntelExceptionTypes
 {
     kBluetoothHCIIntelExceptionTypeNoException          = 0x00,
@@ -123,6 +238,88 @@ typedef enum BluetoothIntelHardwareVariant
     kBluetoothIntelHardwareVariantSlrF   = 0x19
 } BluetoothIntelHardwareVariant;
 
+enum BluetoothIntelFirmwareNaming
+{
+    kBluetoothIntelFirmwareNamingLegacy,                // ibt-hw-<hw_platform>.<hw_variant>[-fw-...].bseq
+    kBluetoothIntelFirmwareNamingDeviceRevision,        // ibt-<hw_variant>-<dev_revid>.sfi
+    kBluetoothIntelFirmwareNamingHardwareRevision,      // ibt-<hw_variant>-<hw_revision>-<fw_revision>.sfi
+    kBluetoothIntelFirmwareNamingCNVX                   // ibt-<cnvi_top>-<cnvr_top>.sfi
+};
+
+enum BluetoothIntelHardwareCapabilities
+{
+    kBluetoothIntelCapabilityWidebandSpeech          = 1 << 0,
+    kBluetoothIntelCapabilityWidebandSpeechROM2_X    = 1 << 1,  // only with the legacy ROM 2.x firmware variant
+    kBluetoothIntelCapabilityValidLEStates           = 1 << 2,
+    kBluetoothIntelCapabilityVersionCheck            = 1 << 3   // the firmware file carries its version
+};
+
+enum BluetoothIntelSecureBootEngines
+{
+    kBluetoothIntelSecureBootEngineRSA   = 1 << 0,
+    kBluetoothIntelSecureBootEngineECDSA = 1 << 1
+};
+
+struct BluetoothIntelHardwareVariantInfo
+{
+    UInt8  variant;
+    const char * name;
+    UInt8  generation;
+    UInt8  naming;                  // BluetoothIntelFirmwareNaming
+    UInt16 msftOpCode;              // 0 without the Microsoft vendor extension
+    UInt8  capabilities;            // BluetoothIntelHardwareCapabilities
+    UInt8  secureBootEngines;       // BluetoothIntelSecureBootEngines
+    UInt32 firmwareDownloadTimeout; // milliseconds
+    UInt32 deviceBootTimeout;       // milliseconds
+};
+
+/* Everything that depends on the hardware variant. Supporting a new
+ * variant means adding its row here.
+ */
+inline constexpr BluetoothIntelHardwareVariantInfo kBluetoothIntelHardwareVariantTable[] =
+{
+    /* variant, name, generation, firmware naming, MSFT opcode, capabilities, secure boot engines, download timeout, boot timeout */
+    { kBluetoothIntelHardwareVariantWP,   "WP",   1, kBluetoothIntelFirmwareNamingLegacy,           0x0000, 0,                                                                                                                        0,                                                                         0,                             0                       },
+    { kBluetoothIntelHardwareVariantStP,  "StP",  1, kBluetoothIntelFirmwareNamingLegacy,           0x0000, kBluetoothIntelCapabilityWidebandSpeechROM2_X,                                                                            0,                                                                         0,                             0                       },
+    { kBluetoothIntelHardwareVariantSfP,  "SfP",  2, kBluetoothIntelFirmwareNamingDeviceRevision,   0x0000, kBluetoothIntelCapabilityWidebandSpeech,                                                                                  kBluetoothIntelSecureBootEngineRSA,                                        kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantWsP,  "WsP",  2, kBluetoothIntelFirmwareNamingDeviceRevision,   0x0000, kBluetoothIntelCapabilityWidebandSpeech,                                                                                  kBluetoothIntelSecureBootEngineRSA,                                        kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantJfP,  "JfP",  2, kBluetoothIntelFirmwareNamingHardwareRevision, 0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityValidLEStates | kBluetoothIntelCapabilityVersionCheck, kBluetoothIntelSecureBootEngineRSA,                                        kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantThP,  "ThP",  2, kBluetoothIntelFirmwareNamingHardwareRevision, 0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityValidLEStates | kBluetoothIntelCapabilityVersionCheck, kBluetoothIntelSecureBootEngineRSA,                                        kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantHrP,  "HrP",  2, kBluetoothIntelFirmwareNamingHardwareRevision, 0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityVersionCheck,                                          kBluetoothIntelSecureBootEngineRSA,                                        kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantCcP,  "CcP",  2, kBluetoothIntelFirmwareNamingHardwareRevision, 0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityVersionCheck,                                          kBluetoothIntelSecureBootEngineRSA,                                        kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantTyP,  "TyP",  3, kBluetoothIntelFirmwareNamingCNVX,             0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityVersionCheck,                                          kBluetoothIntelSecureBootEngineRSA | kBluetoothIntelSecureBootEngineECDSA, kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantSlr,  "Slr",  3, kBluetoothIntelFirmwareNamingCNVX,             0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityValidLEStates | kBluetoothIntelCapabilityVersionCheck, kBluetoothIntelSecureBootEngineRSA | kBluetoothIntelSecureBootEngineECDSA, kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout },
+    { kBluetoothIntelHardwareVariantSlrF, "SlrF", 3, kBluetoothIntelFirmwareNamingCNVX,             0xFC1E, kBluetoothIntelCapabilityWidebandSpeech | kBluetoothIntelCapabilityVersionCheck,                                          kBluetoothIntelSecureBootEngineRSA | kBluetoothIntelSecureBootEngineECDSA, kIntelFirmwareDownloadTimeout, kIntelDeviceBootTimeout }
+};
+
+#define kIntelHardwareVariantCount        0x40  // the hardware variant is a 6 bit field of the CNVi ID
+#define kIntelHardwareVariantNone         0xFF
+
+/* Maps a hardware variant to its row of kBluetoothIntelHardwareVariantTable,
+ * built at compile time.
+ */
+struct BluetoothIntelHardwareVariantIndex
+{
+    UInt8 rows[kIntelHardwareVariantCount];
+
+    constexpr BluetoothIntelHardwareVariantIndex() : rows()
+    {
+        for ( int i = 0; i < kIntelHardwareVariantCount; ++i )
+            rows[i] = kIntelHardwareVariantNone;
+        for ( UInt8 i = 0; i < sizeof(kBluetoothIntelHardwareVariantTable) / sizeof(kBluetoothIntelHardwareVariantTable[0]); ++i )
+            rows[kBluetoothIntelHardwareVariantTable[i].variant] = i;
+    }
+};
+
+inline constexpr BluetoothIntelHardwareVariantIndex kBluetoothIntelHardwareVariantIndex;
+
+static inline const BluetoothIntelHardwareVariantInfo * IntelLookupHardwareVariant(UInt8 variant)
+{
+    if ( variant >= kIntelHardwareVariantCount || kBluetoothIntelHardwareVariantIndex.rows[variant] == kIntelHardwareVariantNone )
+        return NULL;
+    return &kBluetoothIntelHardwareVariantTable[kBluetoothIntelHardwareVariantIndex.rows[variant]];
+}
+
 /*! @enum        IntelExitManufacturerModeResetOptions
      @abstract    Options for the second command parameter in the manufacturing exit HCI command
      @discussion  In Intel's vendor specific manufacturing exit HCI command, the second parameter denotes what shall be done besides the regular disabling, such as a reset.
@@ -340,6 +537,159 @@ struct BluetoothIntelCommandWriteBootParams
     UInt8  firmwareBuildYear;
 } __attribute__((packed));
 
+struct BluetoothIntelCommandReset
+{
+    UInt8  resetType;
+    UInt8  enablePatch;
+    UInt8  reloadDDC;
+    UInt8  bootOption;
+    UInt32 bootAddress;     // little endian
+} __attribute__((packed));
+
+struct BluetoothIntelCommandManufacturerMode
+{
+    UInt8  enable;
+    UInt8  resetOption;
+} __attribute__((packed));
+
+struct BluetoothIntelCommandSetEventMask
+{
+    UInt8  mask[8];
+} __attribute__((packed));
+
+/* The mask of the Intel vendor events, with or without the debugging
+ * related ones.
+ */
+constexpr BluetoothIntelCommandSetEventMask IntelVendorEventMask(bool debug)
+{
+    return BluetoothIntelCommandSetEventMask { { 0x87, (UInt8) (debug ? 0x6E : 0x0C), 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+}
+
+struct BluetoothIntelCommandSetDiagnosticMode
+{
+    UInt8  mode[3];
+} __attribute__((packed));
+
+struct BluetoothIntelCommandWriteDeviceAddress
+{
+    BluetoothDeviceAddress address;
+} __attribute__((packed));
+
+struct BluetoothIntelCommandReadConfigDDC
+{
+    UInt16 ddcID;           // little endian
+} __attribute__((packed));
+
+struct BluetoothIntelCommandByte
+{
+    UInt8  value;
+} __attribute__((packed));
+
+static_assert(sizeof(BluetoothIntelCommandReset) == 8, "Intel Reset takes 8 bytes of parameters");
+static_assert(sizeof(BluetoothIntelCommandManufacturerMode) == 2, "Intel Manufacturer Mode takes 2 bytes of parameters");
+static_assert(sizeof(BluetoothIntelCommandSetEventMask) == 8, "Intel Set Event Mask takes 8 bytes of parameters");
+static_assert(sizeof(BluetoothIntelCommandSetDiagnosticMode) == 3, "Intel Set Diagnostic Mode takes 3 bytes of parameters");
+static_assert(sizeof(BluetoothIntelCommandWriteDeviceAddress) == 6, "Intel Write Device Address takes 6 bytes of parameters");
+static_assert(sizeof(BluetoothIntelCommandReadConfigDDC) == 2, "Intel Read Config DDC takes 2 bytes of parameters");
+
+/* The wire image of an Intel vendor command: the opcode and parameter
+ * length header followed by the typed parameters, laid out by the
+ * compiler instead of interpreting a PackDataList format string.
+ */
+template <BluetoothHCICommandOpCode kOpCode, typename Params = void>
+struct BluetoothIntelCommandPacket
+{
+    static_assert(sizeof(Params) <= kIntelCommandMaxParamLength, "HCI command parameters do not fit the length byte");
+
+    UInt16 opCode;
+    UInt8  paramSize;
+    Params params;
+
+    constexpr BluetoothIntelCommandPacket(const Params & inParams) : opCode(OSSwapHostToLittleConstInt16(kOpCode)), paramSize(sizeof(Params)), params(inParams) {}
+    static constexpr BluetoothHCICommandOpCode OpCode() { return kOpCode; }
+    constexpr IOByteCount Size() const { return 3 + sizeof(Params); }
+} __attribute__((packed));
+
+template <BluetoothHCICommandOpCode kOpCode>
+struct BluetoothIntelCommandPacket<kOpCode, void>
+{
+    UInt16 opCode;
+    UInt8  paramSize;
+
+    constexpr BluetoothIntelCommandPacket() : opCode(OSSwapHostToLittleConstInt16(kOpCode)), paramSize(0) {}
+    static constexpr BluetoothHCICommandOpCode OpCode() { return kOpCode; }
+    constexpr IOByteCount Size() const { return 3; }
+} __attribute__((packed));
+
+/* Commands carrying a byte string only know its length at runtime, but
+ * never more than kMaxParamSize bytes of it.
+ */
+template <BluetoothHCICommandOpCode kOpCode, IOByteCount kMaxParamSize>
+struct BluetoothIntelVariableCommandPacket
+{
+    static_assert(kMaxParamSize <= kIntelCommandMaxParamLength, "HCI command parameters do not fit the length byte");
+
+    UInt16 opCode;
+    UInt8  paramSize;
+    UInt8  params[kMaxParamSize];
+
+    BluetoothIntelVariableCommandPacket() : opCode(OSSwapHostToLittleConstInt16(kOpCode)), paramSize(0) {}
+    static constexpr BluetoothHCICommandOpCode OpCode() { return kOpCode; }
+    IOByteCount Size() const { return 3 + paramSize; }
+
+    bool Append(const void * data, IOByteCount size)
+    {
+        if ( size > kMaxParamSize - paramSize )
+            return false;
+        memcpy(params + paramSize, data, size);
+        paramSize += size;
+        return true;
+    }
+} __attribute__((packed));
+
+typedef BluetoothIntelCommandPacket<0xFC01, BluetoothIntelCommandReset>                    BluetoothIntelResetPacket;
+typedef BluetoothIntelCommandPacket<0xFC05>                                                BluetoothIntelReadVersionInfoPacket;
+typedef BluetoothIntelCommandPacket<0xFC05, BluetoothIntelCommandByte>                     BluetoothIntelReadVersionInfoTLVPacket;
+typedef BluetoothIntelVariableCommandPacket<0xFC09, kIntelSecureSendMaxFragmentLength + 1> BluetoothIntelSecureSendPacket;
+typedef BluetoothIntelCommandPacket<0xFC0D>                                                BluetoothIntelReadBootParamsPacket;
+typedef BluetoothIntelCommandPacket<0xFC11, BluetoothIntelCommandManufacturerMode>         BluetoothIntelManufacturerModePacket;
+typedef BluetoothIntelCommandPacket<0xFC22, BluetoothIntelCommandByte>                     BluetoothIntelReadExceptionInfoPacket;
+typedef BluetoothIntelCommandPacket<0xFC31, BluetoothIntelCommandWriteDeviceAddress>       BluetoothIntelWriteDeviceAddressPacket;
+typedef BluetoothIntelCommandPacket<0xFC3F>                                                BluetoothIntelSWRFKillPacket;
+typedef BluetoothIntelCommandPacket<0xFC43, BluetoothIntelCommandSetDiagnosticMode>        BluetoothIntelSetDiagnosticModePacket;
+typedef BluetoothIntelCommandPacket<0xFC52, BluetoothIntelCommandSetEventMask>             BluetoothIntelSetEventMaskPacket;
+typedef BluetoothIntelCommandPacket<0xFC86>                                                BluetoothIntelReadOffloadUseCasesPacket;
+typedef BluetoothIntelVariableCommandPacket<0xFC8B, kIntelDDCMaxParamLength>               BluetoothIntelWriteDDCPacket;
+typedef BluetoothIntelCommandPacket<0xFC8C, BluetoothIntelCommandReadConfigDDC>            BluetoothIntelReadConfigDDCPacket;
+typedef BluetoothIntelCommandPacket<0xFCA1, BluetoothIntelCommandByte>                     BluetoothIntelSetLinkStatisticsTracingPacket;
+typedef BluetoothIntelCommandPacket<0xFCA6, BluetoothIntelCommandByte>                     BluetoothIntelReadDebugFeaturesPacket;
+
+static_assert(sizeof(BluetoothIntelResetPacket) == 11, "Intel Reset packet is 11 bytes");
+static_assert(sizeof(BluetoothIntelSWRFKillPacket) == 3, "Intel SW RF Kill packet is 3 bytes");
+static_assert(sizeof(BluetoothIntelSecureSendPacket) == 3 + 1 + kIntelSecureSendMaxFragmentLength, "Intel Secure Send packet holds a fragment type and a full fragment");
+
+/* One number of a statistics dictionary, see PublishStatistics. */
+struct BluetoothIntelStatistic
+{
+    const char * key;
+    UInt64       value;
+    UInt8        bits;
+};
+
+struct BluetoothIntelCommandPackingStatistics
+{
+    UInt32 samples;
+    UInt64 formattedTime;       // nanoseconds per command, PackDataList
+    UInt64 typedTime;           // nanoseconds per command, BluetoothIntelCommandPacket
+};
+
+struct BluetoothIntelCommandOverheadStatistics
+{
+    UInt32 samples;
+    UInt64 totalTime;           // nanoseconds spent in SendHCIRequestCommon outside of the request itself
+    UInt64 maxTime;             // nanoseconds
+};
+
 struct BluetoothIntelBootupEventParams
 {
     UInt8  zero;
@@ -350,6 +700,210 @@ struct BluetoothIntelBootupEventParams
     UInt8  ddcStatus;
 } __attribute__((packed));
 
+struct BluetoothIntelDDCCacheEntry
+{
+    UInt16 id;
+    UInt8  length;
+    bool   valid;
+    UInt8  value[kIntelDDCMaxValueLength];
+};
+
+struct BluetoothIntelDDCSyncStatistics
+{
+    UInt32 records;
+    UInt32 skipped;
+    UInt32 readCommands;
+    UInt32 writeCommands;
+    UInt32 batchFallbacks;  // batched writes the controller rejected, retried one record at a time
+};
+
+/* Walks a DDC list of Length (1 byte), DDC ID (2 bytes) and value
+ * (Length - 2 bytes) records. Every record carries at least its ID,
+ * does not run past the end of the list, and fits a Write Config DDC
+ * command on its own, length byte included. On failure badOffset is
+ * the offset of the offending record.
+ */
+constexpr bool IntelValidateDDCConfig(const UInt8 * data, UInt32 dataSize, UInt32 & numRecords, UInt32 & badOffset)
+{
+    UInt32 offset = 0;
+    UInt32 count = 0;
+
+    while ( offset < dataSize )
+    {
+        if ( data[offset] < sizeof(UInt16) || data[offset] > kIntelDDCMaxParamLength - sizeof(UInt8) || offset + sizeof(UInt8) + data[offset] > dataSize )
+        {
+            badOffset = offset;
+            return false;
+        }
+
+        offset += data[offset] + sizeof(UInt8);
+        ++count;
+    }
+
+    numRecords = count;
+    return true;
+}
+
+constexpr bool IntelDDCConfigIsValid(const UInt8 * data, UInt32 dataSize)
+{
+    UInt32 numRecords = 0;
+    UInt32 badOffset = 0;
+
+    return IntelValidateDDCConfig(data, dataSize, numRecords, badOffset);
+}
+
+namespace IntelDDCConfigChecks
+{
+    constexpr UInt8 kTwoRecords[]        = { 0x03, 0x92, 0x02, 0x7f, 0x04, 0x91, 0x02, 0x05, 0x00 };
+    constexpr UInt8 kTruncatedRecord[]   = { 0x03, 0x92, 0x02, 0x7f, 0x04, 0x91, 0x02 };
+    constexpr UInt8 kMissingID[]         = { 0x01, 0x92 };
+    constexpr UInt8 kLargestRecord[255]  = { kIntelDDCMaxParamLength - sizeof(UInt8), 0x92, 0x02 };
+    constexpr UInt8 kOversizedRecord[256] = { kIntelDDCMaxParamLength, 0x92, 0x02 };
+
+    static_assert(IntelDDCConfigIsValid(kTwoRecords, sizeof(kTwoRecords)), "A well formed DDC list is accepted");
+    static_assert(!IntelDDCConfigIsValid(kTruncatedRecord, sizeof(kTruncatedRecord)), "A DDC record running past the list is rejected");
+    static_assert(!IntelDDCConfigIsValid(kMissingID, sizeof(kMissingID)), "A DDC record without its ID is rejected");
+    static_assert(IntelDDCConfigIsValid(kLargestRecord, sizeof(kLargestRecord)), "A DDC record filling a whole Write Config DDC command is accepted");
+    static_assert(!IntelDDCConfigIsValid(kOversizedRecord, sizeof(kOversizedRecord)), "A 255 byte DDC record cannot be written with its length byte and is rejected");
+}
+
+struct BluetoothIntelResetHistoryEntry
+{
+    UInt64 timestamp;   // nanoseconds since boot
+    UInt8  resetType;
+    UInt8  resetReason;
+    UInt8  ddcStatus;
+};
+
+struct BluetoothIntelBootProfile
+{
+    UInt64   startTime;                                         // nanoseconds since boot
+    UInt64   duration;                                          // nanoseconds
+    UInt64   phaseStart[kBluetoothIntelSetupPhaseCount];        // nanoseconds since startTime
+    UInt64   phaseDuration[kBluetoothIntelSetupPhaseCount];     // nanoseconds, 0 if the phase did not run
+    UInt64   waitTimeSaved;                                     // nanoseconds, see BluetoothIntelWaitStatistics
+    UInt32   generation;
+    IOReturn result;
+    bool     warmResume;
+};
+
+struct BluetoothIntelSetupStatePolicy
+{
+    const char *             name;
+    UInt8                    maxRetries;
+    UInt32                   budget;        // milliseconds, not retried once it spent that long in the state
+    BluetoothIntelSetupState retryState;    // the state to run again on a failure
+    BluetoothIntelSetupState failureState;  // the state to move to once out of retries
+};
+
+struct BluetoothIntelSetupStateStatistics
+{
+    UInt32 runs;
+    UInt32 failures;
+    UInt32 retries;
+    UInt32 overruns;    // runs that took longer than the budget of the state
+};
+
+struct BluetoothIntelControllerFingerprint
+{
+    UInt32 hardware;        // cnviBT, or the platform, variant and revision of the legacy version information
+    UInt32 firmwareBuild;   // build number, or the build number, week and year of the legacy version information
+    UInt16 timestamp;       // TLV only
+    UInt8  firmwareVariant; // image type, or the firmware variant of the legacy version information
+    UInt8  patchVersion;    // legacy only
+    bool   operational;     // operational firmware, or a patched legacy ROM
+};
+
+/* DDC values read back from a freshly booted controller, which are the
+ * defaults of its firmware build.
+ */
+struct BluetoothIntelDDCDefaults
+{
+    BluetoothIntelControllerFingerprint fingerprint;
+    bool valid;
+    BluetoothIntelDDCCacheEntry entries[kIntelDDCCacheSize];
+};
+
+struct BluetoothIntelConfigRecording
+{
+    BluetoothIntelControllerFingerprint fingerprint;
+    UInt32 length;                              // bytes used in commands
+    UInt32 numCommands;
+    bool   valid;
+    UInt8  commands[kIntelConfigRecordingSize]; // opcode (2 bytes, little endian), parameter length (1 byte), parameters
+};
+
+struct BluetoothIntelRecoveryStatistics
+{
+    UInt32 replays;             // configurations replayed from a recording
+    UInt32 fullSetups;          // configurations run in full, recording them
+    UInt32 replayFallbacks;     // replays abandoned on a mismatch or a failed command
+    UInt64 lastReplayTime;      // nanoseconds from a hard reset to a replayed configuration
+    UInt64 lastFullSetupTime;   // nanoseconds from a hard reset to a full configuration
+};
+
+struct BluetoothIntelTeardownStatistics
+{
+    UInt32 teardowns;
+    UInt32 expired;             // teardowns that hit kIntelTeardownTimeout or a command failure
+    UInt32 skippedCommands;     // commands not sent after the deadline passed or an earlier one failed
+    UInt64 lastLatency;         // nanoseconds spent before super::stop
+    UInt64 worstLatency;        // nanoseconds
+};
+
+struct BluetoothIntelRequestPoolStatistics
+{
+    UInt32 hits;                // leases served from the pool
+    UInt32 misses;              // leases that had to create a request
+    UInt32 discarded;           // requests deleted on release, the pool being full, draining or the request failed
+    UInt32 leaked;              // leases still held when their controller was freed
+};
+
+struct BluetoothIntelRadioToggleStatistics
+{
+    UInt32 fastToggles;         // radio brought back from SW RF kill
+    UInt32 fullToggles;         // radio brought back by a full setup
+    UInt32 fallbacks;           // SW RF kill rejected, or the controller came back changed
+    UInt64 lastFastLatency;     // nanoseconds from radio off to ready over SW RF kill
+    UInt64 lastFullLatency;     // nanoseconds from radio off to ready over a full setup
+};
+
+struct BluetoothIntelFirmwareUpgrade
+{
+    bool   pending;
+    UInt8  runningBuildNumber;      // firmware the controller kept running
+    UInt8  runningBuildWeek;
+    UInt8  runningBuildYear;
+    UInt8  availableBuildNumber;    // firmware file waiting to be loaded
+    UInt8  availableBuildWeek;
+    UInt8  availableBuildYear;
+    UInt32 idleChecks;              // idle windows looked for since the upgrade was deferred
+    UInt64 deferredTime;            // nanoseconds the upgrade has been pending
+};
+
+struct BluetoothIntelWarmResumeStatistics
+{
+    UInt32 resumes;
+    UInt32 fallbacks;       // fingerprint mismatches and failed warm resumes
+    UInt64 lastLatency;     // nanoseconds, from SetupController to ready
+    UInt64 maxLatency;      // nanoseconds
+};
+
+struct BluetoothIntelWaitStatistics
+{
+    UInt32 samples;         // waits ended by their signal since the last timeout
+    UInt32 timeouts;
+    UInt64 lastObserved;    // nanoseconds
+    UInt64 maxObserved;     // nanoseconds, since the last timeout
+    UInt64 timeSaved;       // nanoseconds, against the fixed delays and deadlines
+};
+
+struct BluetoothIntelIdentityCacheEntry
+{
+    UInt32 epoch;       // mIdentityEpoch when the response was read
+    bool   valid;
+};
+
 struct BluetoothIntelSecureSendResultEventParams
 {
     UInt8  result;
@@ -367,6 +921,265 @@ struct BluetoothIntelExceptionInfo
     char info[12];
 } __attribute__((packed));
 
+typedef enum
+{
+    kBluetoothIntelResponseLayoutRaw,           // copied as is, there is no status
+    kBluetoothIntelResponseLayoutNone,          // nothing to decode
+    kBluetoothIntelResponseLayoutStatus,        // a status, anything after it is ignored
+    kBluetoothIntelResponseLayoutStatusData     // a status followed by minSize to maxSize bytes
+} BluetoothIntelResponseLayout;
+
+struct BluetoothIntelOpCodeInfo
+{
+    UInt16 ocf;
+    BluetoothHCIEventCode completeEvent;        // Command Complete or Command Status, 0 leaves the command to the family
+    BluetoothHCIEventCode explicitEvent;        // an event that has to follow, or 0
+    BluetoothIntelResponseLayout layout;
+    UInt16 minSize;                             // return parameters after the status
+    UInt16 maxSize;
+    UInt32 timeout;                             // milliseconds, 0 keeps the timeout of the request
+};
+
+#define kIntelResponseMaxSize             (kIntelCommandMaxParamLength - 1)
+#define kIntelCommandTimeout              2000  // milliseconds
+
+/* Everything known about each Intel vendor command, by OCF: the events
+ * that complete it, how its return parameters are decoded and how long
+ * it may take. Fixed layouts are the packed structures the callers read
+ * back. A command missing here is left to the family and its response
+ * passed through as is.
+ */
+inline constexpr BluetoothIntelOpCodeInfo kBluetoothIntelOpCodeTable[] =
+{
+    { kBluetoothHCIIntelCommandReset,               kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandReadVersionInfo,     kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatusData, 0,                                     kIntelResponseMaxSize,                 kIntelCommandTimeout }, // the legacy structure or TLVs
+    { kBluetoothHCIIntelCommandSecureSend,          kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandReadBootParams,      kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatusData, sizeof(BluetoothIntelBootParams),      sizeof(BluetoothIntelBootParams),      0                    },
+    { kBluetoothHCIIntelCommandWriteBootParams,     0,                                 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandManufacturerMode,    kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandReadExceptionInfo,   0,                                 0,                                kBluetoothIntelResponseLayoutStatusData, sizeof(BluetoothIntelExceptionInfo),   sizeof(BluetoothIntelExceptionInfo),   0                    },
+    { kBluetoothHCIIntelCommandWriteBDData,         kBluetoothHCIEventCommandStatus,   kBluetoothHCIEventVendorSpecific, kBluetoothIntelResponseLayoutNone,       0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandWriteDeviceAddress,  0,                                 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandSWRFKill,            0,                                 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandActivateTraces,      0,                                 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandSetEventMask,        kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     kIntelCommandTimeout },
+    { 0x0060,                                       kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandReadOffloadUseCases, kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatusData, sizeof(BluetoothIntelOffloadUseCases), sizeof(BluetoothIntelOffloadUseCases), kIntelCommandTimeout },
+    { kBluetoothHCIIntelCommandWriteConfigDDC,      kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandReadConfigDDC,       kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatusData, sizeof(UInt8) + sizeof(UInt16),        kIntelResponseMaxSize,                 kIntelCommandTimeout }, // Length, DDC ID, value, as Write Config DDC takes it
+    { kBluetoothHCIIntelCommandWriteMemory,         kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     0                    },
+    { kBluetoothHCIIntelCommandSetLinkStatsTracing, kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatus,     0,                                     0,                                     kIntelCommandTimeout },
+    { kBluetoothHCIIntelCommandReadDebugFeatures,   kBluetoothHCIEventCommandComplete, 0,                                kBluetoothIntelResponseLayoutStatusData, sizeof(BluetoothIntelDebugFeatures),   sizeof(BluetoothIntelDebugFeatures),   kIntelCommandTimeout }
+};
+
+constexpr bool IntelOpCodeTableIsValid()
+{
+    for ( const BluetoothIntelOpCodeInfo & info : kBluetoothIntelOpCodeTable )
+    {
+        if ( info.ocf >= kIntelOpCodeIndexSize || info.minSize > info.maxSize || info.maxSize > kIntelResponseMaxSize )
+            return false;
+        if ( info.layout != kBluetoothIntelResponseLayoutStatusData && info.maxSize )
+            return false;
+    }
+    return true;
+}
+
+static_assert(IntelOpCodeTableIsValid(), "An Intel opcode entry is out of the index or its response does not fit a Command Complete event");
+
+struct BluetoothIntelOpCodeIndex
+{
+    UInt8 rows[kIntelOpCodeIndexSize];
+
+    constexpr BluetoothIntelOpCodeIndex() : rows()
+    {
+        for ( int i = 0; i < kIntelOpCodeIndexSize; ++i )
+            rows[i] = kIntelOpCodeNone;
+        for ( UInt8 i = 0; i < sizeof(kBluetoothIntelOpCodeTable) / sizeof(kBluetoothIntelOpCodeTable[0]); ++i )
+            rows[kBluetoothIntelOpCodeTable[i].ocf] = i;
+    }
+};
+
+inline constexpr BluetoothIntelOpCodeIndex kBluetoothIntelOpCodeIndex;
+
+static inline const BluetoothIntelOpCodeInfo * IntelLookupVendorCommand(UInt16 ocf)
+{
+    if ( ocf >= kIntelOpCodeIndexSize || kBluetoothIntelOpCodeIndex.rows[ocf] == kIntelOpCodeNone )
+        return NULL;
+    return &kBluetoothIntelOpCodeTable[kBluetoothIntelOpCodeIndex.rows[ocf]];
+}
+
+static inline const BluetoothIntelOpCodeInfo * IntelLookupOpCode(BluetoothHCICommandOpCode opCode)
+{
+    if ( (opCode >> 10) != kBluetoothHCICommandGroupVendorSpecific )
+        return NULL;
+    return IntelLookupVendorCommand(opCode & 0x03FF);
+}
+
+/* Command latencies are kept per vendor command of the registry, with
+ * one more slot shared by all other HCI commands.
+ */
+#define kIntelCommandLatencySlots         (sizeof(kBluetoothIntelOpCodeTable) / sizeof(kBluetoothIntelOpCodeTable[0]) + 1)
+
+static inline UInt32 IntelLookupCommandLatencySlot(BluetoothHCICommandOpCode opCode)
+{
+    const BluetoothIntelOpCodeInfo * info = IntelLookupOpCode(opCode);
+
+    if ( !info )
+        return kIntelCommandLatencySlots - 1;
+    return (UInt32) (info - kBluetoothIntelOpCodeTable);
+}
+
+static inline UInt32 IntelLatencyHistogramBucket(UInt64 latency)
+{
+    UInt32 bucket = latency ? 64 - __builtin_clzll(latency) : 0;
+
+    return bucket < kIntelLatencyHistogramBuckets ? bucket : kIntelLatencyHistogramBuckets - 1;
+}
+
+/* Updated with atomic operations from every thread sending a command. */
+struct BluetoothIntelCommandLatency
+{
+    volatile SInt32 count;
+    volatile SInt32 timeouts;
+    volatile SInt32 errors;     // completed with an error status
+    volatile UInt64 maxLatency; // microseconds
+    volatile SInt32 buckets[kIntelLatencyHistogramBuckets];
+};
+
+enum BluetoothIntelCommandLane
+{
+    kBluetoothIntelCommandLaneInteractive,  // connection, SCO and encryption setup
+    kBluetoothIntelCommandLaneNormal,
+    kBluetoothIntelCommandLaneBackground,   // diagnostics and telemetry
+    kBluetoothIntelCommandLaneCount
+};
+
+static inline BluetoothIntelCommandLane IntelLookupCommandLane(BluetoothHCICommandOpCode opCode)
+{
+    switch ( opCode )
+    {
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLinkControl, kBluetoothHCICommandCreateConnection):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLinkControl, kBluetoothHCICommandAcceptConnectionRequest):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLinkControl, kBluetoothHCICommandSetupSynchronousConnection):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLinkControl, kBluetoothHCICommandAcceptSynchronousConnectionRequest):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLinkControl, kBluetoothHCICommandEnhancedSetupSynchronousConnection):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLinkControl, kBluetoothHCICommandEnhancedAcceptSynchronousConnectionRequest):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLECreateConnection):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLEStartEncryption):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLELongTermKeyRequestReply):
+            return kBluetoothIntelCommandLaneInteractive;
+
+        /* Read Exception Info stays in the normal lane: it is sent from
+         * the workloop on a Hardware Error, which must not wait for
+         * interactive commands.
+         */
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupVendorSpecific, kBluetoothHCIIntelCommandActivateTraces):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupVendorSpecific, kBluetoothHCIIntelCommandSetLinkStatsTracing):
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupVendorSpecific, kBluetoothHCIIntelCommandReadDebugFeatures):
+            return kBluetoothIntelCommandLaneBackground;
+
+        default:
+            return kBluetoothIntelCommandLaneNormal;
+    }
+}
+
+struct BluetoothIntelAsyncLaneEntry
+{
+    BluetoothHCICommandOpCode opCode;
+    BluetoothIntelCommandLane lane;
+    bool   valid;
+    UInt64 waitTime;    // nanoseconds held back
+    UInt64 enqueueTime; // absolute time
+};
+
+struct BluetoothIntelCommandLaneStatistics
+{
+    UInt32 commands;
+    UInt32 yields;              // background commands held back behind interactive ones
+    UInt64 waitTime;            // nanoseconds held back
+    UInt64 maxWaitTime;         // nanoseconds
+    UInt64 latency;             // nanoseconds from the enqueue to the completion
+};
+
+struct BluetoothIntelProcessAccounting
+{
+    int    PID;
+    char   name[MAXCOMLEN + 1];
+    bool   valid;
+    UInt32 commands;            // all counters decay, see kIntelProcessAccountingHalfLife
+    UInt32 timeouts;
+    UInt64 bytes;               // command packets, headers included
+    UInt64 controllerTime;      // nanoseconds from the enqueue to the completion of synchronous requests
+};
+
+enum BluetoothIntelCommandCacheSlot
+{
+    kBluetoothIntelCommandCacheSlotSetEventMask,
+    kBluetoothIntelCommandCacheSlotSetEventMaskPageTwo,
+    kBluetoothIntelCommandCacheSlotLESetEventMask,
+    kBluetoothIntelCommandCacheSlotLESetAdvertisingData,
+    kBluetoothIntelCommandCacheSlotLESetScanResponseData,
+    kBluetoothIntelCommandCacheSlotIntelSetEventMask,
+    kBluetoothIntelCommandCacheSlotCount
+};
+
+/* Commands that leave the controller in the same state however often
+ * they are repeated with the same parameters, and only return a status.
+ * LE Set Scan Parameters is not one of them: it is disallowed while
+ * scanning is enabled, and a cached success would hide that.
+ */
+static inline BluetoothIntelCommandCacheSlot IntelLookupCommandCacheSlot(BluetoothHCICommandOpCode opCode)
+{
+    switch ( opCode )
+    {
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupHostController, kBluetoothHCICommandSetEventMask):
+            return kBluetoothIntelCommandCacheSlotSetEventMask;
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupHostController, kBluetoothHCICommandSetEventMaskPageTwo):
+            return kBluetoothIntelCommandCacheSlotSetEventMaskPageTwo;
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLESetEventMask):
+            return kBluetoothIntelCommandCacheSlotLESetEventMask;
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLESetAdvertisingData):
+            return kBluetoothIntelCommandCacheSlotLESetAdvertisingData;
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupLowEnergy, kBluetoothHCICommandLESetScanResponseData):
+            return kBluetoothIntelCommandCacheSlotLESetScanResponseData;
+        case BluetoothHCIMakeCommandOpCode(kBluetoothHCICommandGroupVendorSpecific, kBluetoothHCIIntelCommandSetEventMask):
+            return kBluetoothIntelCommandCacheSlotIntelSetEventMask;
+        default:
+            return kBluetoothIntelCommandCacheSlotCount;
+    }
+}
+
+struct BluetoothIntelCommandCacheEntry
+{
+    bool  valid;
+    UInt8 paramSize;
+    UInt8 params[kIntelCommandCacheMaxParamLength];
+};
+
+struct BluetoothIntelCommandCacheStatistics
+{
+    UInt32 roundTripsSaved;     // repeats completed without the controller
+    UInt32 misses;              // cacheable commands sent to the controller
+    UInt32 invalidations;
+};
+
+/* The return parameters of a vendor command as the controller sent
+ * them, status included.
+ */
+struct BluetoothIntelRecordedResponse
+{
+    UInt16 ocf;
+    UInt8  size;
+    UInt8  data[kIntelCommandMaxParamLength];
+};
+
+struct BluetoothIntelResponseDecodingStatistics
+{
+    UInt32 samples;             // responses decoded
+    UInt32 rejected;            // responses failing the bounds checks
+    UInt64 decodeTime;          // nanoseconds per response
+};
+
 #define IntelCNVXExtractHardwarePlatform(cnvx)      ((UInt8)(((cnvx) & 0x0000ff00) >> 8))
 #define IntelCNVXExtractHardwareVariant(cnvx)       ((UInt8)(((cnvx) & 0x003f0000) >> 16))
 #define IntelCNVXTopExtractType(cnvxTop)            ((cnvxTop) & 0x00000fff)
@@ -270,7 +270,8 @@ INVALID_EVENT_READ:
         return kIOReturnError;
     }
 
-    err = controller->HCIRequestCreate(&id);
+    IntelBluetoothHCIRequestLease lease(controller);
+    err = lease.Acquire(&id);
     if ( err )
     {
         REQUIRE_NO_ERR(err);
@@ -278,7 +279,7 @@ INVALID_EVENT_READ:
         return err;
     }
     err = controller->SendRawHCICommand(id, (char *) &cmd, cmd.dataSize + kBluetoothHCICommandPacketHeaderSize, NULL, 0);
-    controller->HCIRequestDelete(NULL, id);
+    lease.Release();
     if ( err )
     {
         os_log(mInternalOSLogObject, "**** [IntelGen1BluetoothHostControllerUSBTransport][PatchFirmware] ### ERROR: opCode = 0x%04X -- send request failed -- cannot dispatch patch command: 0x%x ****\n", cmd.opCode, err);
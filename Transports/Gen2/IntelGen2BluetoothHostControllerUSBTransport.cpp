@@ -39,18 +39,15 @@ bool IntelGen2BluetoothHostControllerUSBTransport::start(IOService * provider)
 IOReturn IntelGen2BluetoothHostControllerUSBTransport::GetFirmwareNameWL(void * ver, BluetoothIntelBootParams * params, const char * suffix, char * fwName)
 {
     BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) ver;
+    const BluetoothIntelHardwareVariantInfo * info = IntelLookupHardwareVariant(version->hardwareVariant);
     char firmwareName[64];
     
-    switch ( version->hardwareVariant )
+    switch ( info ? info->naming : kBluetoothIntelFirmwareNamingLegacy )
     {
-        case kBluetoothIntelHardwareVariantSfP:
-        case kBluetoothIntelHardwareVariantWsP:
+        case kBluetoothIntelFirmwareNamingDeviceRevision:
             snprintf(firmwareName, sizeof(firmwareName), "ibt-%u-%u.%s", (UInt16) version->hardwareVariant, (UInt16) params->deviceRevisionID, suffix);
             break;
-        case kBluetoothIntelHardwareVariantJfP:
-        case kBluetoothIntelHardwareVariantThP:
-        case kBluetoothIntelHardwareVariantHrP:
-        case kBluetoothIntelHardwareVariantCcP:
+        case kBluetoothIntelFirmwareNamingHardwareRevision:
             snprintf(firmwareName, sizeof(firmwareName), "ibt-%u-%u-%u.%s", (UInt16) version->hardwareVariant, (UInt16) version->hardwareRevision, (UInt16) version->firmwareRevision, suffix);
             break;
         default:
@@ -68,14 +65,19 @@ IOReturn IntelGen2BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
         return kIOReturnInvalid;
 
     IOReturn err;
-    UInt32 callTime;
+    AbsoluteTime callTime;
+    AbsoluteTime phaseTime;
     BluetoothIntelVersionInfo * version = (BluetoothIntelVersionInfo *) ver;
+    const BluetoothIntelHardwareVariantInfo * info;
     OSData * fwData;
-    BluetoothHCIRequestID id;
 
     if ( !version || !params )
         return kIOReturnInvalid;
 
+    info = IntelLookupHardwareVariant(version->hardwareVariant);
+    if ( !info )
+        return kIOReturnInvalid;
+
     /* Check for valid Bluetooth device address only when the
      * operational firmware is already present, which determines
      * if the device will be added as configured or unconfigured
@@ -93,7 +95,7 @@ IOReturn IntelGen2BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
         /* SfP and WsP don't seem to update the firmware version on file
          * so version checking is currently impossible.
          */
-        if ( version->hardwareVariant == kBluetoothIntelHardwareVariantSfP || version->hardwareVariant == kBluetoothIntelHardwareVariantWsP )
+        if ( !(info->capabilities & kBluetoothIntelCapabilityVersionCheck) )
             return kIOReturnSuccess;
 
         /* Proceed to download to check if the version matches */
@@ -103,14 +105,9 @@ IOReturn IntelGen2BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
     /* Read the secure boot parameters to identify the operating
      * details of the bootloader.
      */
-    err = controller->HCIRequestCreate(&id);
-    if ( err )
-    {
-        REQUIRE_NO_ERR(err);
-        return err;
-    }
-    err = controller->BluetoothHCIIntelReadBootParams(id, params);
-    controller->HCIRequestDelete(NULL, id);
+    phaseTime = mBluetoothFamily->GetCurrentTime();
+    err = controller->CallBluetoothHCIIntelReadBootParams(params);
+    controller->RecordSetupPhase(kBluetoothIntelSetupPhaseReadBootParams, phaseTime);
     if ( err )
         return err;
 
@@ -156,7 +153,9 @@ download:
      *
      */
     
+    phaseTime = mBluetoothFamily->GetCurrentTime();
     err = GetFirmware(version, params, "sfi", &fwData);
+    controller->RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareLookup, phaseTime);
     if ( err )
     {
         if ( !controller->mBootloaderMode )
@@ -183,22 +182,17 @@ download:
     /* SfP and WsP don't seem to update the firmware version on file
      * so version checking is currently not possible.
      */
-    switch ( version->hardwareVariant )
+    if ( info->capabilities & kBluetoothIntelCapabilityVersionCheck )
     {
-        case kBluetoothIntelHardwareVariantSfP:
-        case kBluetoothIntelHardwareVariantWsP:
-            /* Skip version checking */
-            break;
-        default:
-            /* Skip download if firmware has the same version */
-            if ( controller->CheckFirmwareVersion(version->firmwareBuildNum, version->firmwareBuildWeek, version->firmwareBuildYear, fwData, bootAddress) )
-            {
-                os_log(mInternalOSLogObject, "**** [IntelGen2BluetoothHostControllerUSBTransport][DownloadFirmware] -- Firmware already loaded! ****\n");
-                controller->mDownloading = false;
-                controller->mFirmwareLoaded = true;
-                setProperty("FirmwareLoaded", true);
-                return kIOReturnSuccess;
-            }
+        /* Skip download if firmware has the same version */
+        if ( controller->CheckFirmwareVersion(version->firmwareBuildNum, version->firmwareBuildWeek, version->firmwareBuildYear, fwData, bootAddress) )
+        {
+            os_log(mInternalOSLogObject, "**** [IntelGen2BluetoothHostControllerUSBTransport][DownloadFirmware] -- Firmware already loaded! ****\n");
+            controller->mDownloading = false;
+            controller->mFirmwareLoaded = true;
+            setProperty("FirmwareLoaded", true);
+            return kIOReturnSuccess;
+        }
     }
 
     /* If the firmware version has changed that means it needs to be reset
@@ -206,11 +200,24 @@ download:
      */
     if ( version->firmwareVariant == kBluetoothHCIIntelFirmwareVariantFirmware )
     {
+        /* Unless the policy defers the upgrade to the next idle window,
+         * in which case the controller comes up on what it runs.
+         */
+        if ( controller->DeferFirmwareUpgrade(version->firmwareBuildNum, version->firmwareBuildWeek, version->firmwareBuildYear) )
+        {
+            controller->mDownloading = false;
+            controller->mFirmwareLoaded = true;
+            setProperty("FirmwareLoaded", true);
+            return kIOReturnSuccess;
+        }
+
         err = controller->ResetToBootloader(true);
         if ( err )
             return err;
     }
 
+    phaseTime = mBluetoothFamily->GetCurrentTime();
+
     err = controller->SecureSendSFIRSAFirmwareHeader(fwData);
     if ( err )
         goto done;
@@ -230,7 +237,9 @@ download:
      * and thus just timeout if that happens and fail the setup
      * of this device.
      */
-    err = controller->WaitForFirmwareDownload(callTime, 5000);
+    controller->RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareDownload, phaseTime);
+
+    err = controller->WaitForFirmwareDownload(callTime, info->firmwareDownloadTimeout);
     if ( err == kIOReturnTimeout )
     {
 done:
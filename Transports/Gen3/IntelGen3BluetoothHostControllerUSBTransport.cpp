@@ -154,14 +154,20 @@ IOReturn IntelGen3BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
         return kIOReturnInvalid;
 
     IOReturn err;
-    UInt32 callTime;
+    AbsoluteTime callTime;
+    AbsoluteTime phaseTime;
     BluetoothIntelVersionInfoTLV * version = (BluetoothIntelVersionInfoTLV *) ver;
+    const BluetoothIntelHardwareVariantInfo * info;
     OSData * fwData;
     UInt32 cssHeaderVersion;
     
     if ( !version || !bootAddress )
         return kIOReturnInvalid;
 
+    info = IntelLookupHardwareVariant(IntelCNVXExtractHardwareVariant(version->cnviBT));
+    if ( !info || !info->secureBootEngines )
+        return kIOReturnInvalid;
+
     /* The firmware variant determines if the device is in bootloader
      * mode or is running operational firmware. The value 0x03 identifies
      * the bootloader and the value 0x23 identifies the operational
@@ -191,7 +197,9 @@ IOReturn IntelGen3BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
         controller->mInvalidDeviceAddress = true;
     }
 
+    phaseTime = mBluetoothFamily->GetCurrentTime();
     err = GetFirmware(version, NULL, "sfi", &fwData);
+    controller->RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareLookup, phaseTime);
     if ( err )
     {
         if ( !controller->mBootloaderMode )
@@ -235,10 +243,23 @@ IOReturn IntelGen3BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
      */
     if ( version->imageType == kBluetoothHCIIntelImageTypeFirmware )
     {
+        /* Unless the policy defers the upgrade to the next idle window,
+         * in which case the controller comes up on what it runs.
+         */
+        if ( controller->DeferFirmwareUpgrade(version->firmwareBuildNumber, version->firmwareBuildWeek, version->firmwareBuildYear) )
+        {
+            controller->mDownloading = false;
+            controller->mFirmwareLoaded = true;
+            setProperty("FirmwareLoaded", true);
+            return kIOReturnSuccess;
+        }
+
         err = controller->ResetToBootloader(true);
         if ( err )
             return err;
     }
+
+    phaseTime = mBluetoothFamily->GetCurrentTime();
     
     /* iBT hardware variants 0x0b, 0x0c, 0x11, 0x12, 0x13, 0x14 support
      * only RSA secure boot engine. Hence, the corresponding sfi file will
@@ -260,7 +281,7 @@ IOReturn IntelGen3BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
         goto done;
     }
     
-    if ( IntelCNVXExtractHardwareVariant(version->cnviBT) <= 0x14 )
+    if ( !(info->secureBootEngines & kBluetoothIntelSecureBootEngineECDSA) )
     {
         if ( version->sbeType != 0x00 )
         {
@@ -277,7 +298,7 @@ IOReturn IntelGen3BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
         if ( err )
             goto done;
     }
-    else if ( IntelCNVXExtractHardwareVariant(version->cnviBT) >= 0x17 )
+    else
     {
         /* Check if CSS header for ECDSA follows the RSA header */
         if ( ((UInt8 *) fwData->getBytesNoCopy())[kIntelECDSAOffset] != 0x06 )
@@ -324,7 +345,9 @@ IOReturn IntelGen3BluetoothHostControllerUSBTransport::DownloadFirmwareWL(void *
      * and thus just timeout if that happens and fail the setup
      * of this device.
      */
-    err = controller->WaitForFirmwareDownload(callTime, 5000);
+    controller->RecordSetupPhase(kBluetoothIntelSetupPhaseFirmwareDownload, phaseTime);
+
+    err = controller->WaitForFirmwareDownload(callTime, info->firmwareDownloadTimeout);
     if ( err == kIOReturnTimeout )
     {
 done:
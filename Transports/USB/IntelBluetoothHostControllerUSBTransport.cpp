@@ -97,42 +97,90 @@ bool IntelBluetoothHostControllerUSBTransport::start(IOService * provider)
 
 void IntelBluetoothHostControllerUSBTransport::stop(IOService * provider)
 {
-    IOReturn err;
-    BluetoothHCIRequestID id;
+    IOReturn err = kIOReturnSuccess;
+    BluetoothHCICommandOpCode opCodes[kIntelMaxTeardownCommands];
+    UInt32 numCommands = 0;
+    UInt32 sent = 0;
+    AbsoluteTime startTime;
+    AbsoluteTime now;
+    UInt64 deadline;
+    UInt64 remaining;
+    UInt64 elapsed;
+    bool expired = false;
 
     IntelBluetoothHostController * controller = OSDynamicCast(IntelBluetoothHostController, mBluetoothController);
-    if ( !controller )
-        return;
 
-    /* Send HCI Reset to the controller to stop any BT activity which
-     * were triggered. This will help to save power and maintain the
-     * sync between Host and controller
-     */
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_11_0
-    if ( controller->CallBluetoothHCIReset(false, (char *) __FUNCTION__) )
-#else
-    if ( controller->CallBluetoothHCIReset(false) )
-#endif
-        return;
+    startTime = mach_absolute_time();
+    clock_interval_to_deadline(kIntelTeardownTimeout, kMillisecondScale, &deadline);
+
+    if ( controller )
+    {
+        /* Send HCI Reset to the controller to stop any BT activity which
+         * were triggered. This will help to save power and maintain the
+         * sync between Host and controller
+         */
+        opCodes[numCommands++] = 0x0C03;
+
+        /* Legacy ROM devices have an issue with BT LED when the interface
+         * is down or BT radio is turned off, which takes 5 seconds to BT
+         * LED goes off. This command turns off the BT LED immediately.
+         */
+        if ( controller->mGeneration == 1 )
+            opCodes[numCommands++] = 0xFC3F;
+    }
 
-    /* Legacy ROM devices have an issue with BT LED when the interface is
-     * down or BT radio is turned off, which takes 5 seconds to BT LED
-     * goes off. This command turns off the BT LED immediately.
+    /* Nothing answers once the device is gone. Otherwise every command
+     * only gets what is left of one deadline, and a controller that did
+     * not answer one will not answer the next.
      */
-    if ( controller->mGeneration == 1 )
+    if ( !mBluetoothUSBHostDevice || mBluetoothUSBHostDevice->isInactive() )
+        numCommands = 0;
+    while ( sent < numCommands )
     {
-        err = controller->HCIRequestCreate(&id);
+        now = mach_absolute_time();
+        if ( now >= deadline )
+        {
+            expired = true;
+            break;
+        }
+        absolutetime_to_nanoseconds(deadline - now, &remaining);
+
+        err = controller->SendTeardownCommand(opCodes[sent++], (UInt32) (remaining / NSEC_PER_MSEC) + 1);
         if ( err )
         {
-            REQUIRE_NO_ERR(err);
-            return;
+            expired = true;
+            break;
         }
-        controller->BluetoothHCIIntelTurnOffDeviceLED(id);
-        controller->HCIRequestDelete(NULL, id);
     }
+
+    /* A command that timed out may still be queued on the pipes: abort
+     * them right away instead of leaving super::stop to wait on them.
+     */
+    if ( expired )
+        AbortPipesAndClose(true, true);
+
+    absolutetime_to_nanoseconds(mach_absolute_time() - startTime, &elapsed);
+    IntelBluetoothHostController::RecordTeardown(elapsed, expired, numCommands - sent);
+    os_log(mInternalOSLogObject, "**** [IntelBluetoothHostControllerUSBTransport][stop] -- Teardown took %llu usecs, %u of %u commands sent: 0x%x ****\n", elapsed / 1000, sent, numCommands, err);
+
     super::stop(provider);
 }
 
+bool IntelBluetoothHostControllerUSBTransport::willTerminate(IOService * provider, IOOptionBits options)
+{
+    IntelBluetoothHostController * controller = OSDynamicCast(IntelBluetoothHostController, mBluetoothController);
+
+    /* Wake up whoever is waiting on the device, e.g. for it to
+     * re-enumerate after a reset to the bootloader.
+     */
+    if ( controller )
+        controller->TransportWillTerminate();
+    if ( mCommandGate )
+        mCommandGate->commandWakeup(&mConfiguredPM);
+
+    return super::willTerminate(provider, options);
+}
+
 bool IntelBluetoothHostControllerUSBTransport::InitializeTransportWL(IOService * provider)
 {
     if ( !provider )
@@ -293,6 +341,7 @@ FAIL:
             that->mHardResetState = 2;
             that->mBluetoothController->mHardResetPerformed = true;
             os_log(that->mInternalOSLogObject, "**** [IntelBluetoothHostControllerUSBTransport][SecureSendBulkInReadHandler] -- calling HardReset() ****\n");
+            IntelBluetoothHostController::NoteHardReset();
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_15
             that->HardReset();
 #else
@@ -390,6 +439,7 @@ FAIL:
                 that->mBluetoothController->mHardResetPerformed = 1;
                 BluetoothFamilyLogPacket(that->mBluetoothFamily, 248, "Bulk In Read -- Hardware Reset");
                 os_log(that->mInternalOSLogObject, "**** [IntelBluetoothHostControllerUSBTransport][SecureSendBulkInReadHandler] -- calling HardReset() ****\n");
+                IntelBluetoothHostController::NoteHardReset();
 #if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_15
                 that->HardReset();
 #else
@@ -471,6 +521,11 @@ bool IntelBluetoothHostControllerUSBTransport::SupportNewIdlePolicy()
 
 IOReturn IntelBluetoothHostControllerUSBTransport::CallPowerManagerChangePowerStateTo(unsigned long ordinal, char * name)
 {
+    IntelBluetoothHostController * controller = OSDynamicCast(IntelBluetoothHostController, mBluetoothController);
+
+    if ( controller )
+        controller->InvalidateCommandCache("Power State Change");
+
     if ( mBluetoothController )
     {
         mBluetoothController->SetChangingPowerState(true);
@@ -495,8 +550,6 @@ IOReturn IntelBluetoothHostControllerUSBTransport::CallPowerManagerChangePowerSt
 bool IntelBluetoothHostControllerUSBTransport::ConfigurePM(IOService * policyMaker)
 {
     IOService * provider;
-    int err;
-    uint8_t i;
 
     if ( !mBluetoothUSBHostDevice )
       goto CONFIG_PM;
@@ -527,23 +580,22 @@ CONFIG_PM:
         mConrollerTransportType = kBluetoothTransportTypeUSB;
     }
 
+    /* Sleep once until the power management callback wakes us up or
+     * the transport terminates, instead of polling. The give-up is not
+     * learned: forcing mConfiguredPM early would start the device
+     * before power management is set up.
+     */
     if ( !mConfiguredPM && mCommandGate )
     {
-        for (i = 0; i < 100; ++i)
-        {
-            err = TransportCommandSleep(&mConfiguredPM, 300, (char *) __FUNCTION__, true);
+        TransportCommandSleep(&mConfiguredPM, kIntelConfigurePMTimeout, (char *) __FUNCTION__, true);
 
-            if ( isInactive() || mConfiguredPM )
-                goto OVER;
-
-            if ( err == THREAD_AWAKENED || (err == THREAD_TIMED_OUT && mConfiguredPM) )
-                goto OVER;
+        if ( !mConfiguredPM && !isInactive() )
+        {
+            os_log(mInternalOSLogObject, "**** [IntelBluetoothHostControllerUSBTransport][ConfigurePM] -- ERROR -- waited %u ms and still did not get the commandWakeup() notification -- 0x%04x ****\n", kIntelConfigurePMTimeout, ConvertAddressToUInt32(this));
+            mConfiguredPM = true;
         }
-        os_log(mInternalOSLogObject, "**** [IntelBluetoothHostControllerUSBTransport][ConfigurePM] -- ERROR -- waited 30 seconds and still did not get the commandWakeup() notification -- 0x%04x ****\n", ConvertAddressToUInt32(this));
-        mConfiguredPM = true;
     }
 
-OVER:
     BluetoothFamilyLogPacket(mBluetoothFamily, 251, "USB Low Power");
     changePowerStateTo(1);
     ReadyToGo(mConfiguredPM);